@@ -0,0 +1,281 @@
+/* admission.c
+ * Admission control, modelled on CoDel. What is watched is the time a
+ * session spends storing an accepted message (spooling, delivery to
+ * the mailboxes, queueing for relay), and the number of messages
+ * being stored at once.
+ *
+ * Storage is overloaded when the store latency has stayed above the
+ * target for a whole interval; short bursts are absorbed. While it is
+ * overloaded, new transactions are refused with a 451 at increasing
+ * frequency (the n-th refusal comes interval/sqrt(n) after the
+ * previous one), which sheds just enough load to bring the latency
+ * back down, and the server stops accepting new connections. As soon
+ * as a store completes under the target, or no store has completed
+ * for an interval, the overload ends. Independently of latency, a
+ * transaction is refused with a 452 while the maximum number of
+ * messages is being stored.
+ *
+ * The state is kept in shared memory, so that it covers all the
+ * processes of a forking server. Each message being stored holds a
+ * slot with the pid of its process; the slots of processes that died
+ * while storing (crashed or killed) are reclaimed when the limit is
+ * reached, so that they cannot keep the server paused. A paused server
+ * waits for the pause to end on a pipe that is written to when a store
+ * ends it, or until the overload is due to expire.
+ */
+
+#include "admission.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define ADMISSION_DEFAULT_TARGET   100   // ms of store latency
+#define ADMISSION_DEFAULT_INTERVAL 1000  // ms
+#define ADMISSION_DEFAULT_STORING  64    // messages being stored at once
+#define ADMISSION_EXTRA_SLOTS      64    // for stores admitted past the limit
+
+struct admission {
+    pthread_mutex_t lock;
+    uint64_t target_ns;
+    uint64_t interval_ns;
+    int      max_storing;
+    int      storing;           // messages being stored right now
+    uint64_t last_sample;       // time of the last completed store
+    uint64_t first_above;       // when latency may count as standing, or 0
+    int      overloaded;
+    uint64_t drop_next;         // time of the next refusal while overloaded
+    unsigned drop_count;
+    int      nslots;
+    struct store {
+        pid_t    pid;           // 0 for a free slot
+        uint64_t start;
+    } slots[];
+};
+
+static struct admission *adm = NULL;
+static int wake_pipe[2] = { -1, -1 };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void lock_state(void) {
+    if (pthread_mutex_lock(&adm->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&adm->lock);
+}
+
+/** Enables admission control.
+ *
+ *  Parameters: spec: "TARGET_MS[,INTERVAL_MS[,MAX_STORING]]".
+ *
+ *  Returns: 0 on success, -1 on failure.
+ */
+int admission_init(const char *spec) {
+    long target = ADMISSION_DEFAULT_TARGET, interval = ADMISSION_DEFAULT_INTERVAL;
+    long storing = ADMISSION_DEFAULT_STORING;
+    pthread_mutexattr_t attr;
+    char *end;
+
+    target = strtol(spec, &end, 10);
+    if (*end == ',')
+        interval = strtol(end + 1, &end, 10);
+    if (*end == ',')
+        storing = strtol(end + 1, &end, 10);
+    if (*end || target <= 0 || interval <= 0 || storing <= 0)
+        return -1;
+
+    // Several sessions may pass the check before any of them begins
+    // storing, so there are slots for more than the limit
+    int nslots = storing + ADMISSION_EXTRA_SLOTS;
+    adm = mmap(NULL, sizeof(struct admission) + nslots * sizeof(struct store),
+               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (adm == MAP_FAILED) {
+        adm = NULL;
+        return -1;
+    }
+    if (pipe(wake_pipe) == -1 ||
+        fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) == -1 || fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC) == -1) {
+        munmap(adm, sizeof(struct admission) + nslots * sizeof(struct store));
+        adm = NULL;
+        return -1;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&adm->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    adm->target_ns = target * 1000000ull;
+    adm->interval_ns = interval * 1000000ull;
+    adm->max_storing = storing;
+    adm->nslots = nslots;
+    return 0;
+}
+
+/** Gives back the slots of processes that died while storing. Called
+ *  with the lock held, only when the limit is reached.
+ */
+static void reclaim_slots(void) {
+    for (int i = 0; i < adm->nslots; i++)
+        if (adm->slots[i].pid && kill(adm->slots[i].pid, 0) < 0 && errno == ESRCH) {
+            dlog("admission: process %d died while storing\n", (int) adm->slots[i].pid);
+            adm->slots[i].pid = 0;
+            adm->storing--;
+        }
+}
+
+static int is_full(void) {
+    if (adm->storing >= adm->max_storing)
+        reclaim_slots();
+    return adm->storing >= adm->max_storing;
+}
+
+/** Ends an overload that has had no samples for an interval: nothing
+ *  is being stored, so there is no evidence of a standing queue left.
+ *  Called with the lock held.
+ */
+static void expire_overload(uint64_t now) {
+    if (adm->overloaded && now - adm->last_sample > adm->interval_ns) {
+        adm->overloaded = 0;
+        adm->first_above = 0;
+        dlog("admission: overload over (idle)\n");
+    }
+}
+
+/** Decides whether a new transaction may start.
+ *
+ *  Returns: Admit_ok, or Admit_busy / Admit_full if it should get a
+ *           451 / 452 reply.
+ */
+Admit_result admission_check(void) {
+    Admit_result result = Admit_ok;
+    uint64_t now;
+
+    if (!adm)
+        return Admit_ok;
+    now = now_ns();
+    lock_state();
+    expire_overload(now);
+    if (is_full()) {
+        result = Admit_full;
+    } else if (adm->overloaded && now >= adm->drop_next) {
+        result = Admit_busy;
+        adm->drop_count++;
+        adm->drop_next = now + adm->interval_ns / sqrt(adm->drop_count);
+    }
+    pthread_mutex_unlock(&adm->lock);
+    return result;
+}
+
+/** Checks whether new connections should not be accepted for now.
+ *
+ *  Returns: -1 if they may be accepted, otherwise the number of
+ *           milliseconds after which to check again: when the overload
+ *           is due to expire, or at most an interval. A store that ends
+ *           the pause earlier makes admission_wake_fd() readable.
+ */
+int admission_pause_ms(void) {
+    uint64_t now, wait;
+    int paused;
+
+    if (!adm)
+        return -1;
+    now = now_ns();
+    lock_state();
+    expire_overload(now);
+    paused = is_full() || adm->overloaded;
+    wait = adm->interval_ns;
+    if (adm->overloaded && adm->last_sample + adm->interval_ns - now < wait)
+        wait = adm->last_sample + adm->interval_ns - now;
+    pthread_mutex_unlock(&adm->lock);
+    if (!paused)
+        return -1;
+    return wait / 1000000 + 1;
+}
+
+/** Returns 1 if new connections should not be accepted for now. */
+int admission_paused(void) {
+    return admission_pause_ms() >= 0;
+}
+
+/** Returns a descriptor that becomes readable when a pause may have
+ *  ended, or -1 if admission control is off. The caller drains it.
+ */
+int admission_wake_fd(void) {
+    return adm ? wake_pipe[0] : -1;
+}
+
+/** Marks the start of storing a message.
+ *
+ *  Returns: the start time, to be passed to admission_store_end().
+ */
+uint64_t admission_store_begin(void) {
+    uint64_t start = now_ns();
+
+    if (!adm)
+        return 0;
+    lock_state();
+    // Without a free slot, the store goes unaccounted
+    for (int i = 0; i < adm->nslots; i++)
+        if (!adm->slots[i].pid) {
+            adm->slots[i].pid = getpid();
+            adm->slots[i].start = start;
+            adm->storing++;
+            break;
+        }
+    pthread_mutex_unlock(&adm->lock);
+    return start;
+}
+
+/** Marks the end of storing a message, and takes its latency as a
+ *  sample.
+ */
+void admission_store_end(uint64_t start) {
+    uint64_t now, latency;
+
+    if (!adm)
+        return;
+    now = now_ns();
+    latency = now - start;
+    pid_t pid = getpid();
+    lock_state();
+    int paused = adm->overloaded || adm->storing >= adm->max_storing;
+    for (int i = 0; i < adm->nslots; i++)
+        if (adm->slots[i].pid == pid && adm->slots[i].start == start) {
+            adm->slots[i].pid = 0;
+            adm->storing--;
+            break;
+        }
+    adm->last_sample = now;
+    if (latency < adm->target_ns) {
+        if (adm->overloaded)
+            dlog("admission: overload over\n");
+        adm->first_above = 0;
+        adm->overloaded = 0;
+    } else if (!adm->first_above) {
+        adm->first_above = now + adm->interval_ns;
+    } else if (now >= adm->first_above && !adm->overloaded) {
+        dlog("admission: overloaded, store latency %llums\n",
+             (unsigned long long) (latency / 1000000));
+        adm->overloaded = 1;
+        adm->drop_count = 1;
+        adm->drop_next = now;
+    }
+    if (paused && !adm->overloaded && adm->storing < adm->max_storing)
+        if (write(wake_pipe[1], "", 1) < 0) {
+            // full: the paused processes have a wakeup pending already
+        }
+    pthread_mutex_unlock(&adm->lock);
+}
@@ -0,0 +1,26 @@
+/* admission.h
+ * Admission control: tempfails new transactions and pauses accepting
+ * connections while message storage is overloaded.
+ */
+
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <stdint.h>
+
+typedef enum admit_result
+{
+    Admit_ok,
+    Admit_busy,      // storage latency is too high: 451
+    Admit_full       // too many messages being stored: 452
+} Admit_result;
+
+int          admission_init(const char *spec);
+Admit_result admission_check(void);
+int          admission_paused(void);
+int          admission_pause_ms(void);
+int          admission_wake_fd(void);
+uint64_t     admission_store_begin(void);
+void         admission_store_end(uint64_t start);
+
+#endif
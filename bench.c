@@ -0,0 +1,389 @@
+/* bench.c
+ * Microbenchmarks for the building blocks of the server: line reading
+ * from a socket, command splitting and dispatch, user lookup and mail
+ * storage, and DKIM body hashing.
+ *
+ * Every benchmark runs in its own child process inside a scratch
+ * directory, since the mail storage functions work on fixed paths
+ * relative to the current directory and keep the users file open
+ * between calls.
+ *
+ * Results are printed one per line as tab-separated
+ *     name  ns/op  iterations
+ * and, if a baseline file in the same format is given, each result is
+ * compared to it and any benchmark slower than the baseline by more
+ * than the threshold is flagged and makes the program exit with 1. A
+ * missing baseline file, a benchmark that fails to run and a result
+ * that the baseline has no entry for are errors too.
+ *
+ * Usage: microbench [-b baseline] [-t threshold-percent] [-o output] [filter]
+ */
+
+#include "mysmtpd.h"
+#include "netbuffer.h"
+#include "mailuser.h"
+#include "util.h"
+#include "dkim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MIN_BENCH_NS 200000000ull  // run each benchmark for at least 0.2s
+#define MAX_NAME 64
+#define MAX_RESULTS 64
+
+typedef void (*bench_fn)(long iters, long arg);
+
+struct result {
+    char   name[MAX_NAME];
+    double ns_per_op;
+    long   iters;
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------ */
+/* Benchmarks. Each one performs the operation iters times.           */
+
+static void bench_read_line(long iters, long linelen) {
+    int sv[2];
+    const int per_batch = 64;
+    char line[1024], out[1024 + 1], batch[per_batch * sizeof(line)];
+    size_t blen = 0;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    memset(line, 'a', linelen - 2);
+    memcpy(line + linelen - 2, "\r\n", 2);
+    for (int i = 0; i < per_batch; i++) {
+        memcpy(batch + blen, line, linelen);
+        blen += linelen;
+    }
+
+    net_buffer_t nb = nb_create(sv[1], 1024);
+    for (long done = 0; done < iters; done += per_batch) {
+        write(sv[0], batch, blen);
+        for (int i = 0; i < per_batch; i++)
+            nb_read_line(nb, out);
+    }
+    nb_destroy(nb);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static const char *sample_commands[] = {
+    "MAIL FROM:<sender@example.com>\r\n",
+    "RCPT TO:<recipient@example.com>\r\n",
+    "DATA\r\n",
+    "EHLO client.example.com\r\n",
+    "NOOP\r\n",
+    "QUIT\r\n",
+    "XFOO bar\r\n",
+};
+#define NSAMPLES (sizeof(sample_commands) / sizeof(sample_commands[0]))
+
+static void bench_split(long iters, long unused) {
+    char buf[1025];
+    char *words[1024];
+    for (long i = 0; i < iters; i++) {
+        strcpy(buf, sample_commands[i % NSAMPLES]);
+        split(buf, words);
+    }
+}
+
+static void bench_dispatch(long iters, long unused) {
+    static const char *verbs[] = { "MAIL", "rcpt", "DATA", "EHLO", "NOOP", "QUIT", "XFOO" };
+    volatile const smtp_command *cmd;
+    for (long i = 0; i < iters; i++)
+        cmd = smtp_find_command(verbs[i % (sizeof(verbs) / sizeof(verbs[0]))]);
+    (void) cmd;
+}
+
+static void setup_users(long nusers) {
+    FILE *f = fopen("users.txt", "w");
+    for (long i = 0; i < nusers; i++)
+        fprintf(f, "user%ld password%ld\n", i, i);
+    fclose(f);
+}
+
+/** Writes the users file, and loads the user table from it. */
+static void setup_users_warm(long nusers) {
+    setup_users(nusers);
+    mailuser_warmup_start(1);
+    mailuser_warmup_wait(100);
+}
+
+static void bench_valid_user(long iters, long nusers) {
+    char name[MAX_USERNAME_SIZE];
+    // Look up a user in the middle of the file, i.e., the average case
+    // of a successful lookup.
+    snprintf(name, sizeof(name), "user%ld", nusers / 2);
+    for (long i = 0; i < iters; i++)
+        is_valid_user(name, NULL);
+}
+
+static void setup_mailbox(const char *user, long depth) {
+    char path[256];
+    mkdir("mail.store", 0777);
+    snprintf(path, sizeof(path), "mail.store/%s", user);
+    mkdir(path, 0777);
+    for (long i = 0; i < depth; i++) {
+        snprintf(path, sizeof(path), "mail.store/%s/%ld.mail", user, i);
+        close(open(path, O_CREAT | O_WRONLY, 0666));
+    }
+}
+
+static void bench_save_mail(long iters, long depth) {
+    char path[256];
+    user_list_t users = user_list_create();
+    FILE *f = fopen("message.tmp", "w");
+
+    fputs("Subject: bench\r\n\r\nhello\r\n", f);
+    fclose(f);
+    setup_mailbox("box", depth);
+    user_list_add(&users, "box");
+    snprintf(path, sizeof(path), "mail.store/box/%ld.mail", depth);
+
+    for (long i = 0; i < iters; i++) {
+        save_user_mail("message.tmp", users);
+        // Keep the mailbox at the same depth for every iteration
+        unlink(path);
+    }
+    user_list_destroy(users);
+}
+
+/** Sets up a mailbox for bench_save_mail_warm, and caches it. */
+static void setup_mailbox_warm(long depth) {
+    FILE *f = fopen("message.tmp", "w");
+
+    fputs("Subject: bench\r\n\r\nhello\r\n", f);
+    fclose(f);
+    f = fopen("users.txt", "w");
+    fputs("box password\n", f);
+    fclose(f);
+    setup_mailbox("box", depth);
+    mailuser_warmup_start(1);
+    mailuser_warmup_wait(100);
+}
+
+/** Like bench_save_mail, with the mailbox cached: each message goes to
+ *  the next number, so the one stored last is removed.
+ */
+static void bench_save_mail_warm(long iters, long depth) {
+    static long stored = 0;
+    char path[256];
+
+    for (long i = 0; i < iters; i++, stored++) {
+        save_user_mail_one("message.tmp", "box");
+        snprintf(path, sizeof(path), "mail.store/box/%ld.mail", depth + stored);
+        unlink(path);
+    }
+}
+
+static void bench_load_mail(long iters, long depth) {
+    setup_mailbox("box", depth);
+    for (long i = 0; i < iters; i++)
+        mail_list_destroy(load_user_mail("box"));
+}
+
+static void bench_dkim_body(long iters, long relaxed) {
+    static const char line[] =
+        "Lorem ipsum dolor sit amet,  consectetur adipiscing elit, sed do eiusmod tem";
+    char sig[256];
+    dkim_t d = dkim_create();
+
+    // One signature, so each line goes through one body hash
+    snprintf(sig, sizeof(sig), "DKIM-Signature: v=1; a=rsa-sha256; c=simple/%s; d=example.com; "
+             "s=sel; h=From; bh=AAAA; b=AAAA", relaxed ? "relaxed" : "simple");
+    dkim_line(d, sig, strlen(sig));
+    dkim_line(d, "", 0);
+    for (long i = 0; i < iters; i++)
+        dkim_line(d, line, sizeof(line) - 1);
+    dkim_destroy(d);
+}
+
+/* ------------------------------------------------------------------ */
+
+struct benchmark {
+    const char *name;
+    bench_fn    fn;
+    long        arg;
+    void      (*setup)(long arg);
+};
+
+static const struct benchmark benchmarks[] = {
+    { "nb_read_line/32",        bench_read_line,  32,      NULL },
+    { "nb_read_line/512",       bench_read_line,  512,     NULL },
+    { "split",                  bench_split,      0,       NULL },
+    { "dispatch",               bench_dispatch,   0,       NULL },
+    { "is_valid_user/1k",       bench_valid_user, 1000,    setup_users },
+    { "is_valid_user/100k",     bench_valid_user, 100000,  setup_users },
+    { "is_valid_user/1M",       bench_valid_user, 1000000, setup_users },
+    { "is_valid_user/1M/warm",  bench_valid_user, 1000000, setup_users_warm },
+    { "save_user_mail/0",       bench_save_mail,  0,       NULL },
+    { "save_user_mail/1k",      bench_save_mail,  1000,    NULL },
+    { "save_user_mail/10k",     bench_save_mail,  10000,   NULL },
+    { "save_user_mail/10k/warm", bench_save_mail_warm, 10000, setup_mailbox_warm },
+    { "load_user_mail/1k",      bench_load_mail,  1000,    NULL },
+    { "load_user_mail/10k",     bench_load_mail,  10000,   NULL },
+    { "dkim_body/simple",       bench_dkim_body,  0,       NULL },
+    { "dkim_body/relaxed",      bench_dkim_body,  1,       NULL },
+};
+
+/** Runs a benchmark with an increasing number of iterations until it
+ *  takes at least MIN_BENCH_NS, then writes the result to fd.
+ */
+static void run_child(const struct benchmark *b, int fd) {
+    char dir[] = "/tmp/mysmtpd-benchXXXXXX";
+    char line[256];
+    unsigned long long start, elapsed;
+    long iters = 1;
+
+    if (!mkdtemp(dir) || chdir(dir) < 0)
+        exit(1);
+    if (b->setup)
+        b->setup(b->arg);
+
+    for (;;) {
+        start = now_ns();
+        b->fn(iters, b->arg);
+        elapsed = now_ns() - start;
+        if (elapsed >= MIN_BENCH_NS)
+            break;
+        // Aim directly for the target time, with some margin
+        long next = elapsed ? (long) (iters * 1.2 * MIN_BENCH_NS / elapsed) : iters * 100;
+        iters = next > iters * 100 ? iters * 100 : next > iters ? next : iters * 2;
+    }
+
+    int len = snprintf(line, sizeof(line), "%s\t%.1f\t%ld\n",
+                       b->name, (double) elapsed / iters, iters);
+    write(fd, line, len);
+
+    snprintf(line, sizeof(line), "rm -rf %s", dir);
+    chdir("/");
+    system(line);
+    exit(0);
+}
+
+static int run_benchmark(const struct benchmark *b) {
+    int pfd[2], status;
+    char buf[256];
+    ssize_t len;
+    struct result *r = &results[nresults];
+
+    if (pipe(pfd) < 0)
+        return -1;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pfd[0]);
+        run_child(b, pfd[1]);
+    }
+    close(pfd[1]);
+    len = read(pfd[0], buf, sizeof(buf) - 1);
+    close(pfd[0]);
+    waitpid(pid, &status, 0);
+    if (len <= 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+        return -1;
+    buf[len] = 0;
+    if (sscanf(buf, "%63s %lf %ld", r->name, &r->ns_per_op, &r->iters) != 3)
+        return -1;
+    nresults++;
+    return 0;
+}
+
+static int compare_baseline(const char *file, double threshold) {
+    char line[256], name[MAX_NAME];
+    double ns;
+    int regressions = 0, compared[nresults];
+    FILE *f = fopen(file, "r");
+
+    if (!f) {
+        fprintf(stderr, "bench: no baseline %s; run \"make bench-baseline\" first\n", file);
+        return -1;
+    }
+    memset(compared, 0, sizeof(compared));
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || sscanf(line, "%63s %lf", name, &ns) != 2)
+            continue;
+        for (int i = 0; i < nresults; i++) {
+            if (strcmp(results[i].name, name))
+                continue;
+            compared[i] = 1;
+            double change = (results[i].ns_per_op - ns) * 100 / ns;
+            int regressed = change > threshold;
+            fprintf(stderr, "%-24s %12.1f -> %12.1f ns/op %+7.1f%%%s\n", name, ns,
+                    results[i].ns_per_op, change, regressed ? "  REGRESSION" : "");
+            regressions += regressed;
+        }
+    }
+    fclose(f);
+    // A new benchmark needs a new baseline before it can be checked
+    for (int i = 0; i < nresults; i++)
+        if (!compared[i]) {
+            fprintf(stderr, "bench: %s is not in baseline %s; run \"make bench-baseline\"\n",
+                    results[i].name, file);
+            regressions++;
+        }
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    const char *baseline = NULL, *output = NULL, *filter = NULL;
+    double threshold = 20;
+    FILE *out = stdout;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "b:t:o:")) != -1) {
+        switch (opt) {
+        case 'b': baseline = optarg; break;
+        case 't': threshold = atof(optarg); break;
+        case 'o': output = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-b baseline] [-t threshold-percent] [-o output] [filter]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (optind < argc)
+        filter = argv[optind];
+    if (output && !(out = fopen(output, "w"))) {
+        perror(output);
+        return 2;
+    }
+
+    be_verbose = 0;
+    fprintf(out, "# name\tns/op\titerations\n");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (filter && !strstr(benchmarks[i].name, filter))
+            continue;
+        if (run_benchmark(&benchmarks[i]) < 0) {
+            fprintf(stderr, "bench: %s failed\n", benchmarks[i].name);
+            failed++;
+            continue;
+        }
+        struct result *r = &results[nresults - 1];
+        fprintf(out, "%s\t%.1f\t%ld\n", r->name, r->ns_per_op, r->iters);
+        fflush(out);
+    }
+    if (out != stdout)
+        fclose(out);
+
+    if (baseline && compare_baseline(baseline, threshold) != 0)
+        return 1;
+    return failed ? 1 : 0;
+}
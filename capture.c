@@ -0,0 +1,121 @@
+/* capture.c
+ * Per-session capture of inbound client data. Records are collected
+ * in a memory buffer and written out only when it fills up or the
+ * session ends, so capturing adds no system calls to the receive path
+ * in the common case.
+ */
+
+#include "capture.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define CAPTURE_BUFFER_SIZE 65536
+
+struct capture {
+    int      fd;
+    uint64_t start_ns;
+    size_t   used;
+    char     buf[CAPTURE_BUFFER_SIZE];
+};
+
+static char *capture_dir = NULL;
+static unsigned capture_seq = 0;
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void capture_flush(capture_t cap) {
+    size_t off = 0;
+    while (off < cap->used) {
+        ssize_t rv = write(cap->fd, cap->buf + off, cap->used - off);
+        if (rv <= 0)
+            break;
+        off += rv;
+    }
+    cap->used = 0;
+}
+
+static void capture_append(capture_t cap, const void *data, size_t len) {
+    if (cap->used + len > CAPTURE_BUFFER_SIZE)
+        capture_flush(cap);
+    if (len > CAPTURE_BUFFER_SIZE) {
+        write(cap->fd, data, len);
+        return;
+    }
+    memcpy(cap->buf + cap->used, data, len);
+    cap->used += len;
+}
+
+/** Enables capturing of all subsequent sessions into files in the
+ *  given directory, which is created if it does not exist. Passing
+ *  NULL disables capturing.
+ */
+void capture_init(const char *directory) {
+    free(capture_dir);
+    capture_dir = directory ? strdup(directory) : NULL;
+    if (capture_dir)
+        mkdir(capture_dir, 0777);
+}
+
+/** Starts the capture file for a new session.
+ *
+ *  Returns: A capture object, or NULL if capturing is disabled or the
+ *           file could not be created.
+ */
+capture_t capture_open(void) {
+    char name[4096];
+    capture_t cap;
+
+    if (!capture_dir)
+        return NULL;
+    cap = malloc(sizeof(struct capture));
+    if (!cap)
+        return NULL;
+    cap->start_ns = realtime_ns();
+    cap->used = 0;
+    snprintf(name, sizeof(name), "%s/%llu-%d-%u.cap", capture_dir,
+             (unsigned long long) (cap->start_ns / 1000000), (int) getpid(), capture_seq++);
+    cap->fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (cap->fd < 0) {
+        dlog("capture: cannot create %s\n", name);
+        free(cap);
+        return NULL;
+    }
+    capture_append(cap, CAPTURE_MAGIC, 8);
+    capture_append(cap, &cap->start_ns, sizeof(cap->start_ns));
+    return cap;
+}
+
+/** Appends a block of received data to the session capture.
+ */
+void capture_record(capture_t cap, const char *data, size_t len) {
+    uint64_t offset;
+    uint32_t len32 = len;
+
+    if (!cap || !len)
+        return;
+    offset = realtime_ns() - cap->start_ns;
+    capture_append(cap, &offset, sizeof(offset));
+    capture_append(cap, &len32, sizeof(len32));
+    capture_append(cap, data, len);
+}
+
+/** Writes out any buffered data and closes the session capture.
+ */
+void capture_close(capture_t cap) {
+    if (!cap)
+        return;
+    capture_flush(cap);
+    close(cap->fd);
+    free(cap);
+}
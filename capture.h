@@ -0,0 +1,29 @@
+/* capture.h
+ * Records the raw bytes received from each client, with timestamps,
+ * so that sessions can later be replayed against a test server.
+ *
+ * File format (host byte order):
+ *     magic "SMTPCAP1" (8 bytes)
+ *     session start, CLOCK_REALTIME nanoseconds (uint64)
+ *     records, each:
+ *         offset from session start in nanoseconds (uint64)
+ *         length (uint32)
+ *         length bytes of received data
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "SMTPCAP1"
+
+typedef struct capture *capture_t;
+
+void      capture_init(const char *directory);
+capture_t capture_open(void);
+void      capture_record(capture_t cap, const char *data, size_t len);
+void      capture_close(capture_t cap);
+
+#endif
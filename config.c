@@ -0,0 +1,310 @@
+/* config.c
+ * Runtime configuration. Settings are "key value" pairs, one per line
+ * in a configuration file ('#' starts a comment), or given on the
+ * command line as "key=value". Settings are applied in order, so a
+ * later one overrides an earlier one, except for "listen", which adds
+ * a listener each time.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#define MAX_CONFIG_LINE 1024
+
+static const char *listener_kinds[] = {
+    [Listen_smtp]       = "smtp",
+    [Listen_submission] = "submission",
+    [Listen_lmtp]       = "lmtp",
+    [Listen_admin]      = "admin",
+};
+
+struct config config = {
+    .nlisten          = 0,
+#if defined(DOFORK)
+    .engine           = Engine_fork,
+#else
+    .engine           = Engine_iterative,
+#endif
+    .workers          = 0,
+    .backlog          = 1024,
+    .socket_buffer    = 0,
+    .ready_fd         = -1,
+    .line_length      = 1024,
+    .client_timeout   = 300,
+    .shutdown_timeout = 30,
+    .max_message_size = 0,
+    .max_recipients   = 0,
+    .filter_workers   = 4,
+    .resolver_threads = 4,
+    .relay_timeout    = 60,
+    .warmup_threads   = 4,
+    .warmup_threshold = 100,
+    .users_file       = "users.txt",
+    .mail_store       = "mail.store",
+    .spool_dir        = "mail.spool",
+    .queue_dir        = "mail.queue",
+    .durability       = Durability_queue,
+};
+
+/** Parses a non-negative number, with an optional k, m or g suffix
+ *  (powers of 1024).
+ *
+ *  Returns: 0 on success, -1 if the value is not a valid number.
+ */
+static int parse_size(const char *value, size_t *out) {
+    char *end;
+    unsigned long long n = strtoull(value, &end, 10);
+
+    if (end == value || *value == '-')
+        return -1;
+    switch (tolower((unsigned char) *end)) {
+    case 'g': n *= 1024;   // fall through
+    case 'm': n *= 1024;   // fall through
+    case 'k': n *= 1024; end++; break;
+    }
+    if (*end)
+        return -1;
+    *out = n;
+    return 0;
+}
+
+static int parse_int(const char *value, int *out) {
+    size_t n;
+
+    if (parse_size(value, &n) < 0 || n > 0x7fffffff)
+        return -1;
+    *out = n;
+    return 0;
+}
+
+/** Parses one option of a listener: "nodelay", "rcvbuf=SIZE",
+ *  "sndbuf=SIZE", "keepalive=IDLE[:INTERVAL[:COUNT]]",
+ *  "fastopen=QUEUE" or "insecure_auth".
+ *
+ *  Returns: 0 on success, -1 if the option is invalid.
+ */
+static int parse_listen_option(const char *opt, size_t len, Listen_options *opts) {
+    char buf[64], *value;
+
+    if (len >= sizeof(buf))
+        return -1;
+    memcpy(buf, opt, len);
+    buf[len] = 0;
+    if ((value = strchr(buf, '=')))
+        *value++ = 0;
+    if (!strcmp(buf, "nodelay") && !value) {
+        opts->nodelay = 1;
+        return 0;
+    }
+    if (!strcmp(buf, "insecure_auth") && !value) {
+        opts->insecure_auth = 1;
+        return 0;
+    }
+    if (!value)
+        return -1;
+    if (!strcmp(buf, "rcvbuf"))
+        return parse_int(value, &opts->rcvbuf);
+    if (!strcmp(buf, "sndbuf"))
+        return parse_int(value, &opts->sndbuf);
+    if (!strcmp(buf, "fastopen"))
+        return parse_int(value, &opts->fastopen) < 0 || opts->fastopen < 1 ? -1 : 0;
+    if (!strcmp(buf, "keepalive")) {
+        char *end;
+        opts->keepidle = strtol(value, &end, 10);
+        if (*end == ':')
+            opts->keepintvl = strtol(end + 1, &end, 10);
+        if (*end == ':')
+            opts->keepcnt = strtol(end + 1, &end, 10);
+        return *end || opts->keepidle <= 0 || opts->keepintvl < 0 || opts->keepcnt < 0 ? -1 : 0;
+    }
+    return -1;
+}
+
+/** Parses a listener specification, "[kind=]address[,option]...". The
+ *  kind is smtp (the default), submission, lmtp or admin; the address
+ *  is "port", "host:port", "[address]:port" or the path of a Unix
+ *  socket; the options are listener options (see parse_listen_option).
+ *
+ *  Parameters: spec: the specification.
+ *              kind: set to the kind of listener (may be NULL).
+ *              addr: receives the address, CONFIG_MAX_ADDRESS bytes
+ *                    (may be NULL).
+ *              opts: receives the options (may be NULL).
+ *
+ *  Returns: 0 on success, -1 if the specification is invalid.
+ */
+int config_parse_listen(const char *spec, Listener_kind *kind, char *addr,
+                        Listen_options *opts) {
+    const char *eq = strchr(spec, '='), *comma = strchr(spec, ',');
+    Listener_kind k = Listen_smtp;
+    Listen_options o = {0};
+
+    if (eq && (!comma || eq < comma)) {
+        for (k = 0; k < sizeof(listener_kinds) / sizeof(listener_kinds[0]); k++)
+            if (strlen(listener_kinds[k]) == (size_t) (eq - spec) &&
+                !strncmp(spec, listener_kinds[k], eq - spec))
+                break;
+        if (k == sizeof(listener_kinds) / sizeof(listener_kinds[0]))
+            return -1;
+        spec = eq + 1;
+    }
+    if (!comma)
+        comma = spec + strlen(spec);
+    if (comma - spec >= CONFIG_MAX_ADDRESS)
+        return -1;
+    if (addr)
+        snprintf(addr, CONFIG_MAX_ADDRESS, "%.*s", (int) (comma - spec), spec);
+    while (*comma) {
+        const char *opt = comma + 1;
+        comma = opt + strcspn(opt, ",");
+        if (parse_listen_option(opt, comma - opt, &o) < 0)
+            return -1;
+    }
+    if (kind)
+        *kind = k;
+    if (opts)
+        *opts = o;
+    return 0;
+}
+
+/** Applies one setting.
+ *
+ *  Parameters: key: name of the setting.
+ *              value: its value; copied if it is kept.
+ *
+ *  Returns: 0 on success, -1 if the value is invalid, 1 if the key is
+ *           not a known setting.
+ */
+int config_set(const char *key, const char *value) {
+    int rv = 0;
+
+    if (!strcmp(key, "listen")) {
+        char addr[CONFIG_MAX_ADDRESS];
+        if (config.nlisten == CONFIG_MAX_LISTEN || config_parse_listen(value, NULL, addr, NULL) < 0 ||
+            !addr[0])
+            return -1;
+        config.listen[config.nlisten++] = strdup(value);
+    } else if (!strcmp(key, "engine")) {
+        if (!strcmp(value, "iterative"))
+            config.engine = Engine_iterative;
+        else if (!strcmp(value, "fork"))
+            config.engine = Engine_fork;
+        else if (!strcmp(value, "prefork"))
+            config.engine = Engine_prefork;
+        else
+            return -1;
+    } else if (!strcmp(key, "workers")) {
+        rv = parse_int(value, &config.workers);
+    } else if (!strcmp(key, "backlog")) {
+        rv = parse_int(value, &config.backlog);
+    } else if (!strcmp(key, "socket_buffer")) {
+        rv = parse_int(value, &config.socket_buffer);
+    } else if (!strcmp(key, "ready_fd")) {
+        rv = parse_int(value, &config.ready_fd);
+    } else if (!strcmp(key, "line_length")) {
+        rv = parse_size(value, &config.line_length);
+        // A line must at least hold a command and its arguments
+        if (!rv && (config.line_length < 512 || config.line_length > 1024 * 1024))
+            rv = -1;
+    } else if (!strcmp(key, "client_timeout")) {
+        rv = parse_int(value, &config.client_timeout);
+    } else if (!strcmp(key, "shutdown_timeout")) {
+        rv = parse_int(value, &config.shutdown_timeout);
+    } else if (!strcmp(key, "max_message_size")) {
+        rv = parse_size(value, &config.max_message_size);
+    } else if (!strcmp(key, "max_recipients")) {
+        rv = parse_int(value, &config.max_recipients);
+    } else if (!strcmp(key, "filter_workers")) {
+        rv = parse_int(value, &config.filter_workers);
+        if (!rv && config.filter_workers < 1)
+            rv = -1;
+    } else if (!strcmp(key, "resolver_threads")) {
+        rv = parse_int(value, &config.resolver_threads);
+        if (!rv && config.resolver_threads < 1)
+            rv = -1;
+    } else if (!strcmp(key, "relay_timeout")) {
+        rv = parse_int(value, &config.relay_timeout);
+    } else if (!strcmp(key, "warmup_threads")) {
+        rv = parse_int(value, &config.warmup_threads);
+        if (!rv && config.warmup_threads < 1)
+            rv = -1;
+    } else if (!strcmp(key, "warmup_threshold")) {
+        rv = parse_int(value, &config.warmup_threshold);
+        if (!rv && config.warmup_threshold > 100)
+            rv = -1;
+    } else if (!strcmp(key, "users_file")) {
+        config.users_file = strdup(value);
+    } else if (!strcmp(key, "mail_store")) {
+        config.mail_store = strdup(value);
+    } else if (!strcmp(key, "spool_dir")) {
+        config.spool_dir = strdup(value);
+    } else if (!strcmp(key, "queue_dir")) {
+        config.queue_dir = strdup(value);
+    } else if (!strcmp(key, "durability")) {
+        if (!strcmp(value, "none"))
+            config.durability = Durability_none;
+        else if (!strcmp(value, "queue"))
+            config.durability = Durability_queue;
+        else if (!strcmp(value, "full"))
+            config.durability = Durability_full;
+        else
+            return -1;
+    } else {
+        return 1;
+    }
+    return rv;
+}
+
+/** Reads a configuration file.
+ *
+ *  Parameters: file: name of the file.
+ *              other: called for keys that are not settings of this
+ *                     module (may be NULL); returns 0 if it took the
+ *                     setting, -1 otherwise.
+ *
+ *  Returns: 0 on success, -1 on failure (reported on stderr).
+ */
+int config_load(const char *file, int (*other)(const char *key, const char *value)) {
+    char line[MAX_CONFIG_LINE];
+    int lineno = 0, rv = 0;
+    FILE *f = fopen(file, "r");
+
+    if (!f) {
+        perror(file);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *key = line, *value, *end;
+
+        lineno++;
+        if ((end = strchr(line, '#')))
+            *end = 0;
+        end = line + strlen(line);
+        while (end > line && isspace((unsigned char) end[-1]))
+            *--end = 0;
+        while (isspace((unsigned char) *key))
+            key++;
+        if (!*key)
+            continue;
+        value = key + strcspn(key, " \t");
+        if (*value)
+            *value++ = 0;
+        while (isspace((unsigned char) *value))
+            value++;
+
+        int status = config_set(key, value);
+        if (status > 0)
+            status = other ? other(key, value) : -1;
+        if (status < 0) {
+            fprintf(stderr, "%s:%d: invalid setting \"%s %s\"\n", file, lineno, key, value);
+            rv = -1;
+        }
+    }
+    fclose(f);
+    return rv;
+}
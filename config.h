@@ -0,0 +1,89 @@
+/* config.h
+ * Runtime configuration: compiled-in defaults, overridden by a
+ * configuration file and by the command line.
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <stddef.h>
+
+#define CONFIG_MAX_LISTEN  8
+#define CONFIG_MAX_ADDRESS 256   // bytes of a listen address, with its null
+
+typedef enum engine
+{
+    Engine_iterative,   // one client at a time, in the server process
+    Engine_fork,        // a new process per client
+    Engine_prefork      // a fixed pool of processes, each accepting clients
+} Engine;
+
+typedef enum listener_kind
+{
+    Listen_smtp,        // mail from other servers
+    Listen_submission,  // mail from users, who must authenticate (AUTH PLAIN)
+    Listen_lmtp,        // local delivery
+    Listen_admin        // a statistics dump, on connecting
+} Listener_kind;
+
+// Options of a listener: socket options, inherited by the clients it
+// accepts, and session options
+typedef struct listen_options
+{
+    int nodelay;        // TCP_NODELAY
+    int rcvbuf;         // SO_RCVBUF in bytes, 0 for config.socket_buffer
+    int sndbuf;         // SO_SNDBUF in bytes, 0 for config.socket_buffer
+    int keepidle;       // seconds idle before keepalive probes, 0 for no keepalive
+    int keepintvl;      // seconds between probes, 0 for the system default
+    int keepcnt;        // unanswered probes before dropping, 0 for the system default
+    int fastopen;       // TCP_FASTOPEN queue length, 0 for no Fast Open
+    int insecure_auth;  // offer AUTH to clients that are not on this host
+} Listen_options;
+
+typedef enum durability
+{
+    Durability_none,    // no fsync at all
+    Durability_queue,   // fsync the relay queue and the filter spool
+    Durability_full     // also fsync delivered mailboxes
+} Durability;
+
+struct config {
+    // Server
+    const char *listen[CONFIG_MAX_LISTEN];  // "[kind=]address[,option]..." each
+    int         nlisten;
+    Engine      engine;
+    int         workers;            // processes of the prefork engine, 0 for one per CPU
+    int         backlog;            // listen queue length (capped by net.core.somaxconn)
+    int         socket_buffer;      // SO_RCVBUF/SO_SNDBUF in bytes, 0 for the system default
+    int         ready_fd;           // file descriptor to write READY=1 to once serving, or -1
+
+    // Sessions
+    size_t      line_length;        // longest command or data line
+    int         client_timeout;     // seconds to wait for a client line, 0 for ever
+    int         shutdown_timeout;   // seconds a transaction may take to finish on shutdown
+    size_t      max_message_size;   // bytes, 0 for no limit
+    int         max_recipients;     // per transaction, 0 for no limit
+
+    // Background work
+    int         filter_workers;
+    int         resolver_threads;
+    int         relay_timeout;      // seconds to wait for a next hop reply
+    int         warmup_threads;     // threads warming up the mailbox caches at startup
+    int         warmup_threshold;   // percent of the warm-up done before serving
+
+    // Storage
+    const char *users_file;
+    const char *mail_store;
+    const char *spool_dir;
+    const char *queue_dir;
+    Durability  durability;
+};
+
+extern struct config config;
+
+int         config_set(const char *key, const char *value);
+int         config_parse_listen(const char *spec, Listener_kind *kind, char *addr,
+                                Listen_options *opts);
+int         config_load(const char *file, int (*other)(const char *key, const char *value));
+
+#endif
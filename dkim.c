@@ -0,0 +1,838 @@
+/* dkim.c
+ * DKIM verification in a single pass over the message.
+ *
+ * The session feeds each line of the message to dkim_line() as it is
+ * received. Header lines are kept (they are needed for the header hash
+ * and are small); once the header section ends, the DKIM-Signature
+ * headers are parsed, and from then on every body line goes straight
+ * into one running body hash per signature, canonicalized on the fly
+ * ("simple" or "relaxed"). Trailing empty lines, which both
+ * canonicalizations ignore, are only counted, and hashed if a non-empty
+ * line follows. When the message is complete, dkim_result() finishes
+ * the body hashes, hashes the signed headers, checks the signatures and
+ * formats an Authentication-Results header. The body is never read a
+ * second time.
+ *
+ * Public keys come from a key resolver: DNS TXT records, or files in a
+ * local directory (for testing), one file per key named after the
+ * record, e.g. "sel._domainkey.example.com", holding the record text
+ * ("v=DKIM1; k=rsa; p=..."). Other resolvers can be plugged in with
+ * dkim_set_resolver(). Key records are cached.
+ *
+ * Key lookups never hold up the session: when a DKIM-Signature header
+ * is parsed at the end of the header section, its key is queued for a
+ * small pool of lookup threads (like the reverse DNS resolver), which
+ * fill in the cache while the body is received. dkim_result() only
+ * reads the cache, and a key that is not in yet gives a temperror. Only
+ * the local key directory, which involves no network, is read at once.
+ *
+ * Supported algorithms are rsa-sha256, rsa-sha1 and ed25519-sha256.
+ */
+
+#include "dkim.h"
+#include "util.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#define DKIM_MAX_SIGNATURES 8
+#define DKIM_MAX_HEADERS    1024
+#define DKIM_MAX_HEADER_LEN (256 * 1024)
+#define DKIM_MAX_RECORD     4096
+#define KEY_CACHE_SLOTS     256
+#define KEY_TTL             3600
+#define KEY_NEGATIVE_TTL    300
+#define KEY_QUEUE_SIZE      256
+#define KEY_NAME_MAX        256
+#define KEY_PENDING         (-2)   // lookup not finished (or not started)
+
+typedef enum dkim_alg
+{
+    Alg_rsa_sha256,
+    Alg_rsa_sha1,
+    Alg_ed25519_sha256
+} Dkim_alg;
+
+struct header {
+    size_t start;
+    size_t len;           // without the final CRLF
+};
+
+struct signature {
+    int            header;          // index of the DKIM-Signature header
+    const char    *error;           // reason for a permerror, or NULL
+    Dkim_alg       alg;
+    int            relaxed_header;
+    int            relaxed_body;
+    long           limit;           // l= tag, or -1
+    char          *domain;
+    char          *selector;
+    char          *signed_headers;  // h= tag
+    unsigned char *body_hash;       // bh= tag, decoded
+    int            body_hash_len;
+    unsigned char *sig;             // b= tag, decoded
+    int            sig_len;
+
+    // Running body hash
+    EVP_MD_CTX    *ctx;
+    long           hashed;
+    long           empty_lines;
+    int            any_output;
+};
+
+struct dkim {
+    int     in_body;
+    char   *headers;
+    size_t  hlen, hcap;
+    struct header hdr[DKIM_MAX_HEADERS];
+    int     nhdr;
+    struct signature sigs[DKIM_MAX_SIGNATURES];
+    int     nsigs;
+};
+
+struct key_slot {
+    char   name[KEY_NAME_MAX];
+    char   record[DKIM_MAX_RECORD];
+    int    found;     // as returned by the resolver
+    int    pending;   // queued or being looked up
+    time_t expires;
+};
+
+static int enabled = 0;
+static const char *key_directory = NULL;
+static dkim_key_resolver resolver = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t key_work = PTHREAD_COND_INITIALIZER;
+static struct key_slot *key_cache = NULL;
+static char key_queue[KEY_QUEUE_SIZE][KEY_NAME_MAX];
+static int key_queue_head = 0, key_queue_len = 0;
+static pid_t started_pid = 0;
+
+/* ------------------------------------------------------------------ */
+/* Key resolvers                                                       */
+
+/** Reads a key record from a file in the key directory. The record may
+ *  span several lines, and may be written as quoted strings like in a
+ *  DNS zone file.
+ */
+static int resolve_file(const char *name, char *record, size_t len) {
+    char path[1024];
+    size_t n = 0;
+    FILE *f;
+    int c;
+
+    if (strchr(name, '/'))
+        return 0;
+    snprintf(path, sizeof(path), "%s/%s", key_directory, name);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    while ((c = getc(f)) != EOF && n < len - 1)
+        if (c != '"' && c != '\n' && c != '\r')
+            record[n++] = c;
+    record[n] = 0;
+    fclose(f);
+    return 1;
+}
+
+/** Looks up a key record in DNS. */
+static int resolve_dns(const char *name, char *record, size_t len) {
+    unsigned char answer[NS_PACKETSZ * 4];
+    size_t n = 0;
+    ns_msg msg;
+    ns_rr rr;
+    int alen;
+
+    alen = res_query(name, ns_c_in, ns_t_txt, answer, sizeof(answer));
+    if (alen < 0)
+        return h_errno == HOST_NOT_FOUND || h_errno == NO_DATA ? 0 : -1;
+    if (ns_initparse(answer, alen, &msg) < 0)
+        return -1;
+    for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0 || ns_rr_type(rr) != ns_t_txt)
+            continue;
+        // A TXT record is a sequence of length-prefixed strings
+        const unsigned char *p = ns_rr_rdata(rr), *end = p + ns_rr_rdlen(rr);
+        while (p < end && p + 1 + *p <= end) {
+            if (n + *p < len) {
+                memcpy(record + n, p + 1, *p);
+                n += *p;
+            }
+            p += 1 + *p;
+        }
+        record[n] = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static struct key_slot *key_slot(const char *name) {
+    unsigned h = 5381;
+
+    for (const char *p = name; *p; p++)
+        h = h * 33 + tolower((unsigned char) *p);
+    return &key_cache[h % KEY_CACHE_SLOTS];
+}
+
+/** Stores the result of a lookup, unless the slot has been taken over
+ *  by another name in the meantime. Temporary failures expire at once,
+ *  so that the next message looks the key up again.
+ */
+static void store_key(const char *name, int found, const char *record) {
+    struct key_slot *slot = key_slot(name);
+
+    pthread_mutex_lock(&cache_lock);
+    if (slot->pending && !strcasecmp(slot->name, name)) {
+        snprintf(slot->record, sizeof(slot->record), "%s", found > 0 ? record : "");
+        slot->found = found;
+        slot->pending = 0;
+        slot->expires = time(NULL) + (found > 0 ? KEY_TTL : found == 0 ? KEY_NEGATIVE_TTL : 0);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void *key_thread(void *arg) {
+    char name[KEY_NAME_MAX], record[DKIM_MAX_RECORD];
+
+    pthread_mutex_lock(&cache_lock);
+    for (;;) {
+        while (!key_queue_len)
+            pthread_cond_wait(&key_work, &cache_lock);
+        strcpy(name, key_queue[key_queue_head]);
+        key_queue_head = (key_queue_head + 1) % KEY_QUEUE_SIZE;
+        key_queue_len--;
+        pthread_mutex_unlock(&cache_lock);
+
+        int found = resolver(name, record, sizeof(record));
+        store_key(name, found, record);
+        dlog("dkim: key %s %s\n", name, found > 0 ? "found" : found == 0 ? "not found" : "lookup failed");
+
+        pthread_mutex_lock(&cache_lock);
+    }
+    return NULL;
+}
+
+/** Starts looking up the key record for a name, unless the cache has
+ *  it or a lookup is in progress. Never waits for DNS; if the lookup
+ *  queue is full, or the cache slot is busy with a lookup for another
+ *  name, the request is dropped and the key stays pending.
+ */
+static void start_lookup(const char *name) {
+    char record[DKIM_MAX_RECORD];
+    struct key_slot *slot;
+
+    if (!key_cache || strlen(name) >= KEY_NAME_MAX)
+        return;
+    slot = key_slot(name);
+
+    int async = resolver != resolve_file;
+    pthread_mutex_lock(&cache_lock);
+    if (slot->pending || (slot->expires > time(NULL) && !strcasecmp(slot->name, name)) ||
+        (async && key_queue_len == KEY_QUEUE_SIZE)) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    slot->pending = 1;
+    if (async) {
+        // Threads are started on first use in each process, so that
+        // forked children get their own
+        if (started_pid != getpid()) {
+            pthread_t thread;
+            started_pid = getpid();
+            for (int i = 0; i < config.resolver_threads; i++)
+                if (pthread_create(&thread, NULL, key_thread, NULL) == 0)
+                    pthread_detach(thread);
+        }
+        snprintf(key_queue[(key_queue_head + key_queue_len) % KEY_QUEUE_SIZE], KEY_NAME_MAX, "%s", name);
+        key_queue_len++;
+        pthread_cond_signal(&key_work);
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    store_key(name, resolver(name, record, sizeof(record)), record);
+}
+
+/** Returns the cached key record for a name, without waiting: 1 and
+ *  the record if found, 0 if there is no key, -1 if the lookup failed,
+ *  KEY_PENDING if it has not finished.
+ */
+static int cached_key(const char *name, char *record, size_t len) {
+    struct key_slot *slot;
+    int found = KEY_PENDING;
+
+    if (!key_cache)
+        return KEY_PENDING;
+    slot = key_slot(name);
+    pthread_mutex_lock(&cache_lock);
+    // A result that has just expired is still the answer to the lookup
+    // this message started
+    if (!slot->pending && slot->name[0] && !strcasecmp(slot->name, name)) {
+        found = slot->found;
+        snprintf(record, len, "%s", slot->record);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return found;
+}
+
+/** Enables DKIM verification.
+ *
+ *  Parameters: keys: "dns" to look up keys in DNS, or the name of a
+ *                    directory holding key record files.
+ *
+ *  Returns: 0 on success, -1 on failure.
+ */
+int dkim_init(const char *keys) {
+    key_cache = calloc(KEY_CACHE_SLOTS, sizeof(struct key_slot));
+    if (!key_cache)
+        return -1;
+    if (!strcmp(keys, "dns")) {
+        resolver = resolve_dns;
+    } else {
+        key_directory = strdup(keys);
+        resolver = resolve_file;
+    }
+    enabled = 1;
+    return 0;
+}
+
+/** Replaces the key resolver set up by dkim_init(). It is called on
+ *  the key lookup threads, so it may block.
+ */
+void dkim_set_resolver(dkim_key_resolver fn) {
+    resolver = fn;
+}
+
+/** Returns 1 if incoming messages are verified. */
+int dkim_enabled(void) {
+    return enabled;
+}
+
+/* ------------------------------------------------------------------ */
+/* Helpers                                                             */
+
+static int is_wsp(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static int is_fws(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/** Decodes base64, ignoring whitespace. Returns the decoded length, or
+ *  -1 on invalid input. The result must be freed.
+ */
+static int base64_decode(const char *in, unsigned char **out) {
+    size_t n = 0, len = strlen(in);
+    char *clean = malloc(len + 1);
+    int rv, pad = 0;
+
+    for (size_t i = 0; i < len; i++)
+        if (!is_fws(in[i]))
+            clean[n++] = in[i];
+    clean[n] = 0;
+    if (n % 4) {
+        free(clean);
+        return -1;
+    }
+    while (n - pad > 0 && clean[n - pad - 1] == '=')
+        pad++;
+    *out = malloc(n / 4 * 3 + 1);
+    rv = EVP_DecodeBlock(*out, (unsigned char *) clean, n);
+    free(clean);
+    if (rv < 0) {
+        free(*out);
+        *out = NULL;
+        return -1;
+    }
+    return rv - pad;
+}
+
+/** Returns a copy of a tag value from a tag list ("a=x; b=y"), with
+ *  surrounding whitespace removed, or NULL if the tag is not present.
+ */
+static char *tag_value(const char *list, const char *tag) {
+    size_t taglen = strlen(tag);
+    const char *p = list;
+
+    while (*p) {
+        while (is_fws(*p) || *p == ';')
+            p++;
+        const char *name = p;
+        while (*p && *p != '=' && *p != ';' && !is_fws(*p))
+            p++;
+        size_t namelen = p - name;
+        while (is_fws(*p))
+            p++;
+        if (*p != '=') {
+            while (*p && *p != ';')
+                p++;
+            continue;
+        }
+        p++;
+        while (is_fws(*p))
+            p++;
+        const char *value = p;
+        while (*p && *p != ';')
+            p++;
+        const char *end = p;
+        while (end > value && is_fws(end[-1]))
+            end--;
+        if (namelen == taglen && !strncmp(name, tag, taglen))
+            return strndup(value, end - value);
+    }
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Body hashing                                                        */
+
+static void body_update(struct signature *s, const char *data, size_t len) {
+    if (s->limit >= 0 && s->hashed + (long) len > s->limit)
+        len = s->limit > s->hashed ? s->limit - s->hashed : 0;
+    if (len) {
+        EVP_DigestUpdate(s->ctx, data, len);
+        s->hashed += len;
+    }
+}
+
+/** Adds one body line (without CRLF) to a signature's body hash. */
+static void body_line(struct signature *s, const char *line, size_t len) {
+    char out[1024];
+    size_t n = 0;
+    int space = 0;
+
+    if (s->relaxed_body) {
+        // Whitespace runs become one space, trailing whitespace goes;
+        // a line left empty counts as an empty line.
+        size_t end = len;
+        while (end > 0 && is_wsp(line[end - 1]))
+            end--;
+        if (end == 0) {
+            s->empty_lines++;
+            return;
+        }
+        for (; s->empty_lines > 0; s->empty_lines--)
+            body_update(s, "\r\n", 2);
+        for (size_t i = 0; i < end; i++) {
+            if (is_wsp(line[i])) {
+                space = 1;
+                continue;
+            }
+            if (n + 2 > sizeof(out)) {
+                body_update(s, out, n);
+                n = 0;
+            }
+            if (space)
+                out[n++] = ' ';
+            space = 0;
+            out[n++] = line[i];
+        }
+        body_update(s, out, n);
+    } else {
+        if (len == 0) {
+            s->empty_lines++;
+            return;
+        }
+        for (; s->empty_lines > 0; s->empty_lines--)
+            body_update(s, "\r\n", 2);
+        body_update(s, line, len);
+    }
+    body_update(s, "\r\n", 2);
+    s->any_output = 1;
+}
+
+/* ------------------------------------------------------------------ */
+/* Signatures                                                          */
+
+static void key_name(const struct signature *s, char *name, size_t size) {
+    snprintf(name, size, "%s._domainkey.%s", s->selector, s->domain);
+}
+
+static void parse_signature(dkim_t d, int header) {
+    struct signature *s = &d->sigs[d->nsigs++];
+    const char *raw = d->headers + d->hdr[header].start;
+    char *list = strndup(raw, d->hdr[header].len);
+    char *tags = strchr(list, ':') + 1;
+    char *v, *a, *c, *l, *b, *bh;
+    const EVP_MD *md = EVP_sha256();
+
+    memset(s, 0, sizeof(*s));
+    s->header = header;
+    s->limit = -1;
+
+    v = tag_value(tags, "v");
+    a = tag_value(tags, "a");
+    c = tag_value(tags, "c");
+    l = tag_value(tags, "l");
+    b = tag_value(tags, "b");
+    bh = tag_value(tags, "bh");
+    s->domain = tag_value(tags, "d");
+    s->selector = tag_value(tags, "s");
+    s->signed_headers = tag_value(tags, "h");
+
+    if (!v || strcmp(v, "1") || !a || !b || !bh || !s->domain || !s->selector || !s->signed_headers) {
+        s->error = "missing tag";
+    } else if (!strcmp(a, "rsa-sha256")) {
+        s->alg = Alg_rsa_sha256;
+    } else if (!strcmp(a, "rsa-sha1")) {
+        s->alg = Alg_rsa_sha1;
+        md = EVP_sha1();
+    } else if (!strcmp(a, "ed25519-sha256")) {
+        s->alg = Alg_ed25519_sha256;
+    } else {
+        s->error = "unsupported algorithm";
+    }
+    if (!s->error && c) {
+        char *slash = strchr(c, '/');
+        if (slash)
+            *slash = 0;
+        s->relaxed_header = !strcmp(c, "relaxed");
+        s->relaxed_body = slash && !strcmp(slash + 1, "relaxed");
+        if ((!s->relaxed_header && strcmp(c, "simple")) ||
+            (slash && !s->relaxed_body && strcmp(slash + 1, "simple")))
+            s->error = "unsupported canonicalization";
+    }
+    if (!s->error && l)
+        s->limit = atol(l);
+    if (!s->error && ((s->body_hash_len = base64_decode(bh, &s->body_hash)) <= 0 ||
+                      (s->sig_len = base64_decode(b, &s->sig)) <= 0))
+        s->error = "bad base64";
+    if (!s->error) {
+        char name[512];
+        s->ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(s->ctx, md, NULL);
+        // The key arrives while the body is being received
+        key_name(s, name, sizeof(name));
+        start_lookup(name);
+    }
+    free(v);
+    free(a);
+    free(c);
+    free(l);
+    free(b);
+    free(bh);
+    free(list);
+}
+
+/** Called at the end of the header section. */
+static void end_of_headers(dkim_t d) {
+    d->in_body = 1;
+    for (int i = 0; i < d->nhdr && d->nsigs < DKIM_MAX_SIGNATURES; i++)
+        if (d->hdr[i].len > 15 && !strncasecmp(d->headers + d->hdr[i].start, "DKIM-Signature:", 15))
+            parse_signature(d, i);
+}
+
+/** Appends a header, canonicalized, to a buffer. */
+static void canon_header(char **buf, size_t *len, size_t *cap, const char *raw, size_t rawlen,
+                         int relaxed, int crlf) {
+    if (*len + rawlen + 3 > *cap) {
+        *cap = (*len + rawlen + 3) * 2;
+        *buf = realloc(*buf, *cap);
+    }
+    char *out = *buf + *len;
+    size_t n = 0;
+
+    if (!relaxed) {
+        memcpy(out, raw, rawlen);
+        n = rawlen;
+    } else {
+        const char *colon = memchr(raw, ':', rawlen);
+        size_t i, namelen = colon ? (size_t) (colon - raw) : rawlen;
+        int space = 0;
+
+        while (namelen > 0 && is_wsp(raw[namelen - 1]))
+            namelen--;
+        for (i = 0; i < namelen; i++)
+            out[n++] = tolower((unsigned char) raw[i]);
+        out[n++] = ':';
+        for (i = colon ? colon - raw + 1 : rawlen; i < rawlen; i++) {
+            if (raw[i] == '\r' || raw[i] == '\n')
+                continue;
+            if (is_wsp(raw[i])) {
+                space = 1;
+                continue;
+            }
+            // Leading whitespace of the value is dropped
+            if (space && out[n - 1] != ':')
+                out[n++] = ' ';
+            space = 0;
+            out[n++] = raw[i];
+        }
+    }
+    if (crlf) {
+        out[n++] = '\r';
+        out[n++] = '\n';
+    }
+    *len += n;
+}
+
+/** Builds the data covered by the header hash of a signature. */
+static char *signed_header_data(dkim_t d, struct signature *s, size_t *len) {
+    char used[DKIM_MAX_HEADERS] = { 0 };
+    char *names = strdup(s->signed_headers), *save = NULL, *name;
+    char *buf = NULL;
+    size_t cap = 0;
+
+    *len = 0;
+    for (name = strtok_r(names, ":", &save); name; name = strtok_r(NULL, ":", &save)) {
+        while (is_fws(*name))
+            name++;
+        size_t namelen = strlen(name);
+        while (namelen > 0 && is_fws(name[namelen - 1]))
+            namelen--;
+
+        // Each occurrence of a name selects the next matching header,
+        // from the bottom up
+        for (int i = d->nhdr - 1; i >= 0; i--) {
+            const char *h = d->headers + d->hdr[i].start;
+            if (used[i] || strncasecmp(h, name, namelen))
+                continue;
+            const char *p = h + namelen;
+            while (is_wsp(*p))
+                p++;
+            if (*p != ':')
+                continue;
+            used[i] = 1;
+            canon_header(&buf, len, &cap, h, d->hdr[i].len, s->relaxed_header, 1);
+            break;
+        }
+    }
+    free(names);
+
+    // The signature header itself, with an empty b= value and no CRLF
+    const char *raw = d->headers + d->hdr[s->header].start;
+    size_t rawlen = d->hdr[s->header].len;
+    char *copy = malloc(rawlen + 1);
+    size_t n = 0, i = 0;
+    const char *colon = memchr(raw, ':', rawlen);
+
+    for (; i <= (size_t) (colon - raw); i++)
+        copy[n++] = raw[i];
+    while (i < rawlen) {
+        while (i < rawlen && is_fws(raw[i]))
+            copy[n++] = raw[i++];
+        size_t tag = i;
+        while (i < rawlen && raw[i] != '=' && raw[i] != ';' && !is_fws(raw[i]))
+            copy[n++] = raw[i++];
+        int is_b = i - tag == 1 && raw[tag] == 'b', seen_equals = 0;
+        while (i < rawlen && raw[i] != ';') {
+            if (is_b && seen_equals) {
+                i++;
+                continue;
+            }
+            seen_equals |= raw[i] == '=';
+            copy[n++] = raw[i++];
+        }
+        if (i < rawlen)
+            copy[n++] = raw[i++];
+    }
+    canon_header(&buf, len, &cap, copy, n, s->relaxed_header, 0);
+    free(copy);
+    return buf;
+}
+
+/** Builds a public key from a key record. */
+static EVP_PKEY *record_key(const char *record, Dkim_alg alg, const char **error) {
+    char *k = tag_value(record, "k"), *p = tag_value(record, "p");
+    unsigned char *der = NULL;
+    EVP_PKEY *key = NULL;
+    int len;
+
+    if (!p) {
+        *error = "no key in record";
+    } else if (!*p) {
+        *error = "key revoked";
+    } else if ((len = base64_decode(p, &der)) <= 0) {
+        *error = "bad key";
+    } else if (alg == Alg_ed25519_sha256) {
+        if (!k || strcmp(k, "ed25519"))
+            *error = "key type mismatch";
+        else if (!(key = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, der, len)))
+            *error = "bad key";
+    } else {
+        const unsigned char *q = der;
+        if (k && strcmp(k, "rsa"))
+            *error = "key type mismatch";
+        else if (!(key = d2i_PUBKEY(NULL, &q, len)))
+            *error = "bad key";
+    }
+    free(der);
+    free(k);
+    free(p);
+    return key;
+}
+
+/** Verifies one signature. Returns the result ("pass", "fail",
+ *  "permerror" or "temperror"), and sets reason for anything else
+ *  than a pass.
+ */
+static const char *verify(dkim_t d, struct signature *s, const char **reason) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashlen;
+    char name[512], record[DKIM_MAX_RECORD];
+    const char *result = "fail";
+    EVP_PKEY *key;
+
+    if (s->error) {
+        *reason = s->error;
+        return "permerror";
+    }
+
+    // Body: the simple canonicalization of an empty body is one CRLF
+    if (!s->relaxed_body && !s->any_output)
+        body_update(s, "\r\n", 2);
+    EVP_DigestFinal_ex(s->ctx, hash, &hashlen);
+    if ((int) hashlen != s->body_hash_len || memcmp(hash, s->body_hash, hashlen)) {
+        *reason = "body hash did not verify";
+        return "fail";
+    }
+
+    key_name(s, name, sizeof(name));
+    switch (cached_key(name, record, sizeof(record))) {
+    case KEY_PENDING:
+        *reason = "key lookup pending";
+        return "temperror";
+    case -1:
+        *reason = "key lookup failed";
+        return "temperror";
+    case 0:
+        *reason = "no key";
+        return "permerror";
+    }
+    if (!(key = record_key(record, s->alg, reason)))
+        return "permerror";
+
+    size_t len;
+    char *data = signed_header_data(d, s, &len);
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    int ok;
+    if (s->alg == Alg_ed25519_sha256) {
+        // The Ed25519 signature is over the SHA-256 hash (RFC 8463)
+        EVP_Digest(data, len, hash, &hashlen, EVP_sha256(), NULL);
+        ok = EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, key) == 1 &&
+             EVP_DigestVerify(ctx, s->sig, s->sig_len, hash, hashlen) == 1;
+    } else {
+        ok = EVP_DigestVerifyInit(ctx, NULL, s->alg == Alg_rsa_sha1 ? EVP_sha1() : EVP_sha256(),
+                                  NULL, key) == 1 &&
+             EVP_DigestVerify(ctx, s->sig, s->sig_len, (unsigned char *) data, len) == 1;
+    }
+    if (ok)
+        result = "pass";
+    else
+        *reason = "signature did not verify";
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(key);
+    free(data);
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/* Interface                                                           */
+
+/** Creates the verification state for one message. */
+dkim_t dkim_create(void) {
+    return calloc(1, sizeof(struct dkim));
+}
+
+/** Adds one line of the message, as received (after dot-unstuffing),
+ *  without its CRLF.
+ */
+void dkim_line(dkim_t d, const char *line, size_t len) {
+    if (d->in_body) {
+        for (int i = 0; i < d->nsigs; i++)
+            if (!d->sigs[i].error)
+                body_line(&d->sigs[i], line, len);
+        return;
+    }
+    if (len == 0) {
+        end_of_headers(d);
+        return;
+    }
+
+    int continuation = is_wsp(line[0]) && d->nhdr > 0;
+    if (!continuation && d->nhdr == DKIM_MAX_HEADERS)
+        return;
+    if (d->hlen + len + 2 > DKIM_MAX_HEADER_LEN)
+        return;
+    if (d->hlen + len + 2 > d->hcap) {
+        d->hcap = (d->hlen + len + 2) * 2;
+        d->headers = realloc(d->headers, d->hcap);
+    }
+    if (continuation) {
+        memcpy(d->headers + d->hlen, "\r\n", 2);
+        d->hlen += 2;
+        d->hdr[d->nhdr - 1].len += 2 + len;
+    } else {
+        d->hdr[d->nhdr].start = d->hlen;
+        d->hdr[d->nhdr].len = len;
+        d->nhdr++;
+    }
+    memcpy(d->headers + d->hlen, line, len);
+    d->hlen += len;
+}
+
+/** Verifies the signatures of a complete message and formats the
+ *  result as an Authentication-Results header, terminated by CRLF.
+ *
+ *  Parameters: host: name of this host (the authserv-id).
+ *              buf, size: buffer receiving the header. A header that
+ *                         does not fit is truncated.
+ *
+ *  Returns: the length of the header in buf.
+ */
+size_t dkim_result(dkim_t d, const char *host, char *buf, size_t size) {
+    size_t n;
+
+    if (!d->in_body)
+        end_of_headers(d);   // message without a body
+    n = snprintf(buf, size, "Authentication-Results: %s;", host);
+    if (d->nsigs == 0 && n < size)
+        n += snprintf(buf + n, size - n, " dkim=none");
+    for (int i = 0; i < d->nsigs && n < size; i++) {
+        struct signature *s = &d->sigs[i];
+        const char *reason = NULL, *result = verify(d, s, &reason);
+        dlog("dkim: %s (%s) d=%s s=%s\n", result, reason ? reason : "ok",
+             s->domain ? s->domain : "?", s->selector ? s->selector : "?");
+        n += snprintf(buf + n, size - n, "%s\r\n\tdkim=%s%s%s%s header.d=%s header.s=%s",
+                      i ? ";" : "", result, reason ? " (" : "", reason ? reason : "",
+                      reason ? ")" : "", s->domain ? s->domain : "unknown",
+                      s->selector ? s->selector : "unknown");
+    }
+    if (n + 2 >= size)
+        n = size - 3;
+    memcpy(buf + n, "\r\n", 3);
+    return n + 2;
+}
+
+/** Frees the verification state of a message. */
+void dkim_destroy(dkim_t d) {
+    if (!d)
+        return;
+    for (int i = 0; i < d->nsigs; i++) {
+        struct signature *s = &d->sigs[i];
+        EVP_MD_CTX_free(s->ctx);
+        free(s->domain);
+        free(s->selector);
+        free(s->signed_headers);
+        free(s->body_hash);
+        free(s->sig);
+    }
+    free(d->headers);
+    free(d);
+}
@@ -0,0 +1,28 @@
+/* dkim.h
+ * DKIM signature verification (RFC 6376) of incoming messages, done
+ * while the message is received.
+ */
+
+#ifndef _DKIM_H_
+#define _DKIM_H_
+
+#include <stddef.h>
+
+typedef struct dkim *dkim_t;
+
+/* Looks up the key record (TXT) for a name such as
+ * "selector._domainkey.example.com". Returns 1 and fills record if
+ * found, 0 if there is no key, -1 on a temporary failure.
+ */
+typedef int (*dkim_key_resolver)(const char *name, char *record, size_t len);
+
+int    dkim_init(const char *keys);
+void   dkim_set_resolver(dkim_key_resolver resolver);
+int    dkim_enabled(void);
+
+dkim_t dkim_create(void);
+void   dkim_line(dkim_t d, const char *line, size_t len);
+size_t dkim_result(dkim_t d, const char *host, char *buf, size_t size);
+void   dkim_destroy(dkim_t d);
+
+#endif
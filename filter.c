@@ -0,0 +1,698 @@
+/* filter.c
+ * Content filter stage.
+ *
+ * When filters are configured, a session does not deliver an accepted
+ * message itself. It writes the message to the spool directory and
+ * replies at once; a pool of filter worker threads then runs the
+ * message through the filters and delivers it (locally, or to the
+ * relay queue) if they accept it. A slow filter therefore holds up a
+ * worker, not the client.
+ *
+ * Each spooled message has two files: "<queue id>.msg" with the
+ * message itself (it is hard-linked into the mailboxes on delivery),
+ * and an envelope file, written last, named like relay queue files,
+ *
+ *     <next attempt (epoch seconds)>.<attempts so far>.<queue id>
+ *
+ * holding "from", "local" and "relay" lines, and a "filtered" line once
+ * the message has passed the filters. A dispatcher thread scans
+ * the spool and hands due messages to the workers, with at most
+ * FILTER_MAX_INFLIGHT messages queued or being filtered at a time; the
+ * rest wait in the spool. Messages that get a temporary failure are
+ * rescheduled with a backoff, like relayed messages; so is a message
+ * that passed but could not be delivered to some recipients, for those
+ * recipients only and without filtering it again. A rejected message,
+ * or one still deferred after FILTER_MAX_ATTEMPTS (unless the timeout
+ * verdict is accept) or still undelivered after FILTER_MAX_ATTEMPTS, is
+ * returned to its sender in a non-delivery report; when there is nobody to report to, both of its files are
+ * moved to the "dead" subdirectory of the spool rather than deleted.
+ *
+ * Filters are either built in ("maxsize=BYTES", "header=NAME") or
+ * external programs listening on a local socket ("unix:PATH"). The
+ * external protocol is a small, milter-like exchange: the server
+ * sends
+ *
+ *     MAIL FROM:<reverse-path>
+ *     RCPT TO:<forward-path>     (one line per recipient)
+ *     DATA <length>
+ *     <length bytes of message>
+ *
+ * and the filter answers with a single SMTP-style reply line: 2xx to
+ * accept, 4xx to defer, 5xx to reject. A filter that does not answer
+ * within the filter timeout gets the configured timeout verdict,
+ * accept or tempfail.
+ */
+
+#include "filter.h"
+#include "relay.h"
+#include "util.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_FILTERS            16
+#define MAX_REPLY_LINE         1024
+#define FILTER_MAX_INFLIGHT    64
+#define FILTER_DEFAULT_TIMEOUT 30    // seconds an external filter may take
+#define FILTER_SCAN_INTERVAL   5     // seconds between spool scans
+#define FILTER_RETRY_MIN       60    // first retry delay, in seconds
+#define FILTER_RETRY_MAX       3600  // longest retry delay, in seconds
+#define FILTER_MAX_ATTEMPTS    10    // then the timeout verdict applies
+#define FILTER_DEAD_DIR        "dead"  // in the spool directory
+
+typedef enum filter_type
+{
+    Filter_maxsize,
+    Filter_header,
+    Filter_socket
+} Filter_type;
+
+struct filter {
+    Filter_type type;
+    long        maxsize;
+    char       *arg;     // header name or socket path
+};
+
+struct job {
+    char name[NAME_MAX + 1];
+    int  state;          // 0: free, 1: queued, 2: being filtered
+};
+
+static struct filter filters[MAX_FILTERS];
+static int nfilters = 0;
+static int filter_timeout = FILTER_DEFAULT_TIMEOUT;
+static Filter_verdict timeout_verdict = Filter_tempfail;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work = PTHREAD_COND_INITIALIZER;
+static struct job jobs[FILTER_MAX_INFLIGHT];
+static int wake_pipe[2] = { -1, -1 };
+
+/** Adds a filter.
+ *
+ *  Parameters: spec: "maxsize=BYTES" rejects larger messages,
+ *                    "header=NAME" rejects messages without that header,
+ *                    "unix:PATH" passes messages to an external filter.
+ *
+ *  Returns: 0 on success, -1 if the specification is invalid.
+ */
+int filter_add(const char *spec) {
+    struct filter *f = &filters[nfilters];
+    char *end;
+
+    if (nfilters == MAX_FILTERS)
+        return -1;
+    if (!strncmp(spec, "maxsize=", 8)) {
+        f->type = Filter_maxsize;
+        f->maxsize = strtol(spec + 8, &end, 10);
+        if (end == spec + 8 || *end || f->maxsize < 0)
+            return -1;
+    } else if (!strncmp(spec, "header=", 7) && spec[7]) {
+        f->type = Filter_header;
+        f->arg = strdup(spec + 7);
+    } else if (!strncmp(spec, "unix:", 5) && spec[5]) {
+        f->type = Filter_socket;
+        f->arg = strdup(spec + 5);
+    } else {
+        return -1;
+    }
+    nfilters++;
+    return 0;
+}
+
+/** Sets the time an external filter may take, and what to do with a
+ *  message when it takes longer.
+ *
+ *  Parameters: spec: "SECONDS" or "SECONDS,accept" or "SECONDS,tempfail"
+ *                    (the default).
+ *
+ *  Returns: 0 on success, -1 if the specification is invalid.
+ */
+int filter_set_timeout(const char *spec) {
+    char *end;
+    long seconds = strtol(spec, &end, 10);
+
+    if (end == spec || seconds <= 0)
+        return -1;
+    if (!*end)
+        timeout_verdict = Filter_tempfail;
+    else if (!strcmp(end, ",accept"))
+        timeout_verdict = Filter_accept;
+    else if (!strcmp(end, ",tempfail"))
+        timeout_verdict = Filter_tempfail;
+    else
+        return -1;
+    filter_timeout = seconds;
+    return 0;
+}
+
+/** Returns 1 if messages go through the filter stage. */
+int filter_enabled(void) {
+    return nfilters > 0;
+}
+
+static void wake_dispatcher(void) {
+    if (wake_pipe[1] >= 0)
+        write(wake_pipe[1], "", 1);
+}
+
+/** Writes the envelope file of a spooled message, atomically. */
+static int write_envelope(const char *name, const char *id, const char *from,
+                          user_list_t local, user_list_t relay, int filtered) {
+    char tmp[PATH_MAX];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s/tmp.%s", config.spool_dir, id);
+    f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "from %s\n", from);
+    for (; local; local = user_list_next(local))
+        fprintf(f, "local %s\n", user_list_user(local));
+    for (; relay; relay = user_list_next(relay))
+        fprintf(f, "relay %s\n", user_list_user(relay));
+    if (filtered)
+        fputs("filtered\n", f);
+    if (fflush(f) != 0 || (config.durability != Durability_none && fsync(fileno(f)) < 0)) {
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(f);
+    if (rename(tmp, name) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/** Spools a message for filtering and delivery. Called by sessions,
+ *  possibly in a forked child; the filter workers of the process that
+ *  called filter_start() pick it up.
+ *
+ *  Parameters: id: queue id of the message.
+ *              from: reverse-path of the message.
+ *              local, relay: local recipients and recipients to relay to.
+ *              data: message contents, as pieces (e.g., trace headers
+ *                    and body) that are written one after the other.
+ *              ndata: number of pieces in data.
+ *
+ *  Returns: 0 if the message was spooled, -1 otherwise.
+ */
+int filter_submit(const char *id, const char *from, user_list_t local, user_list_t relay,
+                  const struct iovec *data, int ndata) {
+    char msg[PATH_MAX], name[PATH_MAX];
+    ssize_t total = 0;
+    int fd;
+
+    mkdir(config.spool_dir, 0777);
+    snprintf(msg, sizeof(msg), "%s/%s.msg", config.spool_dir, id);
+    snprintf(name, sizeof(name), "%s/%ld.0.%s", config.spool_dir, (long) time(NULL), id);
+
+    fd = open(msg, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    for (int i = 0; i < ndata; i++)
+        total += data[i].iov_len;
+    if (writev(fd, data, ndata) != total ||
+        (config.durability != Durability_none && fsync(fd) < 0)) {
+        close(fd);
+        unlink(msg);
+        return -1;
+    }
+    close(fd);
+
+    if (write_envelope(name, id, from, local, relay, 0) < 0) {
+        unlink(msg);
+        return -1;
+    }
+    dlog("filter: %s spooled\n", id);
+    wake_dispatcher();
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Filters                                                             */
+
+/** Checks whether the header section of a message has a header. */
+static int has_header(const char *data, const char *header) {
+    size_t len = strlen(header);
+    const char *line = data;
+
+    while (*line && strncmp(line, "\r\n", 2)) {
+        if (!strncasecmp(line, header, len) && line[len] == ':')
+            return 1;
+        line = strstr(line, "\r\n");
+        if (!line)
+            break;
+        line += 2;
+    }
+    return 0;
+}
+
+static int send_full(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t rv = send(fd, buf, len, MSG_NOSIGNAL);
+        if (rv <= 0)
+            return -1;
+        buf += rv;
+        len -= rv;
+    }
+    return 0;
+}
+
+/** Passes a message to an external filter and returns its verdict. */
+static Filter_verdict run_socket_filter(const struct filter *f, const char *from,
+                                        const char **rcpts, int n,
+                                        const char *data, size_t len) {
+    struct sockaddr_un addr;
+    struct timeval tv = { filter_timeout, 0 };
+    char buf[MAX_REPLY_LINE];
+    size_t got = 0;
+    int fd, rv = 0, err = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", f->arg);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return Filter_tempfail;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        dlog("filter: %s: %s\n", f->arg, strerror(errno));
+        close(fd);
+        return Filter_tempfail;
+    }
+
+    snprintf(buf, sizeof(buf), "MAIL FROM:<%s>\r\n", from);
+    rv = send_full(fd, buf, strlen(buf));
+    for (int i = 0; i < n && rv == 0; i++) {
+        snprintf(buf, sizeof(buf), "RCPT TO:<%s>\r\n", rcpts[i]);
+        rv = send_full(fd, buf, strlen(buf));
+    }
+    if (rv == 0) {
+        snprintf(buf, sizeof(buf), "DATA %zu\r\n", len);
+        rv = send_full(fd, buf, strlen(buf));
+    }
+    if (rv == 0)
+        rv = send_full(fd, data, len);
+    buf[0] = 0;
+
+    // Read the reply line
+    while (rv == 0 && got < sizeof(buf) - 1 && !memchr(buf, '\n', got)) {
+        ssize_t r = recv(fd, buf + got, sizeof(buf) - 1 - got, 0);
+        if (r <= 0)
+            rv = -1;
+        else
+            got += r;
+    }
+    err = errno;
+    close(fd);
+
+    if (rv < 0) {
+        if (err == EAGAIN || err == EWOULDBLOCK) {
+            dlog("filter: %s: timed out\n", f->arg);
+            return timeout_verdict;
+        }
+        dlog("filter: %s: no reply\n", f->arg);
+        return Filter_tempfail;
+    }
+    buf[got] = 0;
+    buf[strcspn(buf, "\r\n")] = 0;
+    dlog("filter: %s: %s\n", f->arg, buf);
+    switch (buf[0]) {
+    case '2':
+        return Filter_accept;
+    case '5':
+        return Filter_reject;
+    default:
+        return Filter_tempfail;
+    }
+}
+
+/** Runs a message through all filters, stopping at the first one that
+ *  does not accept it.
+ */
+static Filter_verdict run_filters(const char *from, const char **rcpts, int n,
+                                  const char *data, size_t len) {
+    for (int i = 0; i < nfilters; i++) {
+        const struct filter *f = &filters[i];
+        Filter_verdict verdict = Filter_accept;
+
+        switch (f->type) {
+        case Filter_maxsize:
+            if (len > (size_t) f->maxsize)
+                verdict = Filter_reject;
+            break;
+        case Filter_header:
+            if (!has_header(data, f->arg))
+                verdict = Filter_reject;
+            break;
+        case Filter_socket:
+            verdict = run_socket_filter(f, from, rcpts, n, data, len);
+            break;
+        }
+        if (verdict != Filter_accept)
+            return verdict;
+    }
+    return Filter_accept;
+}
+
+/* ------------------------------------------------------------------ */
+/* Workers                                                             */
+
+static int backoff(int attempts) {
+    int delay = FILTER_RETRY_MIN;
+    while (--attempts > 0 && delay < FILTER_RETRY_MAX)
+        delay *= 2;
+    return delay < FILTER_RETRY_MAX ? delay : FILTER_RETRY_MAX;
+}
+
+/** Delivers a message that passed the filters.
+ *
+ *  Returns: the number of recipients it could not be delivered to, who
+ *           are added to failed_local and failed_relay.
+ */
+static int deliver(const char *id, const char *msg, const char *from,
+                   user_list_t local, user_list_t relay, const char *data, size_t len,
+                   user_list_t *failed_local, user_list_t *failed_relay) {
+    for (; local; local = user_list_next(local))
+        if (save_user_mail_one(msg, user_list_user(local)) < 0)
+            user_list_add(failed_local, user_list_user(local));
+    if (relay) {
+        struct iovec body = { (void *) data, len };
+        relay_enqueue(from, relay, &body, 1, failed_relay);
+    }
+
+    int failures = user_list_len(*failed_local) + user_list_len(*failed_relay);
+    if (failures)
+        dlog("filter: %s: not delivered to %d recipient(s)\n", id, failures);
+    else
+        dlog("filter: %s: delivered\n", id);
+    return failures;
+}
+
+/** Moves a rejected message that cannot be returned to its sender (its
+ *  envelope and message files) to the dead-letter directory.
+ *
+ *  Returns: 0 on success, -1 if the message is still in the spool.
+ */
+static int keep_dead(const char *name, const char *id) {
+    char from[PATH_MAX], to[PATH_MAX];
+
+    snprintf(to, sizeof(to), "%s/" FILTER_DEAD_DIR, config.spool_dir);
+    mkdir(to, 0777);
+    snprintf(from, sizeof(from), "%s/%s.msg", config.spool_dir, id);
+    snprintf(to, sizeof(to), "%s/" FILTER_DEAD_DIR "/%s.msg", config.spool_dir, id);
+    if (rename(from, to) < 0) {
+        dlog("filter: %s: cannot keep rejected message: %s\n", id, strerror(errno));
+        return -1;
+    }
+    snprintf(from, sizeof(from), "%s/%s", config.spool_dir, name);
+    snprintf(to, sizeof(to), "%s/" FILTER_DEAD_DIR "/%s", config.spool_dir, name);
+    if (rename(from, to) < 0) {
+        dlog("filter: %s: cannot keep rejected message: %s\n", id, strerror(errno));
+        // Put the message back with its envelope
+        snprintf(from, sizeof(from), "%s/" FILTER_DEAD_DIR "/%s.msg", config.spool_dir, id);
+        snprintf(to, sizeof(to), "%s/%s.msg", config.spool_dir, id);
+        rename(from, to);
+        return -1;
+    }
+    dlog("filter: %s: kept in " FILTER_DEAD_DIR "\n", id);
+    return 0;
+}
+
+/** Filters and delivers one spooled message, then removes or
+ *  reschedules it.
+ */
+static void filter_entry(const char *name, int attempts, const char *id) {
+    char path[PATH_MAX], msg[PATH_MAX], newpath[PATH_MAX];
+    char *envelope = NULL, *data = NULL, *p, *from = NULL;
+    const char **rcpts = NULL;
+    user_list_t local = NULL, relay = NULL, failed_local = NULL, failed_relay = NULL;
+    struct stat st, msg_st;
+    int fd, msg_fd = -1, n = 0, cap = 0, filtered = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", config.spool_dir, name);
+    snprintf(msg, sizeof(msg), "%s/%s.msg", config.spool_dir, id);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    // Another process may be filtering (or have just rescheduled) it
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0 || st.st_nlink == 0)
+        goto done;
+
+    envelope = malloc(st.st_size + 1);
+    msg_fd = open(msg, O_RDONLY | O_CLOEXEC);
+    if (!envelope || read(fd, envelope, st.st_size) != st.st_size ||
+        msg_fd < 0 || fstat(msg_fd, &msg_st) < 0 ||
+        !(data = malloc(msg_st.st_size + 1)) ||
+        read(msg_fd, data, msg_st.st_size) != msg_st.st_size) {
+        dlog("filter: %s: unreadable spool entry, removed\n", id);
+        unlink(path);
+        unlink(msg);
+        goto done;
+    }
+    envelope[st.st_size] = 0;
+    data[msg_st.st_size] = 0;
+
+    for (p = envelope; *p; ) {
+        char *eol = strchr(p, '\n');
+        if (!eol)
+            break;
+        *eol = 0;
+        if (!strncmp(p, "from ", 5))
+            from = p + 5;
+        else if (!strncmp(p, "local ", 6))
+            user_list_add(&local, p + 6);
+        else if (!strncmp(p, "relay ", 6))
+            user_list_add(&relay, p + 6);
+        else if (!strcmp(p, "filtered"))
+            filtered = 1;
+        if (!strncmp(p, "local ", 6) || !strncmp(p, "relay ", 6)) {
+            if (n == cap)
+                rcpts = realloc(rcpts, (cap = cap ? cap * 2 : 8) * sizeof(*rcpts));
+            rcpts[n++] = p + 6;
+        }
+        p = eol + 1;
+    }
+    if (!from || !n) {
+        dlog("filter: %s: malformed envelope, removed\n", id);
+        unlink(path);
+        unlink(msg);
+        goto done;
+    }
+
+    // A message retried for delivery has passed the filters already
+    Filter_verdict verdict = filtered ? Filter_accept : run_filters(from, rcpts, n, data, msg_st.st_size);
+    const char *reason = "rejected by a content filter";
+    char expired[64];
+    if (verdict == Filter_tempfail && ++attempts >= FILTER_MAX_ATTEMPTS) {
+        dlog("filter: %s: still deferred after %d attempts\n", id, attempts);
+        verdict = timeout_verdict == Filter_accept ? Filter_accept : Filter_reject;
+        snprintf(expired, sizeof(expired), "still deferred by a content filter after %d attempts", attempts);
+        reason = expired;
+    }
+    switch (verdict) {
+    case Filter_accept: {
+        int nfailed = deliver(id, msg, from, local, relay, data, msg_st.st_size,
+                              &failed_local, &failed_relay);
+        if (!nfailed) {
+            unlink(path);
+            unlink(msg);
+            break;
+        }
+        // The envelope is rewritten with the recipients that failed
+        if (++attempts < FILTER_MAX_ATTEMPTS) {
+            snprintf(newpath, sizeof(newpath), "%s/%ld.%d.%s", config.spool_dir,
+                     (long) (time(NULL) + backoff(attempts)), attempts, id);
+            if (write_envelope(newpath, id, from, failed_local, failed_relay, 1) == 0)
+                unlink(path);
+            dlog("filter: %s: delivery deferred, attempt %d\n", id, attempts);
+            break;
+        }
+
+        const char *failed[nfailed];
+        user_list_t u = failed_local;
+        for (int i = 0; i < nfailed; i++, u = user_list_next(u)) {
+            if (!u)
+                u = failed_relay;
+            failed[i] = user_list_user(u);
+        }
+        snprintf(expired, sizeof(expired), "still undeliverable after %d attempts", attempts);
+        if (relay_bounce(id, from, failed, nfailed, expired, data, msg_st.st_size) == 0) {
+            unlink(path);
+            unlink(msg);
+            break;
+        }
+        if (write_envelope(path, id, from, failed_local, failed_relay, 1) == 0 && keep_dead(name, id) == 0)
+            break;
+        snprintf(newpath, sizeof(newpath), "%s/%ld.%d.%s", config.spool_dir,
+                 (long) (time(NULL) + backoff(attempts)), attempts, id);
+        rename(path, newpath);
+        break;
+    }
+    case Filter_reject:
+        dlog("filter: %s: rejected, from <%s>\n", id, from);
+        if (relay_bounce(id, from, rcpts, n, reason, data, msg_st.st_size) == 0) {
+            unlink(path);
+            unlink(msg);
+            break;
+        }
+        if (keep_dead(name, id) == 0)
+            break;
+        // Nowhere to put it, try again later
+        // fall through
+    case Filter_tempfail:
+        snprintf(newpath, sizeof(newpath), "%s/%ld.%d.%s", config.spool_dir,
+                 (long) (time(NULL) + backoff(attempts)), attempts, id);
+        rename(path, newpath);
+        dlog("filter: %s: deferred, attempt %d\n", id, attempts);
+        break;
+    }
+
+done:
+    user_list_destroy(local);
+    user_list_destroy(relay);
+    user_list_destroy(failed_local);
+    user_list_destroy(failed_relay);
+    free(rcpts);
+    free(envelope);
+    free(data);
+    if (msg_fd >= 0)
+        close(msg_fd);
+    close(fd);
+}
+
+static void *worker(void *arg) {
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        struct job *job = NULL;
+        for (int i = 0; i < FILTER_MAX_INFLIGHT && !job; i++)
+            if (jobs[i].state == 1)
+                job = &jobs[i];
+        if (!job) {
+            pthread_cond_wait(&work, &lock);
+            continue;
+        }
+        job->state = 2;
+        pthread_mutex_unlock(&lock);
+
+        long next;
+        int attempts, pos = 0;
+        sscanf(job->name, "%ld.%d.%n", &next, &attempts, &pos);
+        filter_entry(job->name, attempts, job->name + pos);
+
+        pthread_mutex_lock(&lock);
+        job->state = 0;
+        // A slot is free; more of the spool can be dispatched
+        wake_dispatcher();
+    }
+    return NULL;
+}
+
+/** Hands due spooled messages to the workers, as long as there are
+ *  free slots.
+ *
+ *  Returns: the earliest time at which a waiting message is due, or 0
+ *           if none is waiting for a later time.
+ */
+static time_t dispatch(void) {
+    DIR *dir = opendir(config.spool_dir);
+    struct dirent *entry;
+    time_t next_due = 0;
+
+    if (!dir)
+        return 0;
+    pthread_mutex_lock(&lock);
+    while ((entry = readdir(dir)) != NULL) {
+        long next;
+        int attempts, pos = 0, free_slot = -1, busy = 0;
+        if (sscanf(entry->d_name, "%ld.%d.%n", &next, &attempts, &pos) != 2 || !pos)
+            continue;
+        if (next > time(NULL)) {
+            if (!next_due || next < next_due)
+                next_due = next;
+            continue;
+        }
+        for (int i = 0; i < FILTER_MAX_INFLIGHT && !busy; i++) {
+            if (jobs[i].state && !strcmp(jobs[i].name, entry->d_name))
+                busy = 1;
+            else if (!jobs[i].state && free_slot < 0)
+                free_slot = i;
+        }
+        if (busy)
+            continue;
+        if (free_slot < 0)
+            break;   // in-flight limit reached; a finishing worker wakes us
+        snprintf(jobs[free_slot].name, sizeof(jobs[free_slot].name), "%s", entry->d_name);
+        jobs[free_slot].state = 1;
+        pthread_cond_signal(&work);
+    }
+    pthread_mutex_unlock(&lock);
+    closedir(dir);
+    return next_due;
+}
+
+static void *dispatcher(void *arg) {
+    char buf[64];
+    for (;;) {
+        time_t next_due = dispatch();
+
+        // Sleep until the next message is due, the next periodic scan,
+        // a new message is spooled, or a worker slot becomes free.
+        time_t now = time(NULL);
+        int timeout = FILTER_SCAN_INTERVAL;
+        if (next_due && next_due - now < timeout)
+            timeout = next_due > now ? next_due - now : 0;
+        struct pollfd pfd = { wake_pipe[0], POLLIN, 0 };
+        if (poll(&pfd, 1, timeout * 1000) > 0)
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+    }
+    return NULL;
+}
+
+/** Starts the filter dispatcher and workers, if any filter is
+ *  configured. They filter messages spooled by this process and by any
+ *  process forked from it.
+ */
+void filter_start(void) {
+    pthread_t thread;
+
+    if (!nfilters)
+        return;
+    mkdir(config.spool_dir, 0777);
+    if (pipe(wake_pipe) < 0 ||
+        fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) < 0 ||
+        pthread_create(&thread, NULL, dispatcher, NULL) != 0) {
+        perror("filter");
+        exit(1);
+    }
+    pthread_detach(thread);
+    for (int i = 0; i < config.filter_workers; i++) {
+        if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+            perror("filter");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,28 @@
+/* filter.h
+ * Content filtering of accepted messages. Filtered messages are
+ * spooled, checked by a pool of filter workers, and only then
+ * delivered locally or queued for relaying.
+ */
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <sys/uio.h>
+
+#include "mailuser.h"
+
+typedef enum filter_verdict
+{
+    Filter_accept,
+    Filter_reject,
+    Filter_tempfail
+} Filter_verdict;
+
+int  filter_add(const char *spec);
+int  filter_set_timeout(const char *spec);
+int  filter_enabled(void);
+int  filter_submit(const char *id, const char *from, user_list_t local, user_list_t relay,
+                   const struct iovec *data, int ndata);
+void filter_start(void);
+
+#endif
@@ -0,0 +1,338 @@
+/* greylist.c
+ * Greylisting. The first time a (client network, sender, recipient)
+ * triplet is seen, the recipient is deferred with a 450; a client
+ * that retries after the greylisting delay is let through, and the
+ * triplet is remembered for a long time. Most junk senders never
+ * retry.
+ *
+ * The client network is the /24 of an IPv4 address or the /64 of an
+ * IPv6 address, since large senders retry from other hosts of the same
+ * pool. Triplets are stored as 64-bit hashes in an open-addressing
+ * (linear probing) table of fixed size, 16 bytes per entry. When the
+ * table is three quarters full, new triplets are let through rather
+ * than tracked. Entries expire: a lookup that finds an expired entry
+ * starts it over, and the server process sweeps expired entries out
+ * once per time bucket (GREYLIST_BUCKET seconds), GREYLIST_SWEEP_SLOTS
+ * slots at a time so that sessions never wait long for the lock. The
+ * sweep uses backward-shift deletion, so the table needs no tombstones.
+ *
+ * The table lives in shared memory, so that processes forked per
+ * client (DOFORK) all use and update the one table of the server, and
+ * is protected by a process-shared robust mutex. The server process
+ * writes a snapshot of it to GREYLIST_SNAPSHOT_FILE in the spool
+ * directory every few minutes, and loads it on startup.
+ */
+
+#include "greylist.h"
+#include "util.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#define GREYLIST_DEFAULT_ENTRIES 262144
+#define GREYLIST_PENDING_TTL     (4 * 3600)        // time to retry in
+#define GREYLIST_PASSED_TTL      (36 * 24 * 3600)  // time a passed triplet is kept
+#define GREYLIST_BUCKET          60                // seconds between sweeps
+#define GREYLIST_SWEEP_SLOTS     4096              // slots swept per hold of the lock
+#define GREYLIST_SNAPSHOT_EVERY  300               // seconds between snapshots
+#define GREYLIST_MAGIC           "GREYLST1"
+
+struct entry {
+    uint64_t key;         // 0 for a free slot
+    uint32_t first_seen;  // 0 once the triplet has passed
+    uint32_t expires;
+};
+
+struct table {
+    pthread_mutex_t lock;
+    uint32_t mask;        // capacity - 1; the capacity is a power of 2
+    uint32_t count;
+    int      dirty;
+    struct entry entries[];
+};
+
+static struct table *table = NULL;
+static int delay = 0;
+
+/** Hashes a triplet. */
+static uint64_t triplet_key(const char *peer, const char *sender, const char *rcpt) {
+    unsigned char net[16];
+    uint64_t h = 14695981039346656037ull;
+    size_t netlen = 0;
+
+    if (inet_pton(AF_INET, peer, net) == 1) {
+        net[3] = 0;
+        netlen = 4;
+    } else if (inet_pton(AF_INET6, peer, net) == 1) {
+        memset(net + 8, 0, 8);
+        netlen = 16;
+    }
+    for (size_t i = 0; i < netlen; i++)
+        h = (h ^ net[i]) * 1099511628211ull;
+    for (const char *p = sender; *p; p++)
+        h = (h ^ (unsigned char) tolower((unsigned char) *p)) * 1099511628211ull;
+    h = (h ^ 0xff) * 1099511628211ull;
+    for (const char *p = rcpt; *p; p++)
+        h = (h ^ (unsigned char) tolower((unsigned char) *p)) * 1099511628211ull;
+
+    // Mix the high bits into the low ones, which pick the slot
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+static void lock_table(void) {
+    // The lock is robust: a session process that died holding it
+    // does not wedge the others.
+    if (pthread_mutex_lock(&table->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&table->lock);
+}
+
+/** Removes the entry in slot i, moving later entries of the same probe
+ *  run back so that lookups still find them. Called with the lock held.
+ */
+static void delete_slot(uint32_t i) {
+    uint32_t j = i;
+
+    for (;;) {
+        j = (j + 1) & table->mask;
+        if (!table->entries[j].key)
+            break;
+        uint32_t home = table->entries[j].key & table->mask;
+        // Move the entry back unless its home slot lies in (i, j]
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            table->entries[i] = table->entries[j];
+            i = j;
+        }
+    }
+    table->entries[i].key = 0;
+    table->count--;
+}
+
+/** Removes the expired entries of slots [start, end). Called with the
+ *  lock held.
+ */
+static void sweep(uint32_t start, uint32_t end, uint32_t now) {
+    for (uint32_t i = start; i < end; i++)
+        // Deleting may move another entry into slot i; check it again
+        while (table->entries[i].key && table->entries[i].expires <= now) {
+            delete_slot(i);
+            table->dirty = 1;
+        }
+}
+
+/** Returns the slot holding a key, or the free slot where it belongs.
+ *  Called with the lock held.
+ */
+static struct entry *find_slot(uint64_t key) {
+    uint32_t i = key & table->mask;
+
+    while (table->entries[i].key && table->entries[i].key != key)
+        i = (i + 1) & table->mask;
+    return &table->entries[i];
+}
+
+static void snapshot_path(char *path, size_t size, const char *suffix) {
+    snprintf(path, size, "%s/" GREYLIST_SNAPSHOT_FILE "%s", config.spool_dir, suffix);
+}
+
+static void load_snapshot(void) {
+    char path[PATH_MAX], magic[8];
+    FILE *f;
+    struct entry e;
+    uint32_t now = time(NULL), loaded = 0;
+
+    snapshot_path(path, sizeof(path), "");
+    if (!(f = fopen(path, "r")))
+        return;
+    if (fread(magic, 1, 8, f) == 8 && !memcmp(magic, GREYLIST_MAGIC, 8)) {
+        while (fread(&e, sizeof(e), 1, f) == 1 && table->count < (table->mask + 1) / 4 * 3) {
+            struct entry *slot = find_slot(e.key);
+            if (!e.key || e.expires <= now || slot->key)
+                continue;
+            *slot = e;
+            table->count++;
+            loaded++;
+        }
+    }
+    fclose(f);
+    dlog("greylist: loaded %u entries\n", loaded);
+}
+
+/** Writes the table to the snapshot file, atomically, if greylisting
+ *  is enabled and the table changed since the last snapshot.
+ */
+void greylist_save(void) {
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct entry *copy;
+    uint32_t n = 0;
+    FILE *f;
+
+    if (!table)
+        return;
+    lock_table();
+    if (!table->dirty) {
+        pthread_mutex_unlock(&table->lock);
+        return;
+    }
+    copy = malloc((size_t) table->count * sizeof(struct entry) + 1);
+    for (uint32_t i = 0; copy && i <= table->mask; i++)
+        if (table->entries[i].key)
+            copy[n++] = table->entries[i];
+    table->dirty = 0;
+    pthread_mutex_unlock(&table->lock);
+    if (!copy)
+        return;
+
+    // The lock is not held while writing
+    snapshot_path(path, sizeof(path), "");
+    snapshot_path(tmp, sizeof(tmp), ".tmp");
+    mkdir(config.spool_dir, 0777);
+    f = fopen(tmp, "w");
+    if (f) {
+        fwrite(GREYLIST_MAGIC, 1, 8, f);
+        fwrite(copy, sizeof(struct entry), n, f);
+        if (fclose(f) == 0)
+            rename(tmp, path);
+        else
+            unlink(tmp);
+    }
+    free(copy);
+    dlog("greylist: saved %u entries\n", n);
+}
+
+/** Enables greylisting. The last snapshot is loaded by greylist_start(),
+ *  once the spool directory is configured.
+ *
+ *  Parameters: spec: "DELAY" or "DELAY,ENTRIES": the number of seconds
+ *                    a client must wait before retrying, and the table
+ *                    size (rounded up to a power of 2).
+ *
+ *  Returns: 0 on success, -1 on failure.
+ */
+int greylist_init(const char *spec) {
+    long entries = GREYLIST_DEFAULT_ENTRIES;
+    pthread_mutexattr_t attr;
+    char *end;
+    size_t capacity = 1024;
+
+    delay = strtol(spec, &end, 10);
+    if (end == spec || delay <= 0)
+        return -1;
+    if (*end == ',')
+        entries = strtol(end + 1, &end, 10);
+    if (*end || entries <= 0)
+        return -1;
+    while (capacity < (size_t) entries && capacity < (1u << 31))
+        capacity *= 2;
+
+    table = mmap(NULL, sizeof(struct table) + capacity * sizeof(struct entry),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        table = NULL;
+        return -1;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&table->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    table->mask = capacity - 1;
+    return 0;
+}
+
+/** Returns 1 if greylisting is enabled. */
+int greylist_enabled(void) {
+    return table != NULL;
+}
+
+/** Checks a triplet, and records it.
+ *
+ *  Parameters: peer: numeric address of the client.
+ *              sender: reverse-path of the transaction.
+ *              rcpt: forward-path being checked.
+ *
+ *  Returns: 1 if the recipient should be deferred, 0 if it passes.
+ */
+int greylist_check(const char *peer, const char *sender, const char *rcpt) {
+    uint64_t key = triplet_key(peer, sender, rcpt);
+    uint32_t now = time(NULL);
+    int defer = 1;
+
+    lock_table();
+    struct entry *e = find_slot(key);
+    if (e->key && e->expires > now) {
+        if (!e->first_seen || now - e->first_seen >= (uint32_t) delay) {
+            if (e->first_seen)
+                dlog("greylist: %s <%s> -> <%s> passed\n", peer, sender, rcpt);
+            e->first_seen = 0;
+            e->expires = now + GREYLIST_PASSED_TTL;
+            defer = 0;
+        }
+    } else if (e->key) {
+        // Expired, but not swept yet: start over
+        e->first_seen = now;
+        e->expires = now + (GREYLIST_PENDING_TTL > 2 * delay ? GREYLIST_PENDING_TTL : 2 * delay);
+    } else if (table->count >= (table->mask + 1) / 4 * 3) {
+        defer = 0;   // table full: let it through rather than track it
+    } else {
+        e->key = key;
+        e->first_seen = now;
+        e->expires = now + (GREYLIST_PENDING_TTL > 2 * delay ? GREYLIST_PENDING_TTL : 2 * delay);
+        table->count++;
+    }
+    table->dirty = 1;
+    pthread_mutex_unlock(&table->lock);
+    return defer;
+}
+
+/** Sweeps the whole table, taking the lock for GREYLIST_SWEEP_SLOTS
+ *  slots at a time.
+ */
+static void sweep_table(void) {
+    uint32_t now = time(NULL);
+
+    for (uint64_t start = 0; start <= table->mask; start += GREYLIST_SWEEP_SLOTS) {
+        uint64_t end = start + GREYLIST_SWEEP_SLOTS;
+        lock_table();
+        sweep(start, end <= table->mask ? end : table->mask + 1, now);
+        pthread_mutex_unlock(&table->lock);
+    }
+}
+
+static void *snapshot_thread(void *arg) {
+    for (int elapsed = GREYLIST_BUCKET;; elapsed += GREYLIST_BUCKET) {
+        sleep(GREYLIST_BUCKET);
+        sweep_table();
+        if (elapsed % GREYLIST_SNAPSHOT_EVERY == 0)
+            greylist_save();
+    }
+    return NULL;
+}
+
+/** Loads the last snapshot and starts sweeping the table and writing
+ *  periodic snapshots of it, if greylisting is enabled. Called once,
+ *  by the server process.
+ */
+void greylist_start(void) {
+    pthread_t thread;
+
+    if (!table)
+        return;
+    load_snapshot();
+    if (pthread_create(&thread, NULL, snapshot_thread, NULL) == 0)
+        pthread_detach(thread);
+}
@@ -0,0 +1,16 @@
+/* greylist.h
+ * Greylisting of (client network, sender, recipient) triplets.
+ */
+
+#ifndef _GREYLIST_H_
+#define _GREYLIST_H_
+
+#define GREYLIST_SNAPSHOT_FILE "greylist.db"   // in the spool directory
+
+int  greylist_init(const char *spec);
+int  greylist_enabled(void);
+int  greylist_check(const char *peer, const char *sender, const char *rcpt);
+void greylist_start(void);
+void greylist_save(void);
+
+#endif
@@ -5,24 +5,37 @@
  *
  * Modified by: Norm Hutchinson
  * Modified: Mar 5, 2022
+ *
+ * The users file and the mailbox directories are cached: a hash table
+ * of the users, and for each user's mailbox an open directory and the
+ * next mail file number. The caches are filled at startup by a warm-up
+ * phase (mailuser_warmup_start); until an entry is warm, the uncached
+ * code paths are used, so the server may serve during warm-up.
  */
 
 #include "mailuser.h"
+#include "config.h"
+#include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <stdint.h>
+#include <ctype.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
-#define USER_FILE_NAME "users.txt"
-#define MAIL_BASE_DIRECTORY "mail.store"
 #define MAIL_FILE_SUFFIX ".mail"
+#define WARMUP_REPORT_STEP 10   // percent of mailboxes between progress reports
 
 struct user_list {
     char *user;
@@ -30,7 +43,7 @@ struct user_list {
 };
 
 struct mail_item {
-    char file_name[2 * NAME_MAX];
+    char file_name[PATH_MAX];
     size_t file_size;
     int deleted;
 };
@@ -40,6 +53,131 @@ struct mail_list {
     struct mail_list *next;
 };
 
+struct user_entry {
+    const char *name;           // NULL for a free slot
+    const char *password;
+    int         dirfd;          // mailbox directory, or -1 if not open
+    int         next_mail;      // mail file number likely to be free next
+};
+
+struct user_table {
+    char             *data;     // the users file; names and passwords point into it
+    size_t            mask;     // capacity - 1; the capacity is a power of 2
+    size_t            count;
+    struct timespec   mtime;    // of the users file when loaded
+    off_t             size;
+    struct user_entry slots[];
+};
+
+// Published once loaded, and never freed
+static struct user_table *user_table = NULL;
+
+// Open mailbox directories, at most max_dirfds of them
+static int ndirfds = 0, max_dirfds = 0;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             percent;    // of the mailboxes warmed up
+    int             done;
+} warmup = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 1 };
+
+/** Hashes a user name, ignoring case. */
+static size_t user_hash(const char *name) {
+    uint64_t h = 14695981039346656037ull;
+
+    for (const char *p = name; *p; p++)
+        h = (h ^ (unsigned char) tolower((unsigned char) *p)) * 1099511628211ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static struct user_entry *find_user(struct user_table *t, const char *name) {
+    size_t i = user_hash(name) & t->mask;
+
+    for (; t->slots[i].name; i = (i + 1) & t->mask)
+        if (!strcasecmp(t->slots[i].name, name))
+            return &t->slots[i];
+    return NULL;
+}
+
+/** Returns the user table, if it is loaded and the users file has not
+ *  changed since; the users file must be read otherwise.
+ */
+static struct user_table *current_users(void) {
+    struct user_table *t = __atomic_load_n(&user_table, __ATOMIC_ACQUIRE);
+    struct stat st;
+
+    if (!t || stat(config.users_file, &st) < 0 || st.st_size != t->size ||
+        st.st_mtim.tv_sec != t->mtime.tv_sec || st.st_mtim.tv_nsec != t->mtime.tv_nsec)
+        return NULL;
+    return t;
+}
+
+/** Reads the users file into a new user table. Like is_valid_user(),
+ *  the first entry of a user wins.
+ *
+ *  Returns: the table, or NULL if the file cannot be read.
+ */
+static struct user_table *load_users(void) {
+    FILE *f = fopen(config.users_file, "r");
+    struct user_table *t;
+    struct stat st;
+    size_t n = 0, capacity = 16;
+    char *data, *p, *end;
+
+    if (!f)
+        return NULL;
+    if (fstat(fileno(f), &st) < 0 || !(data = malloc(st.st_size + 1)) ||
+        fread(data, 1, st.st_size, f) != (size_t) st.st_size) {
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    data[st.st_size] = 0;
+    for (p = data; *p; p++)
+        n += *p == '\n';
+    while (capacity < (n + 1) * 4 / 3)
+        capacity *= 2;
+    if (!(t = calloc(1, sizeof(struct user_table) + capacity * sizeof(struct user_entry)))) {
+        free(data);
+        return NULL;
+    }
+    t->data = data;
+    t->mask = capacity - 1;
+    t->mtime = st.st_mtim;
+    t->size = st.st_size;
+
+    // Whitespace-separated pairs of user name and password, as read by
+    // is_valid_user()
+    for (p = data, end = data + st.st_size; p < end; ) {
+        char *tok[2];
+        int k;
+        for (k = 0; k < 2; k++) {
+            while (p < end && isspace((unsigned char) *p))
+                p++;
+            if (p == end)
+                break;
+            tok[k] = p;
+            while (p < end && !isspace((unsigned char) *p))
+                p++;
+            *p++ = 0;
+        }
+        if (k < 2 || t->count == capacity * 3 / 4)
+            break;
+        size_t i = user_hash(tok[0]) & t->mask;
+        while (t->slots[i].name && strcasecmp(t->slots[i].name, tok[0]))
+            i = (i + 1) & t->mask;
+        if (t->slots[i].name)
+            continue;
+        t->slots[i].name = tok[0];
+        t->slots[i].password = tok[1];
+        t->slots[i].dirfd = -1;
+        t->count++;
+    }
+    return t;
+}
+
 /** Internal function that opens the users file list. If file has been
  *  opened before, rewinds the pointer to beginning of the file.
  * 
@@ -49,7 +187,7 @@ static FILE *user_file_list(void) {
 
     static FILE *file_ptr = NULL;
     if (!file_ptr)
-        file_ptr = fopen(USER_FILE_NAME, "r+");
+        file_ptr = fopen(config.users_file, "r+");
     if (file_ptr)
         rewind(file_ptr);
     return file_ptr;
@@ -73,6 +211,12 @@ static FILE *user_file_list(void) {
  *           password, and zero (false) otherwise.
  */
 int is_valid_user(const char *username, const char *password) {
+    struct user_table *t = current_users();
+    if (t) {
+        struct user_entry *e = find_user(t, username);
+        return e && (password == NULL || !strcmp(password, e->password));
+    }
+
     FILE *file_ptr = user_file_list();
     if (!file_ptr) return 0;
     char user_file[MAX_USERNAME_SIZE+1];
@@ -136,6 +280,155 @@ void user_list_destroy(user_list_t list) {
     }
 }
 
+/** Returns the user name stored in a node of a list of users.
+ *
+ *  Parameters: list: node of the list of users (non-NULL).
+ */
+const char *user_list_user(user_list_t list) {
+    return list->user;
+}
+
+/** Returns the node following a node of a list of users, or NULL at
+ *  the end of the list. Note that users are listed in reverse order of
+ *  insertion.
+ *
+ *  Parameters: list: node of the list of users (non-NULL).
+ */
+user_list_t user_list_next(user_list_t list) {
+    return list->next;
+}
+
+/** Finds the next free mail file number in a mailbox directory, and
+ *  takes it as the entry's hint if it is further on.
+ */
+static void scan_mailbox(struct user_entry *e, int dirfd) {
+    int fd = dup(dirfd), next = 0;
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    struct dirent *d;
+
+    if (!dir) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    while ((d = readdir(dir)) != NULL) {
+        int n, pos = 0;
+        if (sscanf(d->d_name, "%d" MAIL_FILE_SUFFIX "%n", &n, &pos) == 1 && !d->d_name[pos] &&
+            pos && n >= next)
+            next = n + 1;
+    }
+    closedir(dir);
+    int hint = __atomic_load_n(&e->next_mail, __ATOMIC_RELAXED);
+    while (hint < next &&
+           !__atomic_compare_exchange_n(&e->next_mail, &hint, next, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/** Returns the open mailbox directory of a user, opening (and creating)
+ *  it if needed and the limit of open directories allows.
+ *
+ *  Returns: the directory, or -1.
+ */
+static int mailbox_dirfd(struct user_entry *e) {
+    char path[PATH_MAX];
+    int fd = __atomic_load_n(&e->dirfd, __ATOMIC_ACQUIRE), none = -1;
+
+    if (fd >= 0)
+        return fd;
+    if (__atomic_add_fetch(&ndirfds, 1, __ATOMIC_RELAXED) > max_dirfds) {
+        __atomic_sub_fetch(&ndirfds, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    mkdir(config.mail_store, 0777);
+    snprintf(path, sizeof(path), "%s/%s", config.mail_store, e->name);
+    mkdir(path, 0777);
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        __atomic_sub_fetch(&ndirfds, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    scan_mailbox(e, fd);
+    // Another thread may have opened it meanwhile
+    if (!__atomic_compare_exchange_n(&e->dirfd, &none, fd, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        close(fd);
+        __atomic_sub_fetch(&ndirfds, 1, __ATOMIC_RELAXED);
+        return none;
+    }
+    return fd;
+}
+
+/** Saves a new email message into the mail storage of a single user,
+ *  as described for save_user_mail.
+ *
+ *  Parameters: basefile: Name of a temporary file containing the
+ *                        contents of the email message.
+ *              username: Name of the recipient user.
+ *
+ *  Returns: 0 if the message was stored, -1 otherwise (errno is set
+ *           by the failing system call).
+ */
+int save_user_mail_one(const char *basefile, const char *username) {
+
+    char mail_file[PATH_MAX];
+    int i = 0, dirfd = -1;
+
+    // A cached mailbox is used when the name is spelled as in the users
+    // file, which is how its directory is named
+    struct user_table *t = __atomic_load_n(&user_table, __ATOMIC_ACQUIRE);
+    struct user_entry *e = t ? find_user(t, username) : NULL;
+    if (e && strcmp(e->name, username))
+        e = NULL;
+    if (e)
+        dirfd = mailbox_dirfd(e);
+
+    if (dirfd < 0) {
+        // Create base directory if it doesn't exist yet (error ignored)
+        mkdir(config.mail_store, 0777);
+
+        // Create a directory for the user if it doesn't exist yet. If it
+        // exists mkdir will return an error, which is ignored.
+        snprintf(mail_file, sizeof(mail_file), "%s/%s", config.mail_store, username);
+        mkdir(mail_file, 0777);
+    }
+
+    // Tries to create a file called 0.mail, if it exists tries 1.mail, and
+    // so on; a cached mailbox starts from where the last message went
+    for (;;) {
+        int n = e ? __atomic_fetch_add(&e->next_mail, 1, __ATOMIC_RELAXED) : i++;
+        int rv;
+        if (dirfd >= 0) {
+            snprintf(mail_file, sizeof(mail_file), "%d" MAIL_FILE_SUFFIX, n);
+            rv = linkat(AT_FDCWD, basefile, dirfd, mail_file, 0);
+        } else {
+            snprintf(mail_file, sizeof(mail_file), "%s/%s/%d" MAIL_FILE_SUFFIX, config.mail_store, username, n);
+            rv = link(basefile, mail_file);
+        }
+        if (rv == 0)
+            break;
+        if (errno != EEXIST)
+            return -1;
+    }
+
+    // With full durability, the new directory entry must reach the disk
+    // too (the contents were synced with the temporary file)
+    if (config.durability == Durability_full && dirfd >= 0) {
+        if (fsync(dirfd) < 0)
+            return -1;
+    } else if (config.durability == Durability_full) {
+        snprintf(mail_file, sizeof(mail_file), "%s/%s", config.mail_store, username);
+        int dirfd = open(mail_file, O_RDONLY | O_DIRECTORY);
+        if (dirfd < 0 || fsync(dirfd) < 0) {
+            int err = errno;
+            if (dirfd >= 0)
+                close(dirfd);
+            errno = err;
+            return -1;
+        }
+        close(dirfd);
+    }
+    return 0;
+}
+
 /** Saves a new email message into the mail storage for a list of
  *  users.
  *
@@ -148,27 +441,147 @@ void user_list_destroy(user_list_t list) {
  *  Parameters: basefile: Name of a temporary file containing the
  *                        contents of the email message.
  *              users: List of recipient users to the message.
+ *
+ *  Returns: the number of users for which the message could not be
+ *           stored.
  */
-void save_user_mail(const char *basefile, user_list_t users) {
-  
-    char mail_file[2 * NAME_MAX + 1];
-  
-    // Create base directory if it doesn't exist yet (error ignored)
-    mkdir(MAIL_BASE_DIRECTORY, 0777);
-  
-    for (; users; users = users->next) {
-    
-        // Create a directory for the user if it doesn't exist yet. If it
-        // exists mkdir will return an error, which is ignored.
-        int i = 0;
-        sprintf(mail_file, "%s/%s", MAIL_BASE_DIRECTORY, users->user);
-        mkdir(mail_file, 0777);
-    
-        // Tries to create a file called 0.mail, if it exists tries 1.mail, and so on
-        do {
-            sprintf(mail_file, "%s/%s/%d" MAIL_FILE_SUFFIX, MAIL_BASE_DIRECTORY, users->user, i++);
-        } while (link(basefile, mail_file) < 0 && errno == EEXIST);
+int save_user_mail(const char *basefile, user_list_t users) {
+
+    int failures = 0;
+
+    for (; users; users = users->next)
+        if (save_user_mail_one(basefile, users->user) < 0)
+            failures++;
+    return failures;
+}
+
+struct warmup_work {
+    struct user_table *table;
+    char             **names;   // mailbox directories to warm up
+    size_t             count;
+    size_t             next;    // next one to take
+    size_t             finished;
+    uint64_t           start;
+};
+
+static uint64_t warmup_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static void warmup_progress(int percent, int done) {
+    pthread_mutex_lock(&warmup.lock);
+    warmup.percent = percent;
+    warmup.done = done;
+    pthread_cond_broadcast(&warmup.cond);
+    pthread_mutex_unlock(&warmup.lock);
+}
+
+/** Warm-up thread: opens and scans mailbox directories until there
+ *  are none left.
+ */
+static void *warmup_mailboxes(void *arg) {
+    struct warmup_work *w = arg;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->count) {
+        struct user_entry *e = find_user(w->table, w->names[i]);
+        if (e && !strcmp(e->name, w->names[i]))
+            mailbox_dirfd(e);
+        size_t finished = __atomic_add_fetch(&w->finished, 1, __ATOMIC_RELAXED);
+        int percent = finished * 100 / w->count;
+        if (percent / WARMUP_REPORT_STEP != (finished - 1) * 100 / w->count / WARMUP_REPORT_STEP) {
+            dlog("warmup: mailboxes %d%% (%zu/%zu)\n", percent, finished, w->count);
+            warmup_progress(percent, 0);
+        }
+    }
+    return NULL;
+}
+
+/** Warm-up coordinator: loads the user table, then warms up the
+ *  mailboxes with a pool of threads.
+ */
+static void *warmup_thread(void *arg) {
+    struct warmup_work w = { .start = warmup_ms() };
+    int nthreads = (intptr_t) arg;
+    pthread_t threads[nthreads];
+    size_t size = 0;
+    DIR *dir;
+    struct dirent *d;
+
+    if (!(w.table = load_users())) {
+        dlog("warmup: cannot read %s, not cached\n", config.users_file);
+        warmup_progress(100, 1);
+        return NULL;
+    }
+    __atomic_store_n(&user_table, w.table, __ATOMIC_RELEASE);
+    dlog("warmup: %zu users loaded in %llums\n", w.table->count,
+         (unsigned long long) (warmup_ms() - w.start));
+
+    if ((dir = opendir(config.mail_store))) {
+        while ((d = readdir(dir)) != NULL) {
+            if (d->d_name[0] == '.' || (d->d_type != DT_DIR && d->d_type != DT_UNKNOWN))
+                continue;
+            if (w.count == size) {
+                size = size ? 2 * size : 1024;
+                w.names = realloc(w.names, size * sizeof(char *));
+            }
+            w.names[w.count++] = strdup(d->d_name);
+        }
+        closedir(dir);
+    }
+    if (w.count) {
+        int started = 0;
+        while (started < nthreads &&
+               pthread_create(&threads[started], NULL, warmup_mailboxes, &w) == 0)
+            started++;
+        if (!started)
+            warmup_mailboxes(&w);
+        for (int i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
     }
+    dlog("warmup: done in %llums, %zu mailboxes, %d open\n",
+         (unsigned long long) (warmup_ms() - w.start), w.count, __atomic_load_n(&ndirfds, __ATOMIC_RELAXED));
+    for (size_t i = 0; i < w.count; i++)
+        free(w.names[i]);
+    free(w.names);
+    warmup_progress(100, 1);
+    return NULL;
+}
+
+/** Starts warming up the caches in the background: loading the user
+ *  table, then opening and scanning the mailbox directories.
+ *
+ *  Parameters: threads: number of threads for the mailboxes.
+ */
+void mailuser_warmup_start(int threads) {
+    struct rlimit rl;
+    pthread_t thread;
+
+    // Keep half the file descriptors for sessions
+    max_dirfds = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ?
+                 rl.rlim_cur / 2 : 1024;
+    warmup_progress(0, 0);
+    if (pthread_create(&thread, NULL, warmup_thread, (void *) (intptr_t) threads) != 0) {
+        warmup_progress(100, 1);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/** Waits until the warm-up has got through a percentage of the
+ *  mailboxes, or is finished.
+ *
+ *  Parameters: percent: 0 not to wait, 100 to wait for all of it.
+ */
+void mailuser_warmup_wait(int percent) {
+    if (percent <= 0)
+        return;
+    pthread_mutex_lock(&warmup.lock);
+    while (!warmup.done && warmup.percent < percent)
+        pthread_cond_wait(&warmup.cond, &warmup.lock);
+    pthread_mutex_unlock(&warmup.lock);
 }
 
 /** Reads the list of available email messages for a username, based
@@ -185,8 +598,8 @@ void save_user_mail(const char *basefile, user_list_t users) {
  */
 mail_list_t load_user_mail(const char *username) {
   
-    char filename[2 * NAME_MAX + 1];
-    sprintf(filename, "%s/%s", MAIL_BASE_DIRECTORY, username);
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/%s", config.mail_store, username);
   
     DIR *dir = opendir(filename);
     if (!dir) return NULL;
@@ -206,8 +619,8 @@ mail_list_t load_user_mail(const char *username) {
             !strcmp(dir_entry->d_name + strlen(dir_entry->d_name) - suflen, MAIL_FILE_SUFFIX)) {
       
             struct mail_list *node = malloc(sizeof(struct mail_list));
-            sprintf(node->item.file_name, "%s/%s/%s",
-                    MAIL_BASE_DIRECTORY, username, dir_entry->d_name);
+            snprintf(node->item.file_name, sizeof(node->item.file_name), "%s/%s/%s",
+                    config.mail_store, username, dir_entry->d_name);
       
             if (stat(node->item.file_name, &file_stat) < 0) {
                 free(node);
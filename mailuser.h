@@ -25,8 +25,11 @@ user_list_t user_list_create(void);
 void	    user_list_add(user_list_t *list, const char *username);
 void 	    user_list_destroy(user_list_t list);
 int 	    user_list_len(user_list_t list);
+const char *user_list_user(user_list_t list);
+user_list_t user_list_next(user_list_t list);
 
-void 	    save_user_mail(const char *basefile, user_list_t users);
+int 	    save_user_mail(const char *basefile, user_list_t users);
+int 	    save_user_mail_one(const char *basefile, const char *username);
 
 mail_list_t load_user_mail(const char *username);
 int         mail_list_destroy(mail_list_t list);
@@ -39,4 +42,7 @@ size_t      mail_item_size(mail_item_t item);
 FILE       *mail_item_contents(mail_item_t item);
 void        mail_item_delete(mail_item_t item);
 
+void        mailuser_warmup_start(int threads);
+void        mailuser_warmup_wait(int percent);
+
 #endif
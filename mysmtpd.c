@@ -1,15 +1,38 @@
+#include "mysmtpd.h"
 #include "netbuffer.h"
 #include "mailuser.h"
 #include "server.h"
 #include "util.h"
+#include "stats.h"
+#include "capture.h"
+#include "relay.h"
+#include "resolver.h"
+#include "trace.h"
+#include "qid.h"
+#include "filter.h"
+#include "dkim.h"
+#include "greylist.h"
+#include "admission.h"
+#include "config.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/utsname.h>
 #include <ctype.h>
-
-#define MAX_LINE_LENGTH 1024
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <limits.h>
+#include <openssl/evp.h>
 
 typedef enum state
 {
@@ -25,33 +48,262 @@ typedef struct smtp_state
 {
     int fd;
     net_buffer_t nb;
-    char recvbuf[MAX_LINE_LENGTH + 1];
-    char *words[MAX_LINE_LENGTH];
+    char *recvbuf;      // config.line_length + 1 bytes
+    char **words;
     int nwords;
     State state;
     struct utsname my_uname;
     user_list_t reverse_path_buffer;
     user_list_t forward_path_buffer;
+    user_list_t relay_path_buffer;
     char *mail_data_buffer;
+    session_stats stats;
+    capture_t capture;
+    Listener_kind kind;
+    int lmtp;
+    int authenticated;  // AUTH succeeded (submission)
+    int auth_offered;   // AUTH may be used (submission)
+    char *helo_name;
+    dkim_t dkim;
+    int oversized;      // message data went over config.max_message_size
 } smtp_state;
 
 // https://www.rfc-editor.org/rfc/rfc5321
+// https://www.rfc-editor.org/rfc/rfc2033 (LMTP)
+
+// Speak LMTP instead of SMTP on all connections
+static int lmtp_mode = 0;
+
+// Milliseconds to wait before the greeting; clients talking earlier are dropped
+static int pregreet_delay = 0;
+
+// Optional client checks, based on reverse DNS of the client address
+static int require_rdns = 0;        // client must have a (confirmed) name
+static int require_helo_match = 0;  // HELO name must be that name
+#define RDNS_WAIT_MS 3000           // longest wait for the name at MAIL
+
+// The benchmark programs link the session engine without main()
+#if !defined(MYSMTPD_NO_MAIN)
+
+// Option letters of the features that can also be set in the
+// configuration file, as "key value"
+static const struct
+{
+    const char *key;
+    int opt;
+} option_keys[] = {
+    {"capture", 'C'},
+    {"lmtp", 'L'},
+    {"relay", 'r'},
+    {"client_check", 'N'},
+    {"resolver_stub", 'H'},
+    {"filter", 'F'},
+    {"filter_timeout", 'T'},
+    {"dkim", 'k'},
+    {"pregreet", 'G'},
+    {"greylist", 'g'},
+    {"admission", 'A'},
+};
 
-static void handle_client(int fd);
+/**
+ * Applies one feature option, from the command line or the
+ * configuration file.
+ *
+ * Returns 0 on success, -1 if the argument is invalid (the error has
+ * been reported), -2 if the option is unknown.
+ */
+static int set_option(int opt, const char *arg)
+{
+    switch (opt)
+    {
+    case 'C':
+        // Record raw inbound data of every session in this directory
+        capture_init(arg);
+        break;
+    case 'L':
+        lmtp_mode = 1;
+        break;
+    case 'r':
+        // Relay non-local recipients to a next hop: [domain=]host:port
+        if (relay_add_route(arg) < 0)
+        {
+            fprintf(stderr, "Invalid relay route \"%s\"\n", arg);
+            return -1;
+        }
+        break;
+    case 'N':
+        // Reject clients failing a reverse DNS check (with 450)
+        if (!strcmp(arg, "rdns"))
+            require_rdns = 1;
+        else if (!strcmp(arg, "helo"))
+            require_helo_match = 1;
+        else
+        {
+            fprintf(stderr, "Unknown check \"%s\"\n", arg);
+            return -1;
+        }
+        break;
+    case 'H':
+        // Answer reverse DNS lookups from a file instead of DNS
+        if (resolver_load_stub(arg) < 0)
+        {
+            perror(arg);
+            return -1;
+        }
+        break;
+    case 'F':
+        // Pass accepted messages through a content filter
+        if (filter_add(arg) < 0)
+        {
+            fprintf(stderr, "Invalid filter \"%s\"\n", arg);
+            return -1;
+        }
+        break;
+    case 'T':
+        // Filter timeout, and what to do with the message after it
+        if (filter_set_timeout(arg) < 0)
+        {
+            fprintf(stderr, "Invalid filter timeout \"%s\"\n", arg);
+            return -1;
+        }
+        break;
+    case 'k':
+        // Verify DKIM signatures, with keys from DNS or a directory
+        if (dkim_init(arg) < 0)
+        {
+            perror("dkim");
+            return -1;
+        }
+        break;
+    case 'G':
+        // Hold back the greeting to catch clients that talk first
+        pregreet_delay = atoi(arg);
+        break;
+    case 'g':
+        // Greylist new (client network, sender, recipient) triplets
+        if (greylist_init(arg) < 0)
+        {
+            fprintf(stderr, "Invalid greylisting \"%s\"\n", arg);
+            return -1;
+        }
+        break;
+    case 'A':
+        // Tempfail new transactions while storing messages is too slow
+        if (admission_init(arg) < 0)
+        {
+            fprintf(stderr, "Invalid admission control \"%s\"\n", arg);
+            return -1;
+        }
+        break;
+    default:
+        return -2;
+    }
+    return 0;
+}
+
+// Configuration file keys that are not settings of the config module
+static int set_option_key(const char *key, const char *value)
+{
+    for (size_t i = 0; i < sizeof(option_keys) / sizeof(option_keys[0]); i++)
+        if (!strcmp(key, option_keys[i].key))
+            return set_option(option_keys[i].opt, value) == 0 ? 0 : -1;
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Invalid arguments. Expected: %s [-c config-file] [-o key=value]...\n"
+            "       [-C capture-dir] [-L] [-r [domain=]host:port]...\n"
+            "       [-N rdns|helo]... [-H resolver-stub] [-F filter]... [-T seconds[,accept|tempfail]]\n"
+            "       [-k dns|key-dir] [-G pregreet-ms] [-g delay[,entries]]\n"
+            "       [-A target-ms[,interval-ms[,max-storing]]] [[host:]port]\n", prog);
+}
+
+/**
+ * Runs before the server exits on a shutdown, once all sessions are
+ * finished: messages queued for relay are delivered first.
+ */
+static void shutdown_flush(void)
+{
+    relay_flush(config.shutdown_timeout);
+    greylist_save();
+}
 
 int main(int argc, char *argv[])
 {
+    int opt;
 
-    if (argc != 2)
+    // Settings apply in order: later options override earlier ones, and
+    // the configuration file, if used, should come first
+    while ((opt = getopt(argc, argv, "c:o:C:Lr:N:H:F:T:k:G:g:A:")) != -1)
     {
-        fprintf(stderr, "Invalid arguments. Expected: %s <port>\n", argv[0]);
+        if (opt == 'c')
+        {
+            if (config_load(optarg, set_option_key) < 0)
+                return 1;
+        }
+        else if (opt == 'o')
+        {
+            char *value = strchr(optarg, '=');
+            int status = -1;
+            if (value)
+            {
+                *value = 0;
+                status = config_set(optarg, value + 1);
+                if (status > 0)
+                    status = set_option_key(optarg, value + 1);
+                *value = '=';
+            }
+            if (status < 0)
+            {
+                fprintf(stderr, "Invalid setting \"%s\"\n", optarg);
+                return 1;
+            }
+        }
+        else
+        {
+            int status = set_option(opt, optarg);
+            if (status == -2)
+                usage(argv[0]);
+            if (status < 0)
+                return 1;
+        }
+    }
+
+    // A listen address on the command line adds to the configured ones
+    if (argc - optind > 1 || (argc - optind == 1 && config_set("listen", argv[optind]) < 0) ||
+        (config.nlisten == 0 && !server_inherits_listeners()))
+    {
+        usage(argv[0]);
         return 1;
     }
 
-    run_server(argv[1], handle_client);
+    // The signals that control the server go to the thread running it,
+    // not to the helper threads
+    server_block_signals();
+    mailuser_warmup_start(config.warmup_threads);
+    if (resolver_start() < 0)
+    {
+        perror("resolver");
+        return 1;
+    }
+    relay_start();
+    filter_start();
+    greylist_start();
+    // On SIGUSR2, start the (possibly new) binary with the same command
+    // line; the greylist snapshot is saved first for it to load
+    server_enable_upgrade(argv, greylist_save);
+    // On SIGTERM or SIGINT, deliver the relay queue before exiting
+    server_on_shutdown(shutdown_flush);
+    // Clients are accepted (and readiness reported) once the caches are
+    // warm enough; the rest warms up while serving
+    mailuser_warmup_wait(config.warmup_threshold);
+    stats_init();
+    run_server(handle_client);
 
     return 0;
 }
+#endif
 
 // Resets
 void clear_buffers(smtp_state *ms)
@@ -66,11 +318,21 @@ void clear_buffers(smtp_state *ms)
         user_list_destroy(ms->forward_path_buffer);
         ms->forward_path_buffer = NULL;
     }
+    if (ms->relay_path_buffer)
+    {
+        user_list_destroy(ms->relay_path_buffer);
+        ms->relay_path_buffer = NULL;
+    }
     if (ms->mail_data_buffer)
     {
         free(ms->mail_data_buffer);
         ms->mail_data_buffer = NULL;
     }
+    if (ms->dkim)
+    {
+        dkim_destroy(ms->dkim);
+        ms->dkim = NULL;
+    }
 }
 
 // syntax_error returns
@@ -98,6 +360,15 @@ int checkstate(smtp_state *ms, State s)
     return 0;
 }
 
+// Replies to a command that is not recognized in this session
+int do_unrecognized(smtp_state *ms)
+{
+    dlog("Illegal command \"%s\"\n", ms->words[0] ? ms->words[0] : "");
+    if (send_formatted(ms->fd, "500 Syntax error, command unrecognized\r\n") <= 0)
+        return -1;
+    return 1;
+}
+
 // All the functions that implement a single command return
 //   -1 if the server should exit
 //    0 if the command was successful
@@ -119,10 +390,8 @@ int do_quit(smtp_state *ms)
  *
  *   There must be no transaction in progress and all state tables and buffers are cleared.
  */
-int do_helo(smtp_state *ms)
+static int greet(smtp_state *ms)
 {
-    dlog("Executing helo\n");
-
     if (ms->nwords != 2)
     {
         send_formatted(ms->fd, "501 Syntax error in arguments\r\n");
@@ -138,16 +407,44 @@ int do_helo(smtp_state *ms)
 
     dlog("Syntax OK\n");
 
+    snprintf(ms->helo_name, config.line_length + 1, "%s", ms->words[1]);
     ms->state = Executed_Helo;
-    send_formatted(ms->fd, "250 %s\r\n", ms->my_uname.nodename);
+    if (ms->auth_offered && strcasecmp(ms->words[0], "HELO"))
+        send_formatted(ms->fd, "250-%s\r\n250 AUTH PLAIN\r\n", ms->my_uname.nodename);
+    else
+        send_formatted(ms->fd, "250 %s\r\n", ms->my_uname.nodename);
 
     ms->reverse_path_buffer = NULL;
     ms->forward_path_buffer = NULL;
+    ms->relay_path_buffer = NULL;
     ms->mail_data_buffer = NULL;
 
     return 0;
 }
 
+int do_helo(smtp_state *ms)
+{
+    dlog("Executing helo\n");
+
+    // An LMTP server must not accept HELO or EHLO
+    if (ms->lmtp)
+        return do_unrecognized(ms);
+    return greet(ms);
+}
+
+/**
+ *   Syntax: LHLO SP Domain CRLF
+ *   The LMTP equivalent of EHLO, only accepted in LMTP mode.
+ */
+int do_lhlo(smtp_state *ms)
+{
+    dlog("Executing lhlo\n");
+
+    if (!ms->lmtp)
+        return do_unrecognized(ms);
+    return greet(ms);
+}
+
 /**
    This command specifies that the current mail transaction will be
    aborted.
@@ -186,6 +483,227 @@ int do_rset(smtp_state *ms)
     return 1;
 }
 
+// Clients on unix sockets (and peers we could not name) have no address to look up
+static int peer_is_remote(smtp_state *ms)
+{
+    return strcmp(ms->stats.peer, "local") && strcmp(ms->stats.peer, "unknown");
+}
+
+// Whether the client is on this host: on a Unix socket or loopback
+static int peer_is_local(smtp_state *ms)
+{
+    return !strcmp(ms->stats.peer, "local") || !strncmp(ms->stats.peer, "127.", 4) ||
+           !strcmp(ms->stats.peer, "::1") || !strncmp(ms->stats.peer, "::ffff:127.", 11);
+}
+
+/**
+ * Applies the optional reverse DNS checks to the client, before it
+ * can start a mail transaction. The lookup was started when the
+ * client connected; if it has not completed yet, this waits for it
+ * for up to RDNS_WAIT_MS, then gives the client the benefit of the
+ * doubt rather than holding it up any longer.
+ *
+ * Returns 0 if the client passes, 1 if it was rejected.
+ */
+static int client_check(smtp_state *ms)
+{
+    char name[NI_MAXHOST];
+    Resolve_status status;
+
+    if ((!require_rdns && !require_helo_match) || !peer_is_remote(ms))
+        return 0;
+
+    status = resolver_wait(ms->stats.peer, name, sizeof(name), RDNS_WAIT_MS);
+    if (status == Resolve_none)
+    {
+        dlog("client %s has no reverse DNS\n", ms->stats.peer);
+        send_formatted(ms->fd, "450 Client host rejected: cannot find your hostname [%s]\r\n",
+                       ms->stats.peer);
+        return 1;
+    }
+    if (status == Resolve_found && require_helo_match && strcasecmp(name, ms->helo_name))
+    {
+        dlog("client %s (%s) said HELO %s\n", ms->stats.peer, name, ms->helo_name);
+        send_formatted(ms->fd, "450 Client host rejected: HELO name does not match %s\r\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Handles the end of input from the client: a client that sent nothing
+ * for config.client_timeout seconds is told so before being dropped; a
+ * client that hung up or reset the connection is counted as gone.
+ *
+ * Parameters: status: NB_EOF or NB_ERROR, from nb_read_line().
+ */
+static void read_failed(smtp_state *ms, int status)
+{
+    if (status == NB_ERROR && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        dlog("client %s timed out\n", ms->stats.peer);
+        send_formatted(ms->fd, "421 4.4.2 %s Error: timeout exceeded\r\n", ms->my_uname.nodename);
+        return;
+    }
+    if (status == NB_EOF)
+        dlog("client %s disconnected\n", ms->stats.peer);
+    else
+        dlog("client %s: receive failed: %s\n", ms->stats.peer, strerror(errno));
+    stats_note_disconnect();
+}
+
+/**
+ * Ends the session if the server is shutting down: right away at the
+ * shutdown deadline, or else unless a transaction is in progress, which
+ * may still finish.
+ *
+ * Returns 1 if the client was told the service is closing, 0 otherwise.
+ */
+static int shutdown_reply(smtp_state *ms)
+{
+    Server_state state = server_state();
+
+    if (state == Server_running ||
+        (state == Server_stopping &&
+         (ms->state == Mail_transaction_open || ms->state == Recipient_provided ||
+          ms->state == Data_input)))
+        return 0;
+    dlog("client %s: shutting down\n", ms->stats.peer);
+    send_formatted(ms->fd, "421 4.3.2 %s Service shutting down\r\n", ms->my_uname.nodename);
+    return 1;
+}
+
+/**
+ * Reads a line from the client into ms->recvbuf. A read interrupted by
+ * a shutdown goes on if the session may still continue.
+ *
+ * Returns the length of the line (at least 1), or -1 if the session
+ * must end: the client is gone, or has been told why, if it can be.
+ */
+static int read_line(smtp_state *ms)
+{
+    int len;
+
+    while ((len = nb_read_line(ms->nb, ms->recvbuf)) == NB_ERROR && errno == EINTR)
+        if (shutdown_reply(ms))
+            return -1;
+    if (len == NB_EOF || len == NB_ERROR)
+    {
+        read_failed(ms, len);
+        return -1;
+    }
+    // Replies to pipelined commands go out in as few packets as possible
+    nb_cork(ms->nb);
+    return len;
+}
+
+/**
+ * Refuses a new transaction, or its data, with a temporary failure
+ * while the server cannot store messages fast enough.
+ *
+ * Returns 0 if it may go on, 1 if it was refused.
+ */
+static int admission_reply(smtp_state *ms)
+{
+    switch (admission_check())
+    {
+    case Admit_busy:
+        dlog("admission: refusing %s, storage is slow\n", ms->stats.peer);
+        send_formatted(ms->fd, "451 4.3.2 System busy, try again later\r\n");
+        return 1;
+    case Admit_full:
+        dlog("admission: refusing %s, too many messages being stored\n", ms->stats.peer);
+        send_formatted(ms->fd, "452 4.3.1 Insufficient system storage, try again later\r\n");
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Checks whether the header section of a message has a Message-ID.
+ */
+static int has_message_id(const char *data)
+{
+    const char *line = data;
+
+    while (*line && strncmp(line, "\r\n", 2))
+    {
+        if (!strncasecmp(line, "Message-ID:", 11))
+            return 1;
+        line = strstr(line, "\r\n");
+        if (!line)
+            break;
+        line += 2;
+    }
+    return 0;
+}
+
+/**
+ * Formats the trace headers for the message in the current
+ * transaction: a Received: header, the DKIM verification results if
+ * enabled, and a Message-ID if the message has none.
+ *
+ * Parameters: id:  queue id of the message.
+ *             data: the message.
+ *             buf, size: buffer receiving the headers.
+ *
+ * Returns the length of the headers.
+ */
+static size_t trace_headers(smtp_state *ms, const char *id, const char *data, char *buf, size_t size)
+{
+    char rdns[NI_MAXHOST];
+    const char *rcpt = NULL;
+    int have_rdns = peer_is_remote(ms) &&
+                    resolver_result(ms->stats.peer, rdns, sizeof(rdns)) == Resolve_found;
+    size_t len;
+
+    // Only name the recipient if there is exactly one
+    if (user_list_len(ms->forward_path_buffer) + user_list_len(ms->relay_path_buffer) == 1)
+        rcpt = user_list_user(ms->forward_path_buffer ? ms->forward_path_buffer : ms->relay_path_buffer);
+
+    len = trace_received(buf, size, ms->helo_name, have_rdns ? rdns : NULL, ms->stats.peer,
+                         ms->my_uname.nodename, ms->lmtp ? "LMTP" : "SMTP", id, rcpt);
+
+    if (ms->dkim)
+        len += dkim_result(ms->dkim, ms->my_uname.nodename, buf + len, size - len);
+
+    if (!has_message_id(data))
+    {
+        char message_id[QID_LEN + sizeof(ms->my_uname.nodename) + 4];
+        qid_message_id(message_id, sizeof(message_id), id, ms->my_uname.nodename);
+        int n = snprintf(buf + len, size - len, "Message-ID: %s\r\n", message_id);
+        if (n > 0 && (size_t) n < size - len)
+            len += n;
+        else
+            buf[len] = 0;
+    }
+    return len;
+}
+
+/**
+ * Passes a line of message data, as received, to DKIM verification:
+ * without its line ending, and with the leading dot of dot-stuffed
+ * lines removed. The terminating "." line is not part of the message.
+ */
+static void dkim_data_line(smtp_state *ms, size_t len)
+{
+    const char *line = ms->recvbuf;
+
+    if (len > 0 && line[len - 1] == '\n')
+        len--;
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+    if (len == 1 && line[0] == '.')
+        return;
+    if (line[0] == '.')
+    {
+        line++;
+        len--;
+    }
+    dkim_line(ms->dkim, line, len);
+}
+
 /**
  * Mail data is delivered
  * to one or more mailboxes or another system.
@@ -224,6 +742,15 @@ int do_mail(smtp_state *ms)
 
     dlog("Syntax OK\n");
 
+    if (ms->kind == Listen_submission && !ms->authenticated)
+    {
+        send_formatted(ms->fd, "530 5.7.0 Authentication required\r\n");
+        return 1;
+    }
+
+    if ((ms->kind != Listen_submission && client_check(ms) != 0) || admission_reply(ms) != 0)
+        return 1;
+
     int strlength = strlen(ms->words[1]);
     strlength = strlength - 7; // trim from:< and >
     char reverse_path[strlength + 1];
@@ -295,7 +822,30 @@ int do_rcpt(smtp_state *ms)
 
     dlog("Got forward path %s with length %d\n", forward_path, strlength);
 
-    if (is_valid_user(forward_path, NULL))
+    if (config.max_recipients > 0 &&
+        user_list_len(ms->forward_path_buffer) + user_list_len(ms->relay_path_buffer) >= config.max_recipients)
+    {
+        send_formatted(ms->fd, "452 4.5.3 Too many recipients\r\n");
+        return 1;
+    }
+
+    int local = is_valid_user(forward_path, NULL);
+    if (!local && (ms->lmtp || !relay_accepts(forward_path, ms->stats.peer, ms->authenticated)))
+    {
+        send_formatted(ms->fd, "550 No such user - %s\r\n", forward_path);
+        return 1;
+    }
+
+    // Greylisting: defer recipients the client has not retried yet
+    if (!ms->lmtp && !ms->authenticated && greylist_enabled() && peer_is_remote(ms) &&
+        greylist_check(ms->stats.peer, user_list_user(ms->reverse_path_buffer), forward_path))
+    {
+        send_formatted(ms->fd, "450 4.2.0 <%s>: Recipient address rejected: Greylisted, try again later\r\n",
+                       forward_path);
+        return 1;
+    }
+
+    if (local)
     {
         if (!ms->forward_path_buffer)
         {
@@ -309,11 +859,84 @@ int do_rcpt(smtp_state *ms)
     }
     else
     {
-        send_formatted(ms->fd, "550 No such user - %s\r\n", forward_path);
-        return 1;
+        // Not a local user, but can be queued for a next hop
+        user_list_add(&ms->relay_path_buffer, forward_path);
+        ms->state = Recipient_provided;
+        send_formatted(ms->fd, "250 OK (relay)\r\n");
+        return 0;
     }
 }
 
+/**
+ * LMTP delivery: stores the message for each recipient separately and
+ * sends one reply per recipient, in the order the recipients were
+ * given, so that the client only needs to retry the failed ones. A NULL
+ * fileName means the message could not be stored and fails for everyone.
+ */
+static void lmtp_deliver(smtp_state *ms, const char *fileName)
+{
+    int n = user_list_len(ms->forward_path_buffer);
+    const char *rcpts[n];
+    user_list_t u = ms->forward_path_buffer;
+
+    // The recipient list is kept in reverse order of RCPT commands
+    for (int i = n - 1; i >= 0; i--, u = user_list_next(u))
+        rcpts[i] = user_list_user(u);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (fileName && save_user_mail_one(fileName, rcpts[i]) == 0)
+            send_formatted(ms->fd, "250 OK <%s> delivered\r\n", rcpts[i]);
+        else
+            send_formatted(ms->fd, "451 Requested action aborted: error storing mail for <%s>\r\n", rcpts[i]);
+    }
+}
+
+/**
+ * SMTP delivery of a stored message: links it into the mailboxes of the
+ * local recipients and queues it for the relay recipients. Once anyone
+ * has a copy the message is accepted, since a client retrying it would
+ * deliver it twice to them; the recipients that failed are returned to
+ * the sender instead.
+ *
+ * Returns 0 if the message was accepted, -1 if nobody got it.
+ */
+static int deliver_message(smtp_state *ms, const char *id, const char *fileName, const struct iovec *message)
+{
+    const char *from = user_list_user(ms->reverse_path_buffer);
+    user_list_t failed = NULL;
+    int delivered = 0;
+
+    for (user_list_t u = ms->forward_path_buffer; u; u = user_list_next(u))
+    {
+        if (save_user_mail_one(fileName, user_list_user(u)) == 0)
+            delivered++;
+        else
+            user_list_add(&failed, user_list_user(u));
+    }
+    if (ms->relay_path_buffer)
+    {
+        int nfailed = user_list_len(failed);
+        relay_enqueue(from, ms->relay_path_buffer, message, 2, &failed);
+        delivered += user_list_len(ms->relay_path_buffer) - (user_list_len(failed) - nfailed);
+    }
+
+    if (delivered && failed)
+    {
+        int n = user_list_len(failed);
+        const char *rcpts[n];
+        user_list_t u = failed;
+
+        for (int i = 0; i < n; i++, u = user_list_next(u))
+            rcpts[i] = user_list_user(u);
+        if (relay_bounce(id, from, rcpts, n, "the message could not be stored",
+                         message[1].iov_base, message[1].iov_len) < 0)
+            dlog("message %s: not stored for %d recipient(s), and not returned\n", id, n);
+    }
+    user_list_destroy(failed);
+    return delivered ? 0 : -1;
+}
+
 /**
  * Mail data gets appended to the mail data buffer.
  *
@@ -344,61 +967,130 @@ int do_data(smtp_state *ms)
 
     dlog("Syntax OK\n");
 
+    if (admission_reply(ms) != 0)
+        return 1;
+
     ms->state = Data_input;
 
     send_formatted(ms->fd, "354 Start mail input; end with <CRLF>.<CRLF>\r\n");
 
-    size_t len;
+    if (dkim_enabled())
+        ms->dkim = dkim_create();
+    ms->oversized = 0;
 
-    while ((len = nb_read_line(ms->nb, ms->recvbuf)) >= 0)
+    int len;
+
+    // Ends with the end of data line; otherwise the client is gone, and
+    // the message with it
+    while ((len = read_line(ms)) > 0)
     {
-        if (len == 0)
-        {
-            continue;
-        }
+        // DKIM hashes the line as sent, before trailing space is trimmed
+        if (ms->dkim)
+            dkim_data_line(ms, len);
 
         // Remove CR, LF and other space characters from end of buffer
-        while (isspace(ms->recvbuf[len - 1]))
+        while (len > 0 && isspace((unsigned char) ms->recvbuf[len - 1]))
             ms->recvbuf[--len] = 0;
 
-        dlog("received data: %s, length %zu\n", ms->recvbuf, len);
+        dlog("received data: %s, length %d\n", ms->recvbuf, len);
 
         // End of data
+        if (strcmp(ms->recvbuf, ".") == 0 && ms->oversized)
+        {
+            dlog("message over %zu bytes, refused\n", config.max_message_size);
+            clear_buffers(ms);
+            ms->state = Data_input_done;
+            send_formatted(ms->fd, "552 5.3.4 Message size exceeds fixed maximum message size\r\n");
+            return 0;
+        }
         if (strcmp(ms->recvbuf, ".") == 0)
         {
             dlog("Saving user mail\n");
 
-            // Create temporary file
-            char fileName[] = "maildata_tmpXXXXXX";
-            int file = mkstemp(fileName);
-
-            // don't write anything if mail content is empty.
-            if (ms->mail_data_buffer != NULL)
+            char id[QID_LEN + 1];
+            qid_next(id);
+
+            // The trace headers are written in front of the data, not copied into it
+            char trace[TRACE_MAX_HEADER];
+            struct iovec message[2];
+            message[1].iov_base = ms->mail_data_buffer ? ms->mail_data_buffer : "";
+            message[1].iov_len = strlen(message[1].iov_base);
+            message[0].iov_base = trace;
+            message[0].iov_len = trace_headers(ms, id, message[1].iov_base, trace, sizeof(trace));
+            dlog("message %s from %s [%s] for %d recipient(s)\n", id,
+                 user_list_user(ms->reverse_path_buffer), ms->stats.peer,
+                 user_list_len(ms->forward_path_buffer) + user_list_len(ms->relay_path_buffer));
+
+            int queued = 0;
+            uint64_t store_start = admission_store_begin();
+            if (!ms->lmtp && filter_enabled())
             {
-                write(file, ms->mail_data_buffer, strlen(ms->mail_data_buffer));
+                // Filter workers deliver the message once it passes
+                queued = filter_submit(id, user_list_user(ms->reverse_path_buffer),
+                                       ms->forward_path_buffer, ms->relay_path_buffer, message, 2);
             }
-
-            save_user_mail(fileName, ms->forward_path_buffer);
-            close(file);
-            remove(fileName); // delete temp file
+            else
+            {
+                // Create temporary file, named after the queue id, in the mail
+                // store so that it can be linked into the mailboxes
+                char fileName[PATH_MAX];
+                snprintf(fileName, sizeof(fileName), "%s/maildata_tmp.%s", config.mail_store, id);
+                int file = open(fileName, O_WRONLY | O_CREAT | O_EXCL, 0600);
+                if (file < 0 && errno == ENOENT && mkdir(config.mail_store, 0777) == 0)
+                    file = open(fileName, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+                // A short write would deliver a truncated message, so the
+                // whole transaction fails instead
+                int stored = file >= 0 &&
+                             writev(file, message, 2) == (ssize_t) (message[0].iov_len + message[1].iov_len) &&
+                             (config.durability != Durability_full || fsync(file) == 0);
+                if (!stored)
+                    perror("storing mail data");
+
+                if (ms->lmtp)
+                    lmtp_deliver(ms, stored ? fileName : NULL);
+                else if (!stored || deliver_message(ms, id, fileName, message) < 0)
+                    queued = -1;
+                if (file >= 0)
+                {
+                    close(file);
+                    remove(fileName); // delete temp file
+                }
+            }
+            admission_store_end(store_start);
 
             clear_buffers(ms);
+            stats_note_message();
 
             ms->state = Data_input_done;
-            send_formatted(ms->fd, "250 OK data done\r\n");
+            if (queued < 0)
+                send_formatted(ms->fd, "451 Requested action aborted: local error in processing\r\n");
+            else if (!ms->lmtp)
+                send_formatted(ms->fd, "250 OK data done\r\n");
 
             return 0;
         }
 
-        dlog("string to write: %s, length %zu\n", ms->recvbuf, len);
+        dlog("string to write: %s, length %d\n", ms->recvbuf, len);
+
+        // Past the size limit, the rest of the data is read but not kept
+        if (config.max_message_size > 0 && !ms->oversized &&
+            (ms->mail_data_buffer ? strlen(ms->mail_data_buffer) : 0) + len + 2 > config.max_message_size)
+        {
+            ms->oversized = 1;
+            free(ms->mail_data_buffer);
+            ms->mail_data_buffer = NULL;
+        }
+        if (ms->oversized)
+            continue;
 
         if (ms->mail_data_buffer == NULL)
         {
+            // The first line is dot-stuffed like the others
+            const char *line = ms->recvbuf[0] == '.' ? ms->recvbuf + 1 : ms->recvbuf;
             ms->mail_data_buffer = malloc(len + 1);
-            ms->mail_data_buffer[0] = 0;
-            dlog("strcat: %s \n", ms->recvbuf);
-            strcat(ms->mail_data_buffer, ms->recvbuf);
-            ms->mail_data_buffer[len] = 0;
+            dlog("strcat: %s \n", line);
+            strcpy(ms->mail_data_buffer, line);
         }
         else
         {
@@ -424,10 +1116,10 @@ int do_data(smtp_state *ms)
         strcat(ms->mail_data_buffer, "\r\n");
         ms->mail_data_buffer[strlen(ms->mail_data_buffer)] = 0;
         dlog("new buffer size %lu \n", strlen(ms->mail_data_buffer));
+        stats_note_memory(config.line_length + strlen(ms->mail_data_buffer) + 1);
     }
 
-    send_formatted(ms->fd, "501\n");
-    return 1;
+    return -1;
 }
 
 // receiver must send a 250 OK replay
@@ -466,25 +1158,298 @@ int do_vrfy(smtp_state *ms)
     }
 }
 
-void handle_client(int fd)
+/**
+ * EXPN and HELP are recognized but not supported.
+ */
+int do_not_implemented(smtp_state *ms)
 {
+    dlog("Command not implemented \"%s\"\n", ms->words[0]);
+    if (send_formatted(ms->fd, "502 Command not implemented\r\n") <= 0)
+        return -1;
+    return 1;
+}
 
-    size_t len;
+/**
+ *   Syntax: AUTH SP "PLAIN" [SP initial-response] CRLF
+ *   Authenticates a user on the submission port (RFC 4954, RFC 4616).
+ *   The response is base64 of "authzid NUL user NUL password", checked
+ *   against the users file. Other ports do not offer AUTH, and neither
+ *   does the submission port to remote clients unless its listener has
+ *   the insecure_auth option, as there is no TLS.
+ */
+int do_auth(smtp_state *ms)
+{
+    dlog("Executing auth\n");
+
+    if (ms->kind != Listen_submission)
+        return do_not_implemented(ms);
+    if (!ms->auth_offered)
+    {
+        send_formatted(ms->fd, "538 5.7.11 Encryption required for requested authentication mechanism\r\n");
+        return 1;
+    }
+    if (ms->nwords < 2 || ms->nwords > 3)
+    {
+        syntax_error(ms);
+        return 1;
+    }
+    if (ms->authenticated)
+    {
+        send_formatted(ms->fd, "503 5.5.1 Already authenticated\r\n");
+        return 1;
+    }
+    if (ms->state != Executed_Helo)
+    {
+        send_formatted(ms->fd, "503 Wrong sequence of commands\r\n");
+        return 1;
+    }
+    if (strcasecmp(ms->words[1], "PLAIN"))
+    {
+        send_formatted(ms->fd, "504 5.5.4 Unrecognized authentication type\r\n");
+        return 1;
+    }
+
+    const char *response = ms->nwords == 3 ? ms->words[2] : NULL;
+    if (!response)
+    {
+        int len;
+        send_formatted(ms->fd, "334 \r\n");
+        if ((len = read_line(ms)) < 0)
+            return -1;
+        while (len > 0 && isspace((unsigned char) ms->recvbuf[len - 1]))
+            ms->recvbuf[--len] = 0;
+        response = ms->recvbuf;
+    }
+    if (!strcmp(response, "*"))
+    {
+        send_formatted(ms->fd, "501 5.0.0 Authentication cancelled\r\n");
+        return 1;
+    }
+
+    size_t rlen = strlen(response);
+    unsigned char decoded[rlen / 4 * 3 + 4];
+    int n = rlen % 4 ? -1 : EVP_DecodeBlock(decoded, (const unsigned char *) response, rlen);
+    // EVP_DecodeBlock counts the padding as data
+    if (n >= 1 && rlen >= 1 && response[rlen - 1] == '=')
+        n--;
+    if (n >= 1 && rlen >= 2 && response[rlen - 2] == '=')
+        n--;
+    if (n < 0)
+    {
+        send_formatted(ms->fd, "501 5.5.2 Cannot decode response\r\n");
+        return 1;
+    }
+    decoded[n] = 0;
+
+    // authzid NUL authcid NUL passwd; the authzid, if any, must be the user
+    char *authzid = (char *) decoded, *end = authzid + n;
+    char *user = memchr(authzid, 0, n), *pass = NULL;
+    if (user)
+    {
+        user++;
+        if ((pass = memchr(user, 0, end - user)))
+            pass++;
+    }
+    if (pass && (!*authzid || !strcasecmp(authzid, user)) &&
+        is_valid_user(user, pass))
+    {
+        dlog("client %s authenticated as %s\n", ms->stats.peer, user);
+        ms->authenticated = 1;
+        send_formatted(ms->fd, "235 2.7.0 Authentication successful\r\n");
+        return 0;
+    }
+    dlog("client %s failed to authenticate\n", ms->stats.peer);
+    send_formatted(ms->fd, "535 5.7.8 Authentication credentials invalid\r\n");
+    return 1;
+}
+
+// Commands recognized by the server, in the order they are looked up.
+// The most frequent commands in a mail transaction come first.
+static const smtp_command commands[] = {
+    {"RCPT", do_rcpt},
+    {"MAIL", do_mail},
+    {"DATA", do_data},
+    {"EHLO", do_helo},
+    {"HELO", do_helo},
+    {"LHLO", do_lhlo},
+    {"QUIT", do_quit},
+    {"RSET", do_rset},
+    {"NOOP", do_noop},
+    {"VRFY", do_vrfy},
+    {"AUTH", do_auth},
+    {"EXPN", do_not_implemented},
+    {"HELP", do_not_implemented},
+};
+
+/**
+ * Returns the command table entry for a command verb (ignoring case),
+ * or NULL if the verb is missing or not recognized.
+ */
+const smtp_command *smtp_find_command(const char *verb)
+{
+    if (!verb)
+        return NULL;
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        if (!strcasecmp(verb, commands[i].name))
+            return &commands[i];
+    return NULL;
+}
+
+/**
+ * Returns the number of bytes the client sent along with its SYN, with
+ * TCP Fast Open, or 0. They are already waiting when the client is
+ * accepted; later data may have joined them, which is let go.
+ */
+static int syn_data(int fd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    int bytes = 0;
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+        (info.tcpi_options & TCPI_OPT_SYN_DATA) && ioctl(fd, FIONREAD, &bytes) == 0)
+        return bytes;
+    return 0;
+}
+
+/**
+ * Waits for the pregreet delay before the greeting is sent. A client
+ * that sends anything (or hangs up) in the meantime is not following
+ * the protocol, and is dropped before any session state is set up.
+ * Data sent with the SYN (TCP Fast Open) does not count: it is how the
+ * client pipelines its first command, and the session reads it as any
+ * other input once the greeting is out.
+ *
+ * Returns 0 if the session may go on, -1 if the client was dropped.
+ */
+static int pregreet_check(int fd)
+{
+    static char reply[] = "554 5.5.1 Protocol error\r\n";
+    struct pollfd pfd = {fd, POLLIN, 0};
+    char peer[INET6_ADDRSTRLEN];
+    int early, lowat, talked;
+
+    if (pregreet_delay <= 0)
+        return 0;
+
+    // The socket is already readable with data sent with the SYN, so
+    // poll() is only to wake up for more than that
+    if ((early = syn_data(fd)) > 0)
+    {
+        lowat = early + 1;
+        setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+    }
+    talked = poll(&pfd, 1, pregreet_delay) > 0;
+    if (early > 0)
+    {
+        lowat = 1;
+        setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+    }
+    if (!talked)
+        return 0;
+
+    stats_peer_address(fd, peer);
+    dlog("pregreet: %s talked before the greeting, dropped\n", peer);
+    send_all(fd, reply, sizeof(reply) - 1);
+    return -1;
+}
+
+/**
+ * Serves a connection to the admin listener: writes the server-wide
+ * statistics and state as "name value" lines, then closes.
+ */
+static void admin_dump(int fd)
+{
+    static const char *engines[] = {"iterative", "fork", "prefork"};
+    char buf[2048];
+    int len = stats_dump(buf, sizeof(buf));
+
+    len += snprintf(buf + len, sizeof(buf) - len, "engine %s\nworkers %d\nlisteners %d\n",
+                    engines[config.engine], config.workers, config.nlisten);
+    for (int i = 0; i < config.nlisten && len < (int) sizeof(buf); i++)
+        len += snprintf(buf + len, sizeof(buf) - len, "listen %s\n", config.listen[i]);
+    if (len < (int) sizeof(buf))
+        len += snprintf(buf + len, sizeof(buf) - len, "admission_paused %d\nrelay_queue %d\n",
+                        admission_paused(), relay_queue_length());
+    if (len > (int) sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    send_all(fd, buf, len);
+}
+
+// Frees what handle_client() set up for a session
+static void free_session(smtp_state *ms)
+{
+    nb_destroy(ms->nb);
+    free(ms->recvbuf);
+    free(ms->words);
+    free(ms->helo_name);
+    capture_close(ms->capture);
+    stats_session_end(&ms->stats);
+}
+
+void handle_client(int fd, Listener_kind kind, const Listen_options *opts)
+{
+
+    int len;
     smtp_state mstate, *ms = &mstate;
 
+    if (kind == Listen_admin)
+    {
+        admin_dump(fd);
+        return;
+    }
+    // Only other servers are expected to talk before the greeting
+    if (kind == Listen_smtp && pregreet_check(fd) < 0)
+        return;
+
     ms->fd = fd;
-    ms->nb = nb_create(fd, MAX_LINE_LENGTH);
+    stats_session_begin(&ms->stats, fd);
+    if (peer_is_remote(ms))
+        resolver_lookup(ms->stats.peer);
+    ms->nb = nb_create(fd, config.line_length);
+    ms->recvbuf = malloc(config.line_length + 1);
+    ms->words = malloc(config.line_length * sizeof(char *));
+    ms->helo_name = calloc(1, config.line_length + 1);
+    ms->capture = capture_open();
+    nb_set_capture(ms->nb, ms->capture);
     ms->state = Init;
+    ms->kind = kind;
+    ms->lmtp = lmtp_mode || kind == Listen_lmtp;
+    ms->authenticated = 0;
+    // Without TLS, the password can only be kept from eavesdroppers
+    // when the client is on this host, unless the listener says so
+    ms->auth_offered = kind == Listen_submission && (opts->insecure_auth || peer_is_local(ms));
+    ms->reverse_path_buffer = NULL;
+    ms->forward_path_buffer = NULL;
+    ms->relay_path_buffer = NULL;
+    ms->mail_data_buffer = NULL;
+    ms->dkim = NULL;
     uname(&ms->my_uname);
+    stats_note_memory(config.line_length);
 
-    if (send_formatted(fd, "220 %s Service ready\r\n", ms->my_uname.nodename) <= 0)
-        return;
+    // Clients that go quiet are dropped (recv fails with EAGAIN)
+    if (config.client_timeout > 0)
+    {
+        struct timeval tv = {config.client_timeout, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
 
-    while ((len = nb_read_line(ms->nb, ms->recvbuf)) >= 0)
+    if (send_formatted(fd, "220 %s %sService ready\r\n", ms->my_uname.nodename,
+                       ms->lmtp ? "LMTP " : "") <= 0)
     {
+        free_session(ms);
+        return;
+    }
 
+    // Ends on QUIT, or as soon as the client is gone
+    while ((len = read_line(ms)) > 0)
+    {
         if (ms->recvbuf[len - 1] != '\n')
         {
+            // A last line cut short by a disconnect; the next read ends
+            // the session
+            if ((size_t) len < config.line_length)
+                continue;
             // command line is too long, stop immediately
             send_formatted(fd, "500 Syntax error, command unrecognized\r\n");
             break;
@@ -497,7 +1462,7 @@ void handle_client(int fd)
         }
 
         // Remove CR, LF and other space characters from end of buffer
-        while (isspace(ms->recvbuf[len - 1]))
+        while (len > 0 && isspace((unsigned char) ms->recvbuf[len - 1]))
             ms->recvbuf[--len] = 0;
 
         dlog("Command is %s\n", ms->recvbuf);
@@ -506,61 +1471,19 @@ void handle_client(int fd)
         ms->nwords = split(ms->recvbuf, ms->words);
         char *command = ms->words[0];
 
-        if (!strcasecmp(command, "QUIT"))
-        {
-            if (do_quit(ms) == -1)
-                break;
-        }
-        else if (!strcasecmp(command, "HELO") || !strcasecmp(command, "EHLO"))
-        {
-            if (do_helo(ms) == -1)
-                break;
-        }
-        else if (!strcasecmp(command, "MAIL"))
-        {
-            if (do_mail(ms) == -1)
-                break;
-        }
-        else if (!strcasecmp(command, "RCPT"))
-        {
-            if (do_rcpt(ms) == -1)
-                break;
-        }
-        else if (!strcasecmp(command, "DATA"))
-        {
-            if (do_data(ms) == -1)
-                break;
-        }
-        else if (!strcasecmp(command, "RSET"))
-        {
-            if (do_rset(ms) == -1)
-                break;
-        }
-        else if (!strcasecmp(command, "NOOP"))
-        {
-            if (do_noop(ms) == -1)
-                break;
-        }
-        else if (!strcasecmp(command, "VRFY"))
-        {
-            if (do_vrfy(ms) == -1)
-                break;
-        }
-        else if (!strcasecmp(command, "EXPN") ||
-                 !strcasecmp(command, "HELP"))
-        {
-            dlog("Command not implemented \"%s\"\n", command);
-            if (send_formatted(fd, "502 Command not implemented\r\n") <= 0)
-                break;
-        }
-        else
-        {
-            // invalid command
-            dlog("Illegal command \"%s\"\n", command);
-            if (send_formatted(fd, "500 Syntax error, command unrecognized\r\n") <= 0)
-                break;
-        }
+        const smtp_command *cmd = smtp_find_command(command);
+
+        // Once the server is shutting down, commands get a 421 reply,
+        // except those of a transaction in progress and QUIT
+        if (!(command && strcasecmp(command, "QUIT") == 0) && shutdown_reply(ms))
+            break;
+
+        // invalid commands get a 500 reply
+        if ((cmd ? cmd->handler(ms) : do_unrecognized(ms)) == -1)
+            break;
     }
 
-    nb_destroy(ms->nb);
+    // A transaction cut short by the client leaves its buffers behind
+    clear_buffers(ms);
+    free_session(ms);
 }
@@ -0,0 +1,23 @@
+/* mysmtpd.h
+ * SMTP session engine. handle_client() runs a complete session, of the
+ * kind of its listener, on a connected socket; the command table is
+ * exposed so that it can be exercised by the benchmark programs.
+ */
+
+#ifndef _MYSMTPD_H_
+#define _MYSMTPD_H_
+
+#include "config.h"
+
+typedef struct smtp_state smtp_state;
+
+typedef struct smtp_command
+{
+    const char *name;
+    int (*handler)(smtp_state *ms);
+} smtp_command;
+
+const smtp_command *smtp_find_command(const char *verb);
+void handle_client(int fd, Listener_kind kind, const Listen_options *opts);
+
+#endif
@@ -6,16 +6,22 @@
  */
 
 #include "netbuffer.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 struct net_buffer {
     int    fd;
     size_t max_bytes;
     size_t avail_data;
+    capture_t capture;
+    int    corked;      // TCP_CORK is set on the socket
+    int    can_cork;    // cleared if the socket does not support it
     // Buffer set as size zero, but since it's the last member of the
     // struct, it is possible to malloc additional memory after this
     // struct to be used as part of the buffer (e.g., nb->buf[5] will
@@ -44,6 +50,9 @@ net_buffer_t nb_create(int fd, size_t max_buffer_size) {
     nb->fd          = fd;
     nb->max_bytes   = max_buffer_size;
     nb->avail_data  = 0;
+    nb->capture     = NULL;
+    nb->corked      = 0;
+    nb->can_cork    = 1;
     return nb;
 }
 
@@ -55,6 +64,36 @@ void nb_destroy(net_buffer_t nb) {
     free(nb);
 }
 
+/** Records all data subsequently received through the buffer in a
+ *  session capture. The capture is not owned by the buffer, and is not
+ *  closed when the buffer is destroyed.
+ *
+ *  Parameters: nb: buffer object.
+ *              cap: capture object, or NULL to stop recording.
+ */
+void nb_set_capture(net_buffer_t nb, capture_t cap) {
+    nb->capture = cap;
+}
+
+static void set_cork(net_buffer_t nb, int on) {
+    if (setsockopt(nb->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0)
+        nb->corked = on;
+    else
+        nb->can_cork = 0;
+}
+
+/** Holds back data sent on the socket, so that replies to pipelined
+ *  commands go out together, if more input is already buffered. The
+ *  data is sent when the buffer next has to wait for input. Without
+ *  more input, or on a socket other than TCP, does nothing.
+ *
+ *  Parameters: nb: buffer object.
+ */
+void nb_cork(net_buffer_t nb) {
+    if (nb->avail_data && !nb->corked && nb->can_cork)
+        set_cork(nb, 1);
+}
+
 /** Reads a single line from the socket/buffer (i.e., a string ending
  *  in LF, aka "\n"). If the socket returns more than one line in a
  *  single call to recv, returns a single line and caches the
@@ -78,10 +117,13 @@ void nb_destroy(net_buffer_t nb) {
  *                  max_buffer_size bytes (from nb_create function)
  *                  plus one (for terminating null byte).
  *
- *  Returns: If the connection was terminated properly, returns 0. If
- *           the connection was terminated abruptly or another unknown
- *           error is found, returns -1. Otherwise, returns the number
- *           of bytes in the read line.
+ *  A last line cut short by the end of the connection is returned as
+ *  is (without LF); the next call then returns NB_EOF.
+ *
+ *  Returns: the number of bytes in the read line; NB_EOF if the peer
+ *           closed the connection and no data is left; NB_ERROR if
+ *           recv failed (the connection was reset, the receive timeout
+ *           expired, a signal interrupted it...), with errno set.
  */
 int nb_read_line(net_buffer_t nb, char out[]) {
 
@@ -92,14 +134,21 @@ int nb_read_line(net_buffer_t nb, char out[]) {
 
         // Check if the buffer has space for more data to be received
         if (nb->avail_data < nb->max_bytes) {
+            // Send what was held back before waiting for the client
+            if (nb->corked)
+                set_cork(nb, 0);
             rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
-            // If recv returns an error, return the same error.
+            stats_note_recv(rv);
+            if (rv > 0 && nb->capture)
+                capture_record(nb->capture, nb->buf + nb->avail_data, rv);
             if (rv < 0)
-                return rv;
+                return NB_ERROR;
              
-            // If recv returns 0 (i.e., end of data), return whatever is
-            // available in the buffer.
+            // At the end of data, return whatever is available in the
+            // buffer, if anything
             if (rv == 0) {
+                if (!nb->avail_data)
+                    return NB_EOF;
                 eos = nb->buf + nb->avail_data - 1;
                 break;
             }
@@ -123,6 +172,12 @@ int nb_read_line(net_buffer_t nb, char out[]) {
     return rv;
 }
 
+/** Reads num bytes from the socket/buffer, or fewer at the end of the
+ *  connection.
+ *
+ *  Returns: the number of bytes read, NB_EOF or NB_ERROR, as
+ *           nb_read_line().
+ */
 int nb_read_bytes(net_buffer_t nb, char out[], size_t num) {
 
     int rv;
@@ -131,10 +186,15 @@ int nb_read_bytes(net_buffer_t nb, char out[], size_t num) {
 
         // Check if the buffer has space for more data to be received
         if (nb->avail_data < nb->max_bytes) {
+            // Send what was held back before waiting for the client
+            if (nb->corked)
+                set_cork(nb, 0);
             rv = recv(nb->fd, nb->buf + nb->avail_data, nb->max_bytes - nb->avail_data, 0);
-            // If recv returns an error, return the same error.
+            stats_note_recv(rv);
+            if (rv > 0 && nb->capture)
+                capture_record(nb->capture, nb->buf + nb->avail_data, rv);
             if (rv < 0)
-                return rv;
+                return NB_ERROR;
             // If recv returns 0 (i.e., end of data), return whatever is
             // available in the buffer.
             if (rv == 0) {
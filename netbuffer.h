@@ -9,10 +9,20 @@
 
 #include <string.h>
 
+#include "capture.h"
+
 typedef struct net_buffer *net_buffer_t;
 
+// Results of nb_read_line() and nb_read_bytes() other than a length
+enum {
+    NB_EOF   = 0,   // the peer closed the connection, and nothing is left
+    NB_ERROR = -1   // recv() failed; errno tells why (EAGAIN: timed out)
+};
+
 net_buffer_t nb_create(int fd, size_t max_buffer_size);
 void         nb_destroy(net_buffer_t nb);
+void         nb_set_capture(net_buffer_t nb, capture_t cap);
+void         nb_cork(net_buffer_t nb);
 int          nb_read_line(net_buffer_t nb, char out[]);
 int          nb_read_bytes(net_buffer_t nb, char out[], size_t num);
 #endif
@@ -0,0 +1,89 @@
+/* qid.c
+ * Queue id generation. An id is made of the time the process started,
+ * its process id, a small per-process thread number and a per-thread
+ * counter, each encoded in base32 with a fixed width. Ids from one
+ * thread therefore sort in the order they were made, and ids never
+ * repeat as long as a process id is not reused within the same second.
+ *
+ * Making an id takes no lock and no system call: the counter is
+ * thread-local, and the process-wide parts are read once per thread.
+ * A forked child picks up its own epoch and process id through a
+ * pthread_atfork() handler.
+ */
+
+#include "qid.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define EPOCH_DIGITS   7    // 35 bits of seconds
+#define PID_DIGITS     5    // 25 bits, above the Linux pid_max of 2^22
+#define THREAD_DIGITS  4    // 2^20 threads per process lifetime
+#define COUNTER_DIGITS 7    // 2^35 ids per thread
+
+// base32hex, whose digits sort in the same order as their values
+static const char digits[] = "0123456789abcdefghijklmnopqrstuv";
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static uint64_t epoch;
+static uint64_t pid;
+static unsigned generation = 0;    // changes in every forked child
+static unsigned next_thread = 0;
+
+static __thread unsigned my_generation = (unsigned) -1;
+static __thread char     my_prefix[EPOCH_DIGITS + PID_DIGITS + THREAD_DIGITS];
+static __thread uint64_t my_counter;
+
+/** Writes the low 5 * n bits of value as n base32 digits. */
+static void encode(char *out, uint64_t value, int n) {
+    while (n-- > 0) {
+        out[n] = digits[value & 31];
+        value >>= 5;
+    }
+}
+
+static void new_process(void) {
+    epoch = time(NULL);
+    pid = getpid();
+    next_thread = 0;
+    generation++;
+}
+
+static void init(void) {
+    new_process();
+    pthread_atfork(NULL, NULL, new_process);
+}
+
+/** Makes a new queue id.
+ *
+ *  Parameters: id: buffer of at least QID_LEN + 1 characters.
+ *
+ *  Returns: id, holding the new id.
+ */
+char *qid_next(char id[QID_LEN + 1]) {
+    if (my_generation != generation) {
+        pthread_once(&once, init);
+        my_generation = generation;
+        encode(my_prefix, epoch, EPOCH_DIGITS);
+        encode(my_prefix + EPOCH_DIGITS, pid, PID_DIGITS);
+        encode(my_prefix + EPOCH_DIGITS + PID_DIGITS,
+               __sync_fetch_and_add(&next_thread, 1), THREAD_DIGITS);
+        my_counter = 0;
+    }
+    for (int i = 0; i < (int) sizeof(my_prefix); i++)
+        id[i] = my_prefix[i];
+    encode(id + sizeof(my_prefix), my_counter++, COUNTER_DIGITS);
+    id[QID_LEN] = 0;
+    return id;
+}
+
+/** Formats a Message-ID header value, "<id@host>", for a queue id.
+ *
+ *  Returns: the length of the value, as snprintf.
+ */
+size_t qid_message_id(char *buf, size_t size, const char *id, const char *host) {
+    return snprintf(buf, size, "<%s@%s>", id, host);
+}
@@ -0,0 +1,17 @@
+/* qid.h
+ * Unique, monotonic queue ids, used for spool and queue file names,
+ * trace headers, log messages and generated Message-IDs.
+ */
+
+#ifndef _QID_H_
+#define _QID_H_
+
+#include <stddef.h>
+
+// 7 characters of epoch, 5 of process id, 4 of thread and 7 of counter
+#define QID_LEN 23
+
+char  *qid_next(char id[QID_LEN + 1]);
+size_t qid_message_id(char *buf, size_t size, const char *id, const char *host);
+
+#endif
@@ -0,0 +1,825 @@
+/* relay.c
+ * Outbound relay queue.
+ *
+ * Messages for non-local recipients are written to the queue directory,
+ * one file per message and next hop. The scheduling state of a queued
+ * message lives in its file name,
+ *
+ *     <next attempt (epoch seconds)>.<attempts so far>.<queue id>
+ *
+ * so rescheduling a message is a single rename(), and the queue
+ * survives restarts without any separate index. The file itself holds
+ * the envelope followed by the message:
+ *
+ *     from <reverse-path>
+ *     rcpt <forward-path>        (one line per recipient)
+ *     <empty line>
+ *     <message data>
+ *
+ * A scheduler thread scans the queue, delivers due messages, and
+ * reschedules temporary failures with exponential backoff. Connections
+ * to each next hop are cached and reused for further transactions until
+ * they have been idle for a while. Several processes may share a queue
+ * directory; a message being delivered is locked with flock().
+ *
+ * Recipients that are rejected permanently, or still failing after
+ * RELAY_MAX_ATTEMPTS, are reported to the sender in a non-delivery
+ * report (see relay_bounce()). When there is nobody to report to, the
+ * message is kept in the "dead" subdirectory of the queue, in the same
+ * format, rather than deleted.
+ *
+ * Next hops are configured as routes: "domain=host:port" for a single
+ * recipient domain, or "host:port" as the default route. Mail for an
+ * explicitly routed domain is accepted from any client. The default
+ * route is only used for clients connecting from the local host, or
+ * authenticated on the submission port, so that the server does not
+ * become an open relay.
+ */
+
+#include "relay.h"
+#include "netbuffer.h"
+#include "server.h"
+#include "util.h"
+#include "qid.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <netdb.h>
+
+#define MAX_ROUTES             64
+#define MAX_REPLY_LINE         1024
+#define RELAY_MAX_CONNECTIONS  16
+#define RELAY_MAX_TRANSACTIONS 100   // per connection, then reconnect
+#define RELAY_IDLE_TIMEOUT     30    // seconds an idle connection is kept
+#define RELAY_SCAN_INTERVAL    5     // seconds between queue scans
+#define RELAY_RETRY_MIN        60    // first retry delay, in seconds
+#define RELAY_RETRY_MAX        3600  // longest retry delay, in seconds
+#define RELAY_MAX_ATTEMPTS     30    // then the message is given up
+#define RELAY_DEAD_DIR         "dead"  // in the queue directory
+
+struct route {
+    char *domain;     // NULL for the default route
+    char *host;
+    char *port;
+};
+
+struct hop_conn {
+    const struct route *route;
+    int          fd;
+    net_buffer_t nb;
+    time_t       last_used;
+    int          transactions;
+};
+
+typedef enum rcpt_result { Rcpt_ok, Rcpt_tempfail, Rcpt_permfail } Rcpt_result;
+
+static struct route routes[MAX_ROUTES];
+static int nroutes = 0;
+static struct hop_conn conns[RELAY_MAX_CONNECTIONS];
+static struct utsname my_uname;
+static int wake_pipe[2] = { -1, -1 };
+
+// Queue passes of the scheduler, for relay_flush()
+static pthread_mutex_t pass_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pass_cond = PTHREAD_COND_INITIALIZER;
+static unsigned passes_started = 0, passes_done = 0;
+
+/** Adds a next-hop route.
+ *
+ *  Parameters: spec: "domain=host:port" for mail to a single domain,
+ *                    or "host:port" for the default route.
+ *
+ *  Returns: 0 on success, -1 if the route is malformed or there are
+ *           too many routes.
+ */
+int relay_add_route(const char *spec) {
+    char *copy, *eq, *colon;
+    struct route *r;
+
+    if (nroutes == MAX_ROUTES)
+        return -1;
+    copy = strdup(spec);
+    r = &routes[nroutes];
+    eq = strchr(copy, '=');
+    if (eq) {
+        *eq = 0;
+        r->domain = copy;
+        r->host = eq + 1;
+    } else {
+        r->domain = NULL;
+        r->host = copy;
+    }
+    colon = strrchr(r->host, ':');
+    if (!colon || colon == r->host || !colon[1]) {
+        free(copy);
+        return -1;
+    }
+    *colon = 0;
+    r->port = colon + 1;
+    nroutes++;
+    return 0;
+}
+
+static const struct route *route_for(const char *rcpt, int allow_default) {
+    const char *domain = strrchr(rcpt, '@');
+    const struct route *dflt = NULL;
+
+    if (!domain || !domain[1])
+        return NULL;
+    domain++;
+    for (int i = 0; i < nroutes; i++) {
+        if (!routes[i].domain)
+            dflt = &routes[i];
+        else if (!strcasecmp(routes[i].domain, domain))
+            return &routes[i];
+    }
+    return allow_default ? dflt : NULL;
+}
+
+static int is_local_peer(const char *peer) {
+    return !strcmp(peer, "local") || !strcmp(peer, "::1") ||
+        !strncmp(peer, "127.", 4) || !strncmp(peer, "::ffff:127.", 11);
+}
+
+/** Checks whether a (non-local) recipient can be relayed for a client.
+ *
+ *  Parameters: rcpt: recipient address.
+ *              peer: client address, as formatted by the stats module.
+ *              authenticated: whether the client has authenticated.
+ *
+ *  Returns: non-zero if the message can be queued for relaying.
+ */
+int relay_accepts(const char *rcpt, const char *peer, int authenticated) {
+    return route_for(rcpt, authenticated || is_local_peer(peer)) != NULL;
+}
+
+/** Returns the number of messages in the relay queue, or -1 if it
+ *  cannot be read.
+ */
+int relay_queue_length(void) {
+    DIR *dir = opendir(config.queue_dir);
+    struct dirent *entry;
+    long next;
+    int attempts, n = 0;
+
+    if (!dir)
+        return errno == ENOENT ? 0 : -1;
+    while ((entry = readdir(dir)) != NULL)
+        if (sscanf(entry->d_name, "%ld.%d.", &next, &attempts) == 2)
+            n++;
+    closedir(dir);
+    return n;
+}
+
+static void wake_scheduler(void) {
+    if (wake_pipe[1] >= 0)
+        write(wake_pipe[1], "", 1);
+}
+
+/** Writes one queue file, atomically: the data goes to a temporary
+ *  file which is renamed into place once complete.
+ */
+static int write_queue_file(const char *name, const char *from, const char **rcpts, int n,
+                            const struct iovec *data, int ndata) {
+    char tmp[PATH_MAX], id[QID_LEN + 1];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s/tmp.%s", config.queue_dir, qid_next(id));
+    f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "from %s\n", from);
+    for (int i = 0; i < n; i++)
+        fprintf(f, "rcpt %s\n", rcpts[i]);
+    fputc('\n', f);
+    for (int i = 0; i < ndata; i++)
+        fwrite(data[i].iov_base, 1, data[i].iov_len, f);
+    if (fflush(f) != 0 || (config.durability != Durability_none && fsync(fileno(f)) < 0)) {
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(f);
+    if (rename(tmp, name) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/** Queues a message for relaying. Recipients are grouped by next hop,
+ *  and one queue file is written per next hop.
+ *
+ *  Parameters: from: reverse-path of the message.
+ *              rcpts: list of recipients (all accepted by relay_accepts).
+ *              data: message contents, with CRLF line endings, given
+ *                    as pieces (e.g., trace headers and body) that are
+ *                    written one after the other.
+ *              ndata: number of pieces in data.
+ *              failed: if not NULL, the recipients the message could not
+ *                      be queued for are added to this list.
+ *
+ *  Returns: 0 if the message was queued for all recipients, -1 otherwise.
+ */
+int relay_enqueue(const char *from, user_list_t rcpts, const struct iovec *data, int ndata,
+                  user_list_t *failed) {
+    int n = user_list_len(rcpts), done[n], rv = 0;
+    const char *addrs[n], *group[n];
+    const struct route *hops[n];
+    char name[PATH_MAX], id[QID_LEN + 1];
+    time_t now = time(NULL);
+
+    mkdir(config.queue_dir, 0777);
+    for (int i = 0; i < n; i++, rcpts = user_list_next(rcpts)) {
+        addrs[i] = user_list_user(rcpts);
+        hops[i] = route_for(addrs[i], 1);
+        done[i] = 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int ngroup = 0;
+        if (done[i])
+            continue;
+        for (int j = i; j < n; j++)
+            if (!done[j] && hops[j] == hops[i]) {
+                group[ngroup++] = addrs[j];
+                done[j] = 1;
+            }
+        snprintf(name, sizeof(name), "%s/%ld.0.%s", config.queue_dir, (long) now, qid_next(id));
+        if (write_queue_file(name, from, group, ngroup, data, ndata) < 0) {
+            dlog("relay: cannot queue message: %s\n", strerror(errno));
+            for (int j = 0; failed && j < ngroup; j++)
+                user_list_add(failed, group[j]);
+            rv = -1;
+        } else {
+            dlog("relay: queued %s for %d recipient(s)\n", strrchr(name, '/') + 1, ngroup);
+        }
+    }
+    wake_scheduler();
+    return rv;
+}
+
+/** Returns an undeliverable message to its sender, in a non-delivery
+ *  report carrying the reason and the headers of the message. A report
+ *  for a local sender is stored in its mailbox; any other is queued for
+ *  relaying, with a null reverse-path so that it is never reported on
+ *  in turn.
+ *
+ *  Parameters: id: queue id of the message, for the report and logs.
+ *              from: reverse-path of the message.
+ *              rcpts: the recipients it could not be delivered to.
+ *              n: number of recipients.
+ *              reason: why delivery failed, one line of text.
+ *              data, len: the message.
+ *
+ *  Returns: 0 if the report was stored or queued, -1 if there is no one
+ *           to report to (a null reverse-path, or a sender that is
+ *           neither local nor routed) or it could not be written.
+ */
+int relay_bounce(const char *id, const char *from, const char **rcpts, int n,
+                 const char *reason, const char *data, size_t len) {
+    struct utsname host;
+    char *report = NULL, date[64], message_id[QID_LEN + sizeof(host.nodename) + 4];
+    char report_id[QID_LEN + 1];
+    size_t size = 0, headers = 0;
+    time_t now = time(NULL);
+    int local, rv = -1;
+    FILE *f;
+
+    local = *from && is_valid_user(from, NULL);
+    if (!local && (!*from || !route_for(from, 1)))
+        return -1;
+
+    // The original headers end at the first empty line
+    while (headers < len && data[headers] != '\r' && data[headers] != '\n') {
+        const char *eol = memchr(data + headers, '\n', len - headers);
+        headers = eol ? (size_t) (eol + 1 - data) : len;
+    }
+
+    uname(&host);
+    qid_next(report_id);
+    qid_message_id(message_id, sizeof(message_id), report_id, host.nodename);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z", localtime(&now));
+    f = open_memstream(&report, &size);
+    if (!f)
+        return -1;
+    fprintf(f, "From: Mail Delivery System <MAILER-DAEMON@%s>\r\n"
+            "To: <%s>\r\n"
+            "Subject: Undelivered Mail Returned to Sender\r\n"
+            "Date: %s\r\n"
+            "Message-ID: %s\r\n"
+            "Auto-Submitted: auto-replied\r\n"
+            "\r\n"
+            "This is the mail system at host %s.\r\n"
+            "\r\n"
+            "Your message could not be delivered to the following recipient(s):\r\n"
+            "\r\n",
+            host.nodename, from, date, message_id, host.nodename);
+    for (int i = 0; i < n; i++)
+        fprintf(f, "    <%s>\r\n", rcpts[i]);
+    fprintf(f, "\r\nReason: %s\r\n\r\n--- Headers of the returned message ---\r\n\r\n", reason);
+    fwrite(data, 1, headers, f);
+    if (fclose(f) != 0) {
+        free(report);
+        return -1;
+    }
+
+    struct iovec body = { report, size };
+    if (local) {
+        char file_name[PATH_MAX];
+        int fd;
+        snprintf(file_name, sizeof(file_name), "%s/bounce_tmp.%s", config.mail_store, report_id);
+        fd = open(file_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0 && errno == ENOENT && mkdir(config.mail_store, 0777) == 0)
+            fd = open(file_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            if (write(fd, report, size) == (ssize_t) size &&
+                (config.durability != Durability_full || fsync(fd) == 0) &&
+                save_user_mail_one(file_name, from) == 0)
+                rv = 0;
+            close(fd);
+            unlink(file_name);
+        }
+    } else {
+        user_list_t to = user_list_create();
+        user_list_add(&to, from);
+        rv = relay_enqueue("", to, &body, 1, NULL);
+        user_list_destroy(to);
+    }
+    if (rv == 0)
+        dlog("relay: %s: returned to <%s> for %d recipient(s): %s\n", id, from, n, reason);
+    free(report);
+    return rv;
+}
+
+/** Gives up on some recipients of a queued message: returns it to the
+ *  sender or, if that is not possible, keeps a copy for them in the
+ *  dead-letter directory.
+ *
+ *  Returns: 0 on success, -1 if the message has to stay queued for them.
+ */
+static int give_up(const char *id, const char *from, const char **rcpts, int n,
+                   const char *reason, const struct iovec *body) {
+    char name[PATH_MAX], dead_id[QID_LEN + 1];
+
+    if (relay_bounce(id, from, rcpts, n, reason, body->iov_base, body->iov_len) == 0)
+        return 0;
+    snprintf(name, sizeof(name), "%s/" RELAY_DEAD_DIR, config.queue_dir);
+    mkdir(name, 0777);
+    snprintf(name, sizeof(name), "%s/" RELAY_DEAD_DIR "/%s", config.queue_dir, qid_next(dead_id));
+    if (write_queue_file(name, from, rcpts, n, body, 1) < 0) {
+        dlog("relay: %s: cannot keep undeliverable message: %s\n", id, strerror(errno));
+        return -1;
+    }
+    dlog("relay: %s: %s, kept as " RELAY_DEAD_DIR "/%s\n", id, reason, dead_id);
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* SMTP client side                                                    */
+
+static void close_connection(struct hop_conn *c, int polite) {
+    if (c->fd < 0)
+        return;
+    if (polite)
+        send_all(c->fd, "QUIT\r\n", 6);
+    nb_destroy(c->nb);
+    close(c->fd);
+    c->fd = -1;
+    c->route = NULL;
+}
+
+/** Reads a (possibly multi-line) reply and returns its code, or -1 if
+ *  the connection failed.
+ */
+static int read_reply(struct hop_conn *c) {
+    char line[MAX_REPLY_LINE + 1];
+    for (;;) {
+        int len = nb_read_line(c->nb, line);
+        if (len < 4)
+            return -1;
+        if (line[3] != '-')
+            return atoi(line);
+    }
+}
+
+static int command(struct hop_conn *c, const char *fmt, ...)
+    __attribute__ ((format(printf, 2, 3)));
+
+/** Sends a command and returns the reply code, or -1 on connection
+ *  failure. Not using send_formatted(), whose buffer is not shared
+ *  safely between threads.
+ */
+static int command(struct hop_conn *c, const char *fmt, ...) {
+    char buf[MAX_REPLY_LINE];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len < 0 || len >= sizeof(buf) || send_all(c->fd, buf, len) <= 0)
+        return -1;
+    return read_reply(c);
+}
+
+static int open_connection(struct hop_conn *c, const struct route *r) {
+    struct addrinfo hints, *res, *p;
+    struct timeval tv = { config.relay_timeout, 0 };
+    int fd = -1, rv;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(r->host, r->port, &hints, &res)) != 0) {
+        dlog("relay: %s: %s\n", r->host, gai_strerror(rv));
+        return -1;
+    }
+    for (p = res; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        dlog("relay: cannot connect to %s:%s\n", r->host, r->port);
+        return -1;
+    }
+
+    c->fd = fd;
+    c->nb = nb_create(fd, MAX_REPLY_LINE);
+    c->route = r;
+    c->transactions = 0;
+    if (read_reply(c) != 220 || command(c, "EHLO %s\r\n", my_uname.nodename) != 250) {
+        dlog("relay: %s:%s refused the session\n", r->host, r->port);
+        close_connection(c, 1);
+        return -1;
+    }
+    dlog("relay: connected to %s:%s\n", r->host, r->port);
+    return 0;
+}
+
+/** Returns a connection to the next hop of a route, reusing a cached
+ *  one if available. When the cache is full, the least recently used
+ *  connection is closed.
+ */
+static struct hop_conn *get_connection(const struct route *r) {
+    struct hop_conn *slot = NULL;
+
+    for (int i = 0; i < RELAY_MAX_CONNECTIONS; i++) {
+        struct hop_conn *c = &conns[i];
+        if (c->fd >= 0 && c->route == r)
+            return c;
+        if (!slot || c->fd < 0 || (slot->fd >= 0 && c->last_used < slot->last_used))
+            slot = c;
+    }
+    close_connection(slot, 1);
+    if (open_connection(slot, r) < 0)
+        return NULL;
+    return slot;
+}
+
+static Rcpt_result classify(int code) {
+    if (code >= 200 && code < 300)
+        return Rcpt_ok;
+    if (code >= 500 && code < 600)
+        return Rcpt_permfail;
+    return Rcpt_tempfail;
+}
+
+/** Sends the message data, dot-stuffing lines that start with '.',
+ *  followed by the end-of-data marker.
+ */
+static int send_data(struct hop_conn *c, const char *data, size_t len) {
+    const char *line = data, *end = data + len;
+    while (line < end) {
+        const char *eol = memchr(line, '\n', end - line);
+        size_t n = eol ? (size_t) (eol + 1 - line) : (size_t) (end - line);
+        if (line[0] == '.' && send_all(c->fd, ".", 1) <= 0)
+            return -1;
+        if (send_all(c->fd, (char *) line, n) <= 0)
+            return -1;
+        line += n;
+    }
+    if (len && data[len - 1] != '\n' && send_all(c->fd, "\r\n", 2) <= 0)
+        return -1;
+    return send_all(c->fd, ".\r\n", 3) <= 0 ? -1 : 0;
+}
+
+/** Runs one mail transaction on a connection, filling in the result
+ *  for each recipient.
+ *
+ *  Returns: 0 if the transaction completed (successfully or not), -1
+ *           if the connection failed, in which case the results are
+ *           not meaningful.
+ */
+static int transaction(struct hop_conn *c, const char *from, const char **rcpts, int n,
+                       const char *data, size_t len, Rcpt_result results[]) {
+    int code, accepted = 0;
+    Rcpt_result final;
+
+    c->transactions++;
+    c->last_used = time(NULL);
+
+    if ((code = command(c, "MAIL FROM:<%s>\r\n", from)) < 0)
+        return -1;
+    if (classify(code) != Rcpt_ok) {
+        for (int i = 0; i < n; i++)
+            results[i] = classify(code);
+        command(c, "RSET\r\n");
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if ((code = command(c, "RCPT TO:<%s>\r\n", rcpts[i])) < 0)
+            return -1;
+        results[i] = classify(code);
+        accepted += results[i] == Rcpt_ok;
+    }
+    if (!accepted) {
+        command(c, "RSET\r\n");
+        return 0;
+    }
+
+    if ((code = command(c, "DATA\r\n")) < 0)
+        return -1;
+    if (code == 354) {
+        if (send_data(c, data, len) < 0 || (code = read_reply(c)) < 0)
+            return -1;
+        final = classify(code);
+    } else {
+        command(c, "RSET\r\n");
+        final = code >= 500 && code < 600 ? Rcpt_permfail : Rcpt_tempfail;
+    }
+
+    // The reply to the message data applies to all accepted recipients
+    for (int i = 0; i < n; i++)
+        if (results[i] == Rcpt_ok)
+            results[i] = final;
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Scheduler                                                           */
+
+static time_t backoff(int attempts) {
+    time_t delay = RELAY_RETRY_MIN;
+    while (--attempts > 0 && delay < RELAY_RETRY_MAX)
+        delay *= 2;
+    return delay < RELAY_RETRY_MAX ? delay : RELAY_RETRY_MAX;
+}
+
+/** Attempts delivery of one queued message, then removes or
+ *  reschedules its queue file.
+ */
+static void deliver_entry(const char *name, int attempts, const char *id) {
+    char path[PATH_MAX], newpath[PATH_MAX];
+    char *contents, *p, *data, *from = NULL;
+    const char **rcpts = NULL;
+    struct stat st, path_st;
+    int fd, n = 0, cap = 0, remaining = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", config.queue_dir, name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    // Another process may be delivering it, or have finished between the
+    // open() and the flock(): the file was then removed or renamed
+    // (rescheduled), and the name no longer refers to the locked file
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0 || st.st_nlink == 0 ||
+        stat(path, &path_st) < 0 || path_st.st_ino != st.st_ino || path_st.st_dev != st.st_dev) {
+        close(fd);
+        return;
+    }
+
+    contents = malloc(st.st_size + 1);
+    if (!contents || read(fd, contents, st.st_size) != st.st_size) {
+        free(contents);
+        close(fd);
+        return;
+    }
+    contents[st.st_size] = 0;
+
+    for (p = contents; *p && *p != '\n'; ) {
+        char *eol = strchr(p, '\n');
+        if (!eol)
+            break;
+        *eol = 0;
+        if (!strncmp(p, "from ", 5)) {
+            from = p + 5;
+        } else if (!strncmp(p, "rcpt ", 5)) {
+            if (n == cap)
+                rcpts = realloc(rcpts, (cap = cap ? cap * 2 : 8) * sizeof(*rcpts));
+            rcpts[n++] = p + 5;
+        }
+        p = eol + 1;
+    }
+    if (!from || !n || *p != '\n') {
+        dlog("relay: %s: malformed queue file, removed\n", name);
+        unlink(path);
+        free(rcpts);
+        free(contents);
+        close(fd);
+        return;
+    }
+    data = p + 1;
+
+    Rcpt_result results[n];
+    const struct route *r = route_for(rcpts[0], 1);
+    struct hop_conn *c = r ? get_connection(r) : NULL;
+    int rv = c ? transaction(c, from, rcpts, n, data, st.st_size - (data - contents), results) : -1;
+    if (rv < 0 && c && c->transactions > 1) {
+        // A cached connection may have been closed by the peer while
+        // idle; retry once on a fresh connection.
+        close_connection(c, 0);
+        c = get_connection(r);
+        rv = c ? transaction(c, from, rcpts, n, data, st.st_size - (data - contents), results) : -1;
+    }
+    if (rv < 0) {
+        if (c)
+            close_connection(c, 0);
+        for (int i = 0; i < n; i++)
+            results[i] = Rcpt_tempfail;
+    } else if (c->transactions >= RELAY_MAX_TRANSACTIONS) {
+        close_connection(c, 1);
+    }
+
+    // Keep only the recipients that should be retried
+    const char *rejected[n];
+    int nrejected = 0, expired = 0;
+    for (int i = 0; i < n; i++) {
+        if (results[i] == Rcpt_ok)
+            dlog("relay: %s: delivered to <%s>\n", id, rcpts[i]);
+        else if (results[i] == Rcpt_permfail)
+            rejected[nrejected++] = rcpts[i];
+        else
+            rcpts[remaining++] = rcpts[i];
+    }
+
+    attempts++;
+    if (remaining && attempts >= RELAY_MAX_ATTEMPTS) {
+        dlog("relay: %s: giving up after %d attempts\n", id, attempts);
+        expired = remaining;
+        remaining = 0;
+    }
+
+    // Recipients that cannot be given up on yet are retried instead
+    struct iovec body = { data, st.st_size - (data - contents) };
+    char reason[64];
+    snprintf(reason, sizeof(reason), "still failing temporarily after %d attempts", attempts);
+    if (expired && give_up(id, from, rcpts, expired, reason, &body) < 0)
+        remaining = expired;
+    if (nrejected && give_up(id, from, rejected, nrejected, "rejected permanently by the next hop", &body) < 0)
+        for (int i = 0; i < nrejected; i++)
+            rcpts[remaining++] = rejected[i];
+    if (remaining) {
+        snprintf(newpath, sizeof(newpath), "%s/%ld.%d.%s", config.queue_dir,
+                 (long) (time(NULL) + backoff(attempts)), attempts, id);
+        if (remaining == n) {
+            rename(path, newpath);
+        } else if (write_queue_file(newpath, from, rcpts, remaining, &body, 1) == 0) {
+            unlink(path);
+        }
+        dlog("relay: %s: %d recipient(s) deferred, attempt %d\n", id, remaining, attempts);
+    } else {
+        unlink(path);
+    }
+    free(rcpts);
+    free(contents);
+    close(fd);
+}
+
+/** Delivers all due messages in the queue.
+ *
+ *  Returns: the earliest time at which a queued message is due, or 0
+ *           if the queue is empty.
+ */
+static time_t run_queue(void) {
+    DIR *dir = opendir(config.queue_dir);
+    struct dirent *entry;
+    time_t next_due = 0;
+
+    if (!dir)
+        return 0;
+    while ((entry = readdir(dir)) != NULL) {
+        long next;
+        int attempts, pos = 0;
+        if (sscanf(entry->d_name, "%ld.%d.%n", &next, &attempts, &pos) != 2 || !pos)
+            continue;
+        if (next <= time(NULL))
+            deliver_entry(entry->d_name, attempts, entry->d_name + pos);
+        else if (!next_due || next < next_due)
+            next_due = next;
+    }
+    closedir(dir);
+    return next_due;
+}
+
+static void close_idle_connections(void) {
+    time_t now = time(NULL);
+    for (int i = 0; i < RELAY_MAX_CONNECTIONS; i++)
+        if (conns[i].fd >= 0 && now - conns[i].last_used >= RELAY_IDLE_TIMEOUT)
+            close_connection(&conns[i], 1);
+}
+
+static void *scheduler(void *arg) {
+    char buf[64];
+    for (;;) {
+        pthread_mutex_lock(&pass_lock);
+        unsigned pass = ++passes_started;
+        pthread_mutex_unlock(&pass_lock);
+
+        time_t next_due = run_queue();
+        close_idle_connections();
+
+        pthread_mutex_lock(&pass_lock);
+        passes_done = pass;
+        pthread_cond_broadcast(&pass_cond);
+        pthread_mutex_unlock(&pass_lock);
+
+        // Sleep until the next message is due, the next periodic scan
+        // (which picks up messages queued by other processes), or a
+        // new message is queued by this process.
+        time_t now = time(NULL);
+        int timeout = RELAY_SCAN_INTERVAL;
+        if (next_due && next_due - now < timeout)
+            timeout = next_due > now ? next_due - now : 0;
+        struct pollfd pfd = { wake_pipe[0], POLLIN, 0 };
+        if (poll(&pfd, 1, timeout * 1000) > 0)
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+    }
+    return NULL;
+}
+
+/** Starts the relay scheduler thread, if any route is configured. The
+ *  thread delivers messages queued by this process and by any process
+ *  forked from it.
+ */
+void relay_start(void) {
+    pthread_t thread;
+
+    if (!nroutes)
+        return;
+    uname(&my_uname);
+    for (int i = 0; i < RELAY_MAX_CONNECTIONS; i++)
+        conns[i].fd = -1;
+    mkdir(config.queue_dir, 0777);
+    if (pipe(wake_pipe) < 0 ||
+        fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) < 0 ||
+        pthread_create(&thread, NULL, scheduler, NULL) != 0) {
+        perror("relay");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/** Delivers the messages that are due now before returning, for a
+ *  server that is about to exit. Messages that are not due, or not
+ *  delivered in time, stay in the queue for the next start.
+ *
+ *  Parameters: timeout: seconds to wait at most.
+ */
+void relay_flush(int timeout) {
+    struct timespec deadline;
+
+    if (!nroutes)
+        return;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    // Wait for a whole pass that starts after this call
+    pthread_mutex_lock(&pass_lock);
+    unsigned target = passes_started + 1;
+    wake_scheduler();
+    while ((int) (passes_done - target) < 0)
+        if (pthread_cond_timedwait(&pass_cond, &pass_lock, &deadline) == ETIMEDOUT) {
+            dlog("relay: queue not flushed in %d seconds\n", timeout);
+            break;
+        }
+    pthread_mutex_unlock(&pass_lock);
+}
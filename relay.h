@@ -0,0 +1,25 @@
+/* relay.h
+ * Outbound relaying of mail for non-local recipients: a persistent
+ * queue, a retry scheduler with exponential backoff, and a delivery
+ * engine that keeps SMTP connections to each next hop open for reuse.
+ */
+
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "mailuser.h"
+
+int  relay_add_route(const char *spec);
+int  relay_accepts(const char *rcpt, const char *peer, int authenticated);
+int  relay_enqueue(const char *from, user_list_t rcpts, const struct iovec *data, int ndata,
+                   user_list_t *failed);
+int  relay_bounce(const char *id, const char *from, const char **rcpts, int n,
+                  const char *reason, const char *data, size_t len);
+void relay_start(void);
+void relay_flush(int timeout);
+int  relay_queue_length(void);
+
+#endif
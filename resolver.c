@@ -0,0 +1,341 @@
+/* resolver.c
+ * Asynchronous reverse DNS for client addresses.
+ *
+ * resolver_lookup() only queues the address for a small pool of
+ * resolver threads and returns immediately; resolver_result() only
+ * looks at the cache. Neither ever waits for DNS, so a session can ask
+ * for the name of its peer at any point and simply gets "pending" if
+ * the answer is not in yet; resolver_wait() waits for it, up to a
+ * deadline, where the answer matters.
+ *
+ * The cache and the lookup queue live in shared memory, set up by the
+ * server process together with the threads, so that processes forked
+ * per client (or prefork workers) all share one warm cache and one
+ * pool of threads, like the greylisting table. A bucket holds
+ * RESOLVER_WAYS entries; when all are taken, a new address replaces the
+ * finished entry that expires first.
+ *
+ * A name counts as found only if it is forward-confirmed, i.e., one of
+ * its addresses is the client address. Answers are cached for
+ * RESOLVER_TTL seconds, failures for RESOLVER_NEGATIVE_TTL seconds.
+ *
+ * For testing, a stub file can supply the answers instead of DNS. Each
+ * line holds an address and a name, or "-" for no name:
+ *     127.0.0.1  localhost.example
+ *     10.0.0.9   -
+ */
+
+#include "resolver.h"
+#include "util.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define RESOLVER_QUEUE_SIZE   256
+#define RESOLVER_BUCKETS      1024
+#define RESOLVER_WAYS         8       // entries per bucket
+#define RESOLVER_MAX_NAME     256
+#define RESOLVER_TTL          3600
+#define RESOLVER_NEGATIVE_TTL 300
+
+struct cache_entry {
+    char   addr[INET6_ADDRSTRLEN];   // empty for a free entry
+    char   name[RESOLVER_MAX_NAME];
+    Resolve_status status;
+    time_t expires;
+};
+
+struct shared {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;    // a lookup was queued
+    pthread_cond_t  done;    // a lookup finished
+    int  queue_head, queue_len;
+    char queue[RESOLVER_QUEUE_SIZE][INET6_ADDRSTRLEN];
+    struct cache_entry cache[RESOLVER_BUCKETS][RESOLVER_WAYS];
+};
+
+struct stub_entry {
+    char *addr;
+    char *name;   // NULL for "no name"
+    struct stub_entry *next;
+};
+
+static struct shared *shared = NULL;
+static struct stub_entry *stub = NULL;
+
+static unsigned hash_addr(const char *addr) {
+    unsigned h = 2166136261u;
+    while (*addr)
+        h = (h ^ (unsigned char) *addr++) * 16777619u;
+    return h % RESOLVER_BUCKETS;
+}
+
+static void lock_shared(void) {
+    // The lock is robust: a session process that died holding it
+    // does not wedge the others.
+    if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&shared->lock);
+}
+
+/** Returns the cache entry for an address, or NULL. Expired entries
+ *  in its bucket are freed on the way. Must be called with the lock
+ *  held.
+ */
+static struct cache_entry *cache_find(const char *addr) {
+    struct cache_entry *bucket = shared->cache[hash_addr(addr)], *found = NULL;
+    time_t now = time(NULL);
+
+    for (int i = 0; i < RESOLVER_WAYS; i++) {
+        struct cache_entry *e = &bucket[i];
+        if (e->addr[0] && e->status != Resolve_pending && e->expires <= now)
+            e->addr[0] = 0;
+        else if (e->addr[0] && !strcmp(e->addr, addr))
+            found = e;
+    }
+    return found;
+}
+
+/** Adds a pending entry for an address, in a free entry of its bucket
+ *  or else in place of the finished entry that expires first. If all
+ *  are pending, the address is not cached. Must be called with the
+ *  lock held, after cache_find().
+ */
+static struct cache_entry *cache_add(const char *addr) {
+    struct cache_entry *bucket = shared->cache[hash_addr(addr)], *e = NULL;
+
+    for (int i = 0; i < RESOLVER_WAYS; i++) {
+        struct cache_entry *c = &bucket[i];
+        if (!c->addr[0]) {
+            e = c;
+            break;
+        }
+        if (c->status != Resolve_pending && (!e || c->expires < e->expires))
+            e = c;
+    }
+    if (!e)
+        return NULL;
+    snprintf(e->addr, sizeof(e->addr), "%s", addr);
+    e->name[0] = 0;
+    e->status = Resolve_pending;
+    return e;
+}
+
+/** Loads a stub file that answers lookups instead of DNS.
+ *
+ *  Returns: 0 on success, -1 if the file cannot be read.
+ */
+int resolver_load_stub(const char *file) {
+    char addr[INET6_ADDRSTRLEN + 1], name[NI_MAXHOST + 1];
+    FILE *f = fopen(file, "r");
+
+    if (!f)
+        return -1;
+    while (fscanf(f, "%46s %1025s", addr, name) == 2) {
+        struct stub_entry *s = malloc(sizeof(struct stub_entry));
+        s->addr = strdup(addr);
+        s->name = strcmp(name, "-") ? strdup(name) : NULL;
+        s->next = stub;
+        stub = s;
+    }
+    fclose(f);
+    return 0;
+}
+
+/** Checks that a host name resolves back to the given address.
+ */
+static int forward_confirms(const char *name, const char *addr) {
+    struct addrinfo hints, *res, *p;
+    char buf[INET6_ADDRSTRLEN];
+    int found = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name, NULL, &hints, &res) != 0)
+        return 0;
+    for (p = res; p && !found; p = p->ai_next)
+        if (!getnameinfo(p->ai_addr, p->ai_addrlen, buf, sizeof(buf), NULL, 0, NI_NUMERICHOST))
+            found = !strcmp(buf, addr);
+    freeaddrinfo(res);
+    return found;
+}
+
+/** Performs a blocking lookup. Only ever called by resolver threads.
+ */
+static Resolve_status resolve(const char *addr, char *name, size_t len) {
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+
+    for (struct stub_entry *s = stub; s; s = s->next)
+        if (!strcmp(s->addr, addr)) {
+            if (!s->name)
+                return Resolve_none;
+            snprintf(name, len, "%s", s->name);
+            return Resolve_found;
+        }
+
+    memset(&ss, 0, sizeof(ss));
+    if (inet_pton(AF_INET, addr, &((struct sockaddr_in *) &ss)->sin_addr) == 1) {
+        ss.ss_family = AF_INET;
+        sslen = sizeof(struct sockaddr_in);
+    } else if (inet_pton(AF_INET6, addr, &((struct sockaddr_in6 *) &ss)->sin6_addr) == 1) {
+        ss.ss_family = AF_INET6;
+        sslen = sizeof(struct sockaddr_in6);
+    } else {
+        return Resolve_none;
+    }
+    if (getnameinfo((struct sockaddr *) &ss, sslen, name, len, NULL, 0, NI_NAMEREQD) != 0)
+        return Resolve_none;
+    return forward_confirms(name, addr) ? Resolve_found : Resolve_none;
+}
+
+static void *resolver_thread(void *arg) {
+    char addr[INET6_ADDRSTRLEN], name[RESOLVER_MAX_NAME];
+
+    lock_shared();
+    for (;;) {
+        while (!shared->queue_len)
+            if (pthread_cond_wait(&shared->work, &shared->lock) == EOWNERDEAD)
+                pthread_mutex_consistent(&shared->lock);
+        strcpy(addr, shared->queue[shared->queue_head]);
+        shared->queue_head = (shared->queue_head + 1) % RESOLVER_QUEUE_SIZE;
+        shared->queue_len--;
+        pthread_mutex_unlock(&shared->lock);
+
+        Resolve_status status = resolve(addr, name, sizeof(name));
+
+        lock_shared();
+        struct cache_entry *e = cache_find(addr);
+        if (e) {
+            e->status = status;
+            e->expires = time(NULL) + (status == Resolve_found ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+            snprintf(e->name, sizeof(e->name), "%s", status == Resolve_found ? name : "");
+        }
+        pthread_cond_broadcast(&shared->done);
+        dlog("resolver: %s -> %s\n", addr, status == Resolve_found ? name : "(none)");
+    }
+    return NULL;
+}
+
+/** Sets up the lookup cache in shared memory and starts the resolver
+ *  threads. Called once, by the server process: sessions in the
+ *  processes it forks share its cache and its threads.
+ *
+ *  Returns: 0 on success, -1 on failure.
+ */
+int resolver_start(void) {
+    pthread_mutexattr_t attr;
+    pthread_condattr_t cattr;
+    pthread_t thread;
+
+    shared = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        shared = NULL;
+        return -1;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&shared->work, &cattr);
+    pthread_cond_init(&shared->done, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    for (int i = 0; i < config.resolver_threads; i++)
+        if (pthread_create(&thread, NULL, resolver_thread, NULL) == 0)
+            pthread_detach(thread);
+    return 0;
+}
+
+/** Starts a reverse lookup of an address unless the cache already has
+ *  an answer or a lookup is in progress. Never blocks on DNS; if the
+ *  lookup queue is full, the request is dropped and the address stays
+ *  unresolved.
+ *
+ *  Parameters: addr: numeric IPv4 or IPv6 address.
+ */
+void resolver_lookup(const char *addr) {
+    if (!shared)
+        return;
+    lock_shared();
+    if (!cache_find(addr) && shared->queue_len < RESOLVER_QUEUE_SIZE && cache_add(addr)) {
+        snprintf(shared->queue[(shared->queue_head + shared->queue_len) % RESOLVER_QUEUE_SIZE],
+                 INET6_ADDRSTRLEN, "%s", addr);
+        shared->queue_len++;
+        pthread_cond_signal(&shared->work);
+    }
+    pthread_mutex_unlock(&shared->lock);
+}
+
+/** Returns the reverse lookup result for an address, waiting for a
+ *  lookup in progress for at most the given time.
+ *
+ *  Parameters: addr: numeric address passed to resolver_lookup.
+ *              name: buffer receiving the host name, if found.
+ *              len: size of the name buffer.
+ *              timeout_ms: longest time to wait; 0 not to wait at all.
+ */
+Resolve_status resolver_wait(const char *addr, char *name, size_t len, int timeout_ms) {
+    Resolve_status status = Resolve_pending;
+    struct timespec deadline;
+
+    if (!shared)
+        return Resolve_pending;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    lock_shared();
+    for (;;) {
+        struct cache_entry *e = cache_find(addr);
+        // No entry: the lookup was never queued, so there is nothing to
+        // wait for
+        if (!e || e->status != Resolve_pending) {
+            status = e ? e->status : Resolve_pending;
+            if (status == Resolve_found)
+                snprintf(name, len, "%s", e->name);
+            break;
+        }
+        int rv = timeout_ms > 0 ? pthread_cond_timedwait(&shared->done, &shared->lock, &deadline)
+                                : ETIMEDOUT;
+        if (rv == EOWNERDEAD)
+            pthread_mutex_consistent(&shared->lock);
+        else if (rv == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&shared->lock);
+    return status;
+}
+
+/** Returns the cached reverse lookup result for an address, without
+ *  waiting.
+ *
+ *  Parameters: addr: numeric address passed to resolver_lookup.
+ *              name: buffer receiving the host name, if found.
+ *              len: size of the name buffer.
+ */
+Resolve_status resolver_result(const char *addr, char *name, size_t len) {
+    return resolver_wait(addr, name, len, 0);
+}
@@ -0,0 +1,24 @@
+/* resolver.h
+ * Asynchronous reverse DNS lookups of client addresses, with a cache
+ * of positive and negative answers shared by the server's processes.
+ */
+
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#include <stddef.h>
+
+typedef enum resolve_status
+{
+    Resolve_pending,    // lookup not finished (or not started)
+    Resolve_found,      // address has a forward-confirmed name
+    Resolve_none        // no name, or the name does not map back
+} Resolve_status;
+
+int            resolver_load_stub(const char *file);
+int            resolver_start(void);
+void           resolver_lookup(const char *addr);
+Resolve_status resolver_result(const char *addr, char *name, size_t len);
+Resolve_status resolver_wait(const char *addr, char *name, size_t len, int timeout_ms);
+
+#endif
@@ -12,36 +12,70 @@
  * send_all.
  */
 
+#define _GNU_SOURCE     // accept4()
+
 #include "server.h"
 #include "util.h"
+#include "stats.h"
+#include "admission.h"
+#include "config.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 
-#define BACKLOG 10     // how many pending connections queue will hold
+#define SERVER_HANDOFF_TIMEOUT 30   // seconds for a new server to take over
 
-/** Signal handler used to destroy zombie children (forked) processes
- *  once they finish executing.
- */
-static void sigchld_handler(int s) {
+// Clients accepted from a listener in one go by the fork engine, which
+// does not run sessions itself and can drain a burst quickly
+#define ACCEPT_BATCH 64
 
-    // waitpid() might overwrite errno, so we save and restore it:
-    int saved_errno = errno;
-    while(waitpid(-1, NULL, WNOHANG) > 0);
-    errno = saved_errno;
-}
+// Socket activation: a service manager passes LISTEN_FDS listening
+// sockets, from file descriptor 3 on. Those that match no configured
+// listen address are named ACTIVATED_PREFIX and their address.
+#define LISTEN_FDS_START 3
+#define ACTIVATED_PREFIX "fd:"
+
+// Events read from the signal pipe
+#define EVENT_UPGRADE 1   // SIGUSR2
+#define EVENT_STOP    2   // SIGTERM or SIGINT, or the shutdown deadline
+#define EVENT_CHILD   4   // SIGCHLD
+
+static int signal_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t stop_state = Server_running;
+static char **upgrade_argv = NULL;
+static void (*upgrade_hook)(void) = NULL;
+static void (*shutdown_hook)(void) = NULL;
+
+// Listening sockets to stop on a shutdown; cleared where they are not
+// this server's to stop (session processes, or after a handoff)
+static const int *stop_listeners = NULL;
+static volatile sig_atomic_t nstop_listeners = 0;
+
+// Kind and options of each listener, in the order of config.listen
+static Listener_kind listener_kinds[CONFIG_MAX_LISTEN];
+static Listen_options listener_options[CONFIG_MAX_LISTEN];
+
+// Session processes of the fork engine
+static pid_t *children = NULL;
+static int nchildren = 0, children_size = 0;
 
 /** Signal handler used to catch seg faults
  */
@@ -73,30 +107,188 @@ static void *get_in_addr(struct sockaddr *sa) {
         return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-/** Creates a server socket at the specified port number, listens for
- *  new connections and accepts them. A new forked process is created
- *  for each new client, calling the provided handler function for
- *  this client.
+/** Splits a listen address, "port", "host:port" or "[address]:port",
+ *  into its host (empty for all local addresses) and port.
  *
- *  Parameters: port: String corresponding to the port number (or
- *                    name) where the server will listen for new
- *                    connections.
- *              handler: Function to be called when a new connection
- *                       is accepted. Will receive, as the only
- *                       parameter, the file descriptor corresponding
- *                       to the newly accepted connection.
+ *  Returns: the port.
  */
-void run_server(const char *port, void (*handler)(int)) {
-  
+static const char *split_listen(const char *addr, char *host, size_t size) {
+    const char *colon = strrchr(addr, ':');
+
+    host[0] = 0;
+    if (addr[0] == '[' && colon && colon[-1] == ']') {
+        snprintf(host, size, "%.*s", (int) (colon - addr - 2), addr + 1);
+        return colon + 1;
+    }
+    // A bare IPv6 address has more than one colon, and no port
+    if (!colon || strchr(addr, ':') != colon)
+        return addr;
+    snprintf(host, size, "%.*s", (int) (colon - addr), addr);
+    return colon + 1;
+}
+
+/** Formats the local address of a socket as a listen address.
+ *
+ *  Returns: 0 on success, -1 on failure.
+ */
+static int format_sockname(int fd, char *buf, size_t size) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    char host[INET6_ADDRSTRLEN];
+
+    if (getsockname(fd, (struct sockaddr *) &ss, &len) == -1)
+        return -1;
+    switch (ss.ss_family) {
+    case AF_UNIX:
+        snprintf(buf, size, "%s", ((struct sockaddr_un *) &ss)->sun_path);
+        return 0;
+    case AF_INET:
+        inet_ntop(AF_INET, get_in_addr((struct sockaddr *) &ss), host, sizeof(host));
+        snprintf(buf, size, "%s:%d", host, ntohs(((struct sockaddr_in *) &ss)->sin_port));
+        return 0;
+    case AF_INET6:
+        inet_ntop(AF_INET6, get_in_addr((struct sockaddr *) &ss), host, sizeof(host));
+        snprintf(buf, size, "[%s]:%d", host, ntohs(((struct sockaddr_in6 *) &ss)->sin6_port));
+        return 0;
+    }
+    return -1;
+}
+
+/** Checks whether a listening socket is bound to the address of a
+ *  listener specification: to its path, or to its port, and to its host
+ *  unless the address has none.
+ */
+static int listen_matches(int fd, const char *spec) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    struct addrinfo hints, *res, *p;
+    char host[NI_MAXHOST], addr[CONFIG_MAX_ADDRESS];
+    const char *port;
+    int match = 0;
+
+    if (config_parse_listen(spec, NULL, addr, NULL) < 0 ||
+        getsockname(fd, (struct sockaddr *) &ss, &len) == -1)
+        return 0;
+    port = split_listen(addr, host, sizeof(host));
+    if (ss.ss_family == AF_UNIX)
+        return !strcmp(((struct sockaddr_un *) &ss)->sun_path, addr);
+    if (ss.ss_family != AF_INET && ss.ss_family != AF_INET6)
+        return 0;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0)
+        return 0;
+    for (p = res; p && !match; p = p->ai_next) {
+        if (p->ai_family != ss.ss_family)
+            continue;
+        if (ss.ss_family == AF_INET)
+            match = ((struct sockaddr_in *) p->ai_addr)->sin_port ==
+                    ((struct sockaddr_in *) &ss)->sin_port &&
+                    (!host[0] || !memcmp(get_in_addr(p->ai_addr), get_in_addr((struct sockaddr *) &ss),
+                                         sizeof(struct in_addr)));
+        else
+            match = ((struct sockaddr_in6 *) p->ai_addr)->sin6_port ==
+                    ((struct sockaddr_in6 *) &ss)->sin6_port &&
+                    (!host[0] || !memcmp(get_in_addr(p->ai_addr), get_in_addr((struct sockaddr *) &ss),
+                                         sizeof(struct in6_addr)));
+    }
+    freeaddrinfo(res);
+    return match;
+}
+
+/** Sets the socket options of a listener on a TCP socket, before it
+ *  listens; the clients it accepts inherit them. Buffer sizes default
+ *  to config.socket_buffer.
+ *
+ *  Returns: 0 on success, -1 if an option could not be set (reported
+ *           on stderr).
+ */
+int server_socket_options(int fd, const Listen_options *opts) {
+    int rcvbuf = opts->rcvbuf ? opts->rcvbuf : config.socket_buffer;
+    int sndbuf = opts->sndbuf ? opts->sndbuf : config.socket_buffer;
+    int yes = 1, rv = 0;
+
+    if (opts->nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1)
+        rv = -1;
+    // Only takes effect with the server bit of net.ipv4.tcp_fastopen set
+    if (opts->fastopen > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopen, sizeof(int)) == -1)
+        rv = -1;
+    if (rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int)) == -1)
+        rv = -1;
+    if (sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int)) == -1)
+        rv = -1;
+    if (opts->keepidle > 0 &&
+        (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) == -1 ||
+         setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &opts->keepidle, sizeof(int)) == -1 ||
+         (opts->keepintvl > 0 &&
+          setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &opts->keepintvl, sizeof(int)) == -1) ||
+         (opts->keepcnt > 0 &&
+          setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &opts->keepcnt, sizeof(int)) == -1)))
+        rv = -1;
+    if (rv < 0)
+        perror("server: setsockopt");
+    return rv;
+}
+
+/** Creates a listening Unix socket, replacing a stale one left by a
+ *  previous server. Exits if the path cannot be bound.
+ */
+static int open_unix_listener(const char *path, Listener_kind kind) {
+
+    struct sockaddr_un sun;
+    struct stat st;
+    int sockfd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "server: %s: path too long\n", path);
+        exit(1);
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        bind(sockfd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+        perror(path);
+        exit(1);
+    }
+    // The admin socket is for the server's owner only
+    if (kind == Listen_admin)
+        chmod(path, 0600);
+    if (listen(sockfd, config.backlog) == -1) {
+        perror("listen");
+        exit(1);
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    return sockfd;
+}
+
+/** Creates a listening socket for one listener specification. Exits if
+ *  the address cannot be bound.
+ *
+ *  Returns: the socket, which is nonblocking: with several listeners,
+ *           or several processes accepting from the same one, a client
+ *           may be gone by the time accept() is called.
+ */
+static int open_listener(const char *spec) {
+
     int sockfd; // fd used for listening connections
-    int new_fd; // fd used to transfer data to/from an accepted connection
     struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr; // connector's address information
-    socklen_t sin_size;
-    struct sigaction sa;
+    char host[NI_MAXHOST], addr[CONFIG_MAX_ADDRESS];
+    Listener_kind kind;
+    Listen_options opts;
+    const char *port;
     int yes = 1;
-    char s[INET6_ADDRSTRLEN];
     int rv;
+
+    config_parse_listen(spec, &kind, addr, &opts);
+    if (addr[0] == '/')
+        return open_unix_listener(addr, kind);
+    port = split_listen(addr, host, sizeof(host));
   
     memset(&hints, 0, sizeof hints);
     hints.ai_family   = AF_UNSPEC;   // use IPv4 or IPv6, whichever is available
@@ -104,8 +296,8 @@ void run_server(const char *port, void (*handler)(int)) {
     hints.ai_flags    = AI_PASSIVE;  // use any available connection
   
     // Gets information about available socket types and protocols
-    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    if ((rv = getaddrinfo(host[0] ? host : NULL, port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "%s: getaddrinfo: %s\n", addr, gai_strerror(rv));
         exit(1);
     }
   
@@ -133,6 +325,9 @@ void run_server(const char *port, void (*handler)(int)) {
         exit(1);
     }
 #endif
+
+        // accepted sockets inherit the options of the listener
+        server_socket_options(sockfd, &opts);
     
         // bind to the specified port number
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
@@ -150,59 +345,743 @@ void run_server(const char *port, void (*handler)(int)) {
   
     // if p is null, the loop above could not create a socket for any available address
     if (p == NULL)  {
-        fprintf(stderr, "server: failed to bind\n");
+        fprintf(stderr, "server: failed to bind %s\n", addr);
         exit(1);
     }
   
     // set up a queue of incoming connections to be received by the server
-    if (listen(sockfd, BACKLOG) == -1) {
+    if (listen(sockfd, config.backlog) == -1) {
         perror("listen");
         exit(1);
     }
-  
-    // set up a signal handler to kill zombie forked processes when they exit
-    sa.sa_handler = sigchld_handler;
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    return sockfd;
+}
+
+/** Signal handler for the signals the server acts on. SIGTERM and
+ *  SIGINT start a shutdown, and arm the alarm for its deadline. The
+ *  handler then writes to the signal pipe, which the server polls
+ *  along with its listeners.
+ */
+static void signal_handler(int s) {
+
+    int saved_errno = errno;
+    char c = 'c';
+
+    if (s == SIGUSR2) {
+        c = 'u';
+    } else if (s == SIGTERM || s == SIGINT) {
+        c = 't';
+        if (stop_state == Server_running) {
+            stop_state = config.shutdown_timeout > 0 ? Server_stopping : Server_deadline;
+            alarm(config.shutdown_timeout);
+            // Refuse new clients at once, even while the last sessions
+            // of the iterative engine or of prefork workers still hold
+            // the listening sockets
+            for (int i = 0; i < nstop_listeners; i++)
+                shutdown(stop_listeners[i], SHUT_RDWR);
+        }
+    } else if (s == SIGALRM) {
+        c = 't';
+        stop_state = Server_deadline;
+    }
+    if (signal_pipe[1] >= 0 && write(signal_pipe[1], &c, 1) < 0) {
+        /* the pipe is full: already signalled */
+    }
+    errno = saved_errno;
+}
+
+/** Creates the signal pipe of this process and starts routing signals
+ *  to it: SIGUSR2, SIGTERM, SIGINT, SIGALRM and, if wanted, SIGCHLD.
+ *  The signals that stop the server are not restarted, so that they
+ *  interrupt a session waiting for its client.
+ */
+static void setup_signals(int chld) {
+
+    struct sigaction sa;
+    sigset_t set;
+
+    if (pipe(signal_pipe) == -1 ||
+        fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK) == -1 || fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(signal_pipe[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(signal_pipe[1], F_SETFD, FD_CLOEXEC) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    sa.sa_handler = signal_handler;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+    if (sigaction(SIGUSR2, &sa, NULL) == -1 || (chld && sigaction(SIGCHLD, &sa, NULL) == -1)) {
         perror("sigaction");
         exit(1);
     }
-  
-    dlog("server: waiting for connections...\n");
-  
+    sa.sa_flags = 0;
+    if (sigaction(SIGTERM, &sa, NULL) == -1 || sigaction(SIGINT, &sa, NULL) == -1 ||
+        sigaction(SIGALRM, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+
+    // Only the thread that runs the server takes these signals (see
+    // server_block_signals)
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+}
+
+/** Reads the pending signals from the signal pipe.
+ *
+ *  Returns: the EVENT_ flags of the signals.
+ */
+static int read_signals(void) {
+
+    char buf[64];
+    ssize_t n;
+    int events = 0;
+
+    while ((n = read(signal_pipe[0], buf, sizeof(buf))) > 0)
+        for (ssize_t i = 0; i < n; i++)
+            events |= buf[i] == 'u' ? EVENT_UPGRADE : buf[i] == 't' ? EVENT_STOP : EVENT_CHILD;
+    if (stop_state != Server_running)
+        events |= EVENT_STOP;
+    return events;
+}
+
+/** Reaps the session processes of the fork engine that have exited. */
+static void reap_children(void) {
+
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        for (int i = 0; i < nchildren; i++)
+            if (children[i] == pid) {
+                children[i] = children[--nchildren];
+                break;
+            }
+}
+
+/** Waits for the session processes of the fork engine to finish; on a
+ *  shutdown, they are told to finish first.
+ */
+static void drain_children(int stopping) {
+
+    struct pollfd pfd = { signal_pipe[0], POLLIN, 0 };
+    int told = 0;
+
+    for (;;) {
+        reap_children();
+        if (stopping && !told) {
+            for (int i = 0; i < nchildren; i++)
+                kill(children[i], SIGTERM);
+            told = 1;
+        }
+        if (nchildren == 0)
+            return;
+        if (poll(&pfd, 1, 1000) > 0 && (read_signals() & EVENT_STOP))
+            stopping = 1;
+    }
+}
+
+/** Logs a new client, formatting its address only if it is logged. */
+static void log_connection(int fd) {
+    char s[INET6_ADDRSTRLEN];
+
+    if (be_verbose) {
+        stats_peer_address(fd, s);
+        dlog("server: got connection from %s\n", s);
+    }
+}
+
+/** Accepts clients from the listening sockets, handling each one in
+ *  this process or, with the fork engine, in a new process. Returns
+ *  when an upgrade or a shutdown is requested.
+ *
+ *  Returns: EVENT_UPGRADE or EVENT_STOP.
+ */
+static int serve(const int listeners[], int nlisteners, void (*handler)(int, Listener_kind, const Listen_options *)) {
+
+    int new_fd; // fd used to transfer data to/from an accepted connection
+    struct pollfd pfds[CONFIG_MAX_LISTEN + 2];
+    sigset_t usr2;
+    // An engine running sessions in this process takes one client at a
+    // time, leaving the others to idle processes of the pool
+    int batch = config.engine == Engine_fork ? ACCEPT_BATCH : 1;
+
+    for (int i = 0; i < nlisteners; i++) {
+        pfds[i].fd = listeners[i];
+        pfds[i].events = POLLIN;
+    }
+    pfds[nlisteners].fd = signal_pipe[0];
+    pfds[nlisteners].events = POLLIN;
+    pfds[nlisteners + 1].fd = admission_wake_fd();
+    pfds[nlisteners + 1].events = POLLIN;
+    sigemptyset(&usr2);
+    sigaddset(&usr2, SIGUSR2);
+
     while(1) {
-        // wait for new client to connect
-        sin_size = sizeof(their_addr);
-        new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
-        if (new_fd == -1) {
-            perror("accept");
+        // While storage is overloaded, leave new clients in the listen
+        // backlog rather than take on more sessions: only the signals
+        // and the end of the pause are waited for
+        int pause_ms = admission_pause_ms();
+        for (int i = 0; i < nlisteners; i++)
+            pfds[i].events = pause_ms < 0 ? POLLIN : 0;
+
+        // wait for new clients to connect
+        if (stop_state != Server_running)
+            return EVENT_STOP;
+        if (poll(pfds, nlisteners + 2, pause_ms) == -1) {
+            if (errno != EINTR)
+                perror("poll");
             continue;
         }
-    
-        inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
-                  s, sizeof(s));
-        dlog("server: got connection from %s\n", s);
-    
-        // Create a new process to handle the new client; parent process
-        // will wait for another client.
-#if defined(DOFORK)
-        if (!fork()) {
-            // this is the child process
-            close(sockfd); // child doesn't need the listener, close
-#endif
-            catch_segv();
-            handler(new_fd);
-            close(new_fd);
-#if defined(DOFORK)
-            exit(0);
+        if (pfds[nlisteners + 1].revents & POLLIN) {
+            char buf[64];
+            while (read(pfds[nlisteners + 1].fd, buf, sizeof(buf)) > 0)
+                ;
         }
-    
-        // Parent proceeds from here. In parent, client socket is not needed.
-        close(new_fd);
-#endif
+        if (pfds[nlisteners].revents & POLLIN) {
+            int events = read_signals();
+            if (events & EVENT_CHILD)
+                reap_children();
+            if (events & EVENT_STOP)
+                return EVENT_STOP;
+            if (events & EVENT_UPGRADE)
+                return EVENT_UPGRADE;
+        }
+
+        for (int i = 0; i < nlisteners; i++) {
+            for (int n = 0; n < batch && (pfds[i].revents & POLLIN); n++) {
+                // The client address is not needed here: the session gets it
+                // from the socket, and it is only formatted for the log
+                new_fd = accept4(pfds[i].fd, NULL, NULL, SOCK_CLOEXEC);
+                if (new_fd == -1) {
+                    // drained, or another process of the pool took the client
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        perror("accept");
+                    break;
+                }
+
+                // Create a new process to handle the new client; parent process
+                // will wait for another client.
+                if (config.engine == Engine_fork) {
+                    pid_t pid = fork();
+                    if (!pid) {
+                        // this is the child process; it doesn't need the listeners,
+                        // and an upgrade of the server does not concern it. It
+                        // still takes SIGTERM, from the server shutting down.
+                        nstop_listeners = 0;
+                        for (int j = 0; j < nlisteners; j++)
+                            close(listeners[j]);
+                        close(signal_pipe[0]);
+                        close(signal_pipe[1]);
+                        signal_pipe[1] = -1;
+                        signal(SIGUSR2, SIG_IGN);
+                        signal(SIGCHLD, SIG_DFL);
+                        log_connection(new_fd);
+                        handler(new_fd, listener_kinds[i], &listener_options[i]);
+                        close(new_fd);
+                        exit(0);
+                    }
+                    // Parent proceeds from here. In parent, client socket is not needed.
+                    if (pid > 0) {
+                        if (nchildren == children_size) {
+                            children_size = children_size ? 2 * children_size : 64;
+                            children = realloc(children, children_size * sizeof(pid_t));
+                        }
+                        children[nchildren++] = pid;
+                    }
+                    close(new_fd);
+                } else {
+                    log_connection(new_fd);
+                    // A signal arriving in the middle of the session would make
+                    // reads with a timeout fail; it is taken after the session
+                    pthread_sigmask(SIG_BLOCK, &usr2, NULL);
+                    handler(new_fd, listener_kinds[i], &listener_options[i]);
+                    close(new_fd);
+                    pthread_sigmask(SIG_UNBLOCK, &usr2, NULL);
+                }
+            }
+        }
+    }
+}
+
+/** poll(), carrying on when interrupted by a signal. */
+static int poll_restart(struct pollfd *pfds, nfds_t n, int timeout) {
+    int rv;
+
+    while ((rv = poll(pfds, n, timeout)) == -1 && errno == EINTR)
+        ;
+    return rv;
+}
+
+/** In the new server process of an upgrade: execs the server binary,
+ *  with only the handoff socket open.
+ */
+static void exec_upgrade(int sock) {
+
+    char env[16];
+    sigset_t none;
+    long max = sysconf(_SC_OPEN_MAX);
+    int fd = dup(sock); // without close-on-exec
+
+    for (int i = 3; i < max; i++)
+        if (i != fd)
+            close(i);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    snprintf(env, sizeof(env), "%d", fd);
+    setenv(SERVER_HANDOFF_ENV, env, 1);
+    execvp(upgrade_argv[0], upgrade_argv);
+    perror(upgrade_argv[0]);
+    _exit(127);
+}
+
+/** Starts a new server binary and passes it the listening sockets,
+ *  with the listen address of each, in a single SCM_RIGHTS message.
+ *
+ *  Returns: 0 once the new server is accepting clients, -1 if it could
+ *           not be started (this server then carries on).
+ */
+static int handoff(const int listeners[], int nlisteners) {
+
+    int sv[2];
+    char names[CONFIG_MAX_LISTEN * (NI_MAXHOST + 16)], ready = 0;
+    size_t len = 0;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * CONFIG_MAX_LISTEN)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct pollfd pfd;
+    pid_t pid;
+
+    if (!upgrade_argv)
+        return -1;
+    dlog("server: upgrading\n");
+    if (upgrade_hook)
+        upgrade_hook();
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        // The new server must not be a child of this one, which will
+        // wait for its own children to finish before exiting
+        if (fork() == 0)
+            exec_upgrade(sv[1]);
+        _exit(0);
     }
+    close(sv[1]);
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+
+    for (int i = 0; i < nlisteners; i++)
+        len += snprintf(names + len, sizeof(names) - len, "%s", config.listen[i]) + 1;
+    iov.iov_base = names;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nlisteners);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nlisteners);
+    memcpy(CMSG_DATA(cmsg), listeners, sizeof(int) * nlisteners);
+
+    // The new server confirms once it is serving; until then, and if it
+    // fails, this one goes on accepting
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    int nstop = nstop_listeners;
+    nstop_listeners = 0;
+    if (pid < 0 || sendmsg(sv[0], &msg, MSG_NOSIGNAL) == -1 ||
+        poll_restart(&pfd, 1, SERVER_HANDOFF_TIMEOUT * 1000) <= 0 || read(sv[0], &ready, 1) != 1) {
+        fprintf(stderr, "server: upgrade failed, still serving\n");
+        close(sv[0]);
+        nstop_listeners = nstop;
+        return -1;
+    }
+    close(sv[0]);
+    dlog("server: new server is ready, draining\n");
+    return 0;
+}
+
+/** In a new server started by handoff(): takes over the listening
+ *  sockets of the old server that have a configured listen address.
+ *
+ *  Returns: the handoff socket, to confirm on when ready, or -1 if this
+ *           server was not started by an upgrade.
+ */
+static int inherit_listeners(int listeners[]) {
+
+    const char *env = getenv(SERVER_HANDOFF_ENV);
+    char names[CONFIG_MAX_LISTEN * (NI_MAXHOST + 16)];
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * CONFIG_MAX_LISTEN)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { names, sizeof(names) - 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t len;
+    int sock;
+
+    for (int i = 0; i < CONFIG_MAX_LISTEN; i++)
+        listeners[i] = -1;
+    if (!env)
+        return -1;
+    sock = atoi(env);
+    unsetenv(SERVER_HANDOFF_ENV);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (len <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "server: no listeners handed over\n");
+        return sock;
+    }
+    names[len] = 0;
+
+    int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int fds[CONFIG_MAX_LISTEN];
+    const char *name = names;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    for (int j = 0; j < nfds; j++, name += strlen(name) + 1) {
+        int i = 0;
+        while (i < config.nlisten && (listeners[i] >= 0 || strcmp(config.listen[i], name)))
+            i++;
+        // A socket from socket activation cannot be opened again, so it
+        // is kept even though it is not configured
+        if (name < names + len && i == config.nlisten && config.nlisten < CONFIG_MAX_LISTEN &&
+            !strncmp(name, ACTIVATED_PREFIX, strlen(ACTIVATED_PREFIX)))
+            config.listen[config.nlisten++] = strdup(name);
+        if (name >= names + len || i == config.nlisten) {
+            close(fds[j]); // no longer configured
+            continue;
+        }
+        fcntl(fds[j], F_SETFD, 0);
+        listeners[i] = fds[j];
+        dlog("server: took over %s\n", name);
+    }
+    return sock;
+}
+
+/** Takes the listening sockets passed by a service manager (socket
+ *  activation, with LISTEN_PID and LISTEN_FDS), for the configured
+ *  listen addresses they are bound to. The other ones are added to the
+ *  listeners, as SMTP listeners unless their name in LISTEN_FDNAMES is
+ *  a kind of listener.
+ */
+static void activated_listeners(int listeners[]) {
+
+    const char *pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS");
+    const char *names = getenv("LISTEN_FDNAMES");
+    char name[NI_MAXHOST + 32], kind[32];
+    int n;
+
+    if (!pid || !fds || atol(pid) != getpid())
+        return;
+    n = atoi(fds);
+
+    for (int fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + n; fd++) {
+        int i = 0;
+        size_t len = names ? strcspn(names, ":") : 0;
+
+        // "kind=" if the name of the socket is one
+        snprintf(kind, sizeof(kind), "%.*s=", (int) len, names ? names : "");
+        if (!len || config_parse_listen(kind, NULL, NULL, NULL) < 0)
+            kind[0] = 0;
+        if (names)
+            names = names[len] ? names + len + 1 : NULL;
+
+        while (i < config.nlisten && (listeners[i] >= 0 || !listen_matches(fd, config.listen[i])))
+            i++;
+        if (i == config.nlisten) {
+            snprintf(name, sizeof(name), "%s%s", ACTIVATED_PREFIX, kind);
+            if (config.nlisten == CONFIG_MAX_LISTEN ||
+                format_sockname(fd, name + strlen(name), sizeof(name) - strlen(name)) < 0) {
+                close(fd);
+                continue;
+            }
+            config.listen[config.nlisten++] = strdup(name);
+        }
+        fcntl(fd, F_SETFD, 0);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        listeners[i] = fd;
+        dlog("server: activated %s\n", config.listen[i]);
+    }
+    // not for the processes this one starts
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+}
+
+/** Sends a state notification to the service manager, if there is one
+ *  (NOTIFY_SOCKET, the sd_notify() protocol).
+ */
+static void notify(const char *state) {
 
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un sun;
+    char msg[128];
+    int fd;
+
+    if (!path || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof(sun.sun_path))
+        return;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    if (path[0] == '@')
+        sun.sun_path[0] = 0;    // abstract namespace
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+        return;
+    // After an upgrade, the server has a new process id
+    snprintf(msg, sizeof(msg), "%s\nMAINPID=%d\n", state, (int) getpid());
+    if (sendto(fd, msg, strlen(msg), MSG_NOSIGNAL, (struct sockaddr *) &sun,
+               offsetof(struct sockaddr_un, sun_path) + strlen(path)) == -1)
+        perror("server: notify");
+    close(fd);
+}
+
+/** Tells whoever started the server that it is accepting clients: the
+ *  service manager, and the ready file descriptor if one is configured.
+ *  A server started by an upgrade tells the old one instead (and the
+ *  service manager, of its process id).
+ */
+static void notify_ready(int handoff_sock) {
+
+    if (handoff_sock >= 0) {
+        // tell the old server to stop accepting
+        if (write(handoff_sock, "r", 1) != 1)
+            perror("server: handoff");
+        close(handoff_sock);
+    } else if (config.ready_fd >= 0) {
+        if (write(config.ready_fd, "READY=1\n", 8) != 8)
+            perror("server: ready_fd");
+        close(config.ready_fd);
+    }
+    config.ready_fd = -1;
+    notify("READY=1");
+}
+
+/** Returns 1 if the server will be passed its listening sockets, by
+ *  socket activation or by the server it upgrades; it then needs no
+ *  configured listen address.
+ */
+int server_inherits_listeners(void) {
+    const char *pid = getenv("LISTEN_PID");
+
+    return getenv(SERVER_HANDOFF_ENV) || (pid && getenv("LISTEN_FDS") && atol(pid) == getpid());
+}
+
+/** Runs the prefork engine: keeps config.workers processes serving
+ *  clients, replacing any that exits. On an upgrade, the workers are
+ *  told to stop accepting, and the engine exits once they all have
+ *  finished their sessions. On a shutdown, the workers are told to
+ *  stop, and the engine returns once they all have exited.
+ */
+static void prefork(const int listeners[], int nlisteners, void (*handler)(int, Listener_kind, const Listen_options *)) {
+
+    pid_t *workers;
+
+    if (config.workers <= 0)
+        config.workers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    workers = calloc(config.workers, sizeof(pid_t));
+    int running = 0, draining = 0;
+    pid_t pid;
+
+    for (;;) {
+        for (int i = 0; i < config.workers && !draining; i++) {
+            if (workers[i] > 0)
+                continue;
+            pid = fork();
+            if (pid == 0) {
+                // A worker stops accepting on SIGUSR2 from the engine, and
+                // shuts down on SIGTERM
+                close(signal_pipe[0]);
+                close(signal_pipe[1]);
+                signal(SIGCHLD, SIG_DFL);
+                nstop_listeners = 0;    // the engine stops them
+                setup_signals(0);
+                serve(listeners, nlisteners, handler);
+                exit(0);
+            }
+            if (pid < 0) {
+                perror("fork");
+                break;
+            }
+            workers[i] = pid;
+            running++;
+        }
+
+        struct pollfd pfd = { signal_pipe[0], POLLIN, 0 };
+        int events = poll(&pfd, 1, 1000) > 0 ? read_signals() : 0;
+
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+            for (int i = 0; i < config.workers; i++)
+                if (workers[i] == pid) {
+                    if (!draining)
+                        dlog("server: worker %d exited\n", (int) pid);
+                    workers[i] = 0;
+                    running--;
+                }
+
+        if ((events & EVENT_STOP) && draining != EVENT_STOP) {
+            if (!draining)
+                for (int i = 0; i < nlisteners; i++)
+                    close(listeners[i]);
+            draining = EVENT_STOP;
+            for (int i = 0; i < config.workers; i++)
+                if (workers[i] > 0)
+                    kill(workers[i], SIGTERM);
+        } else if ((events & EVENT_UPGRADE) && !draining && handoff(listeners, nlisteners) == 0) {
+            draining = EVENT_UPGRADE;
+            for (int i = 0; i < nlisteners; i++)
+                close(listeners[i]);
+            for (int i = 0; i < config.workers; i++)
+                if (workers[i] > 0)
+                    kill(workers[i], SIGUSR2);
+        }
+        if (draining == EVENT_UPGRADE && running == 0)
+            exit(0);
+        if (draining == EVENT_STOP && running == 0)
+            return;
+    }
+}
+
+/** Enables upgrades: on SIGUSR2, the server runs the given command
+ *  line (normally its own), hands its listening sockets to the new
+ *  server, and exits once its sessions are finished.
+ *
+ *  Parameters: argv: command line of the new server.
+ *              hook: called before the new server is started, e.g. to
+ *                    save state that it loads; may be NULL.
+ */
+void server_enable_upgrade(char *argv[], void (*hook)(void)) {
+    upgrade_argv = argv;
+    upgrade_hook = hook;
+}
+
+/** Sets what to do before the server exits on SIGTERM or SIGINT, once
+ *  all sessions are finished.
+ */
+void server_on_shutdown(void (*hook)(void)) {
+    shutdown_hook = hook;
+}
+
+/** Blocks the signals the server acts on in the calling thread, and in
+ *  the threads it creates from now on. Called before starting helper
+ *  threads, so that those signals go to the thread that runs the
+ *  server, where they interrupt a session waiting for its client.
+ */
+void server_block_signals(void) {
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGALRM);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/** Returns whether the server is shutting down: Server_stopping once a
+ *  shutdown was requested, and Server_deadline when sessions must end.
+ */
+Server_state server_state(void) {
+    return stop_state;
+}
+
+/** Creates server sockets for the listen addresses of the
+ *  configuration (or takes them over from the server being upgraded),
+ *  listens for new connections and accepts them, calling the provided
+ *  handler function for each new client. How clients are handled (in
+ *  this process, in a new forked process per client, or in a pool of
+ *  forked processes) depends on the configured engine.
+ *
+ *  Parameters: handler: Function to be called when a new connection
+ *                       is accepted. Will receive the file descriptor
+ *                       corresponding to the newly accepted connection,
+ *                       and the kind and options of the listener that
+ *                       accepted it.
+ */
+void run_server(void (*handler)(int, Listener_kind, const Listen_options *)) {
+  
+    int listeners[CONFIG_MAX_LISTEN], owned[CONFIG_MAX_LISTEN], nowned = 0;
+    int handoff_sock = inherit_listeners(listeners);
+    int event;
+  
+    activated_listeners(listeners);
+    if (config.nlisten == 0) {
+        fprintf(stderr, "server: no listening sockets\n");
+        exit(1);
+    }
+    for (int i = 0; i < config.nlisten; i++) {
+        const char *spec = config.listen[i];
+        if (listeners[i] < 0)
+            listeners[i] = open_listener(spec);
+        // Sockets from socket activation are shared with the service
+        // manager, which goes on listening on them
+        if (strncmp(spec, ACTIVATED_PREFIX, strlen(ACTIVATED_PREFIX)))
+            owned[nowned++] = listeners[i];
+        else
+            spec += strlen(ACTIVATED_PREFIX);
+        config_parse_listen(spec, &listener_kinds[i], NULL, &listener_options[i]);
+    }
+  
+    // forked processes are reaped when SIGCHLD comes through the pipe
+    stop_listeners = owned;
+    nstop_listeners = nowned;
+    setup_signals(config.engine != Engine_iterative);
+    catch_segv();
+  
+    dlog("server: waiting for connections...\n");
+    notify_ready(handoff_sock);
+  
+    if (config.engine == Engine_prefork) {
+        prefork(listeners, config.nlisten, handler);
+        event = EVENT_STOP;
+    } else {
+        while ((event = serve(listeners, config.nlisten, handler)) == EVENT_UPGRADE &&
+               handoff(listeners, config.nlisten) < 0)
+            ;
+
+        // Drain: on an upgrade, sessions in forked processes run to
+        // completion; on a shutdown, within the deadline
+        for (int i = 0; i < config.nlisten; i++)
+            close(listeners[i]);
+        drain_children(event == EVENT_STOP);
+    }
+
+    if (event == EVENT_STOP) {
+        dlog("server: shutting down\n");
+        notify("STOPPING=1");
+        // Unix sockets of this server go with it
+        for (int i = 0; i < config.nlisten; i++) {
+            char addr[CONFIG_MAX_ADDRESS];
+            if (config_parse_listen(config.listen[i], NULL, addr, NULL) == 0 && addr[0] == '/')
+                unlink(addr);
+        }
+        if (shutdown_hook)
+            shutdown_hook();
+    }
+    exit(0);
 }
 
 /** Sends a buffer of data, until all data is sent or an error is
@@ -228,6 +1107,7 @@ int send_all(int fd, char buf[], size_t size) {
     size_t rem = size;
     while (rem > 0) {
         int rv = send(fd, buf, rem, MSG_NOSIGNAL);
+        stats_note_send(rv);
         // If there was an error, interrupt sending and returns an error
         if (rv <= 0)
             return rv;
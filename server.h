@@ -10,9 +10,28 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#include "config.h"
+
 #include <stdio.h>
 
-void        run_server(const char *port, void (*handler)(int));
+// Environment variable naming the socket a new server gets its
+// listening sockets from, during an upgrade
+#define SERVER_HANDOFF_ENV "MYSMTPD_HANDOFF_FD"
+
+typedef enum server_state
+{
+    Server_running,
+    Server_stopping,    // shutting down: finish the transaction in progress
+    Server_deadline     // shutting down: end the session now
+} Server_state;
+
+void         run_server(void (*handler)(int, Listener_kind, const Listen_options *));
+void         server_enable_upgrade(char *argv[], void (*hook)(void));
+void         server_on_shutdown(void (*hook)(void));
+void         server_block_signals(void);
+int          server_inherits_listeners(void);
+int          server_socket_options(int fd, const Listen_options *opts);
+Server_state server_state(void);
 
 int         send_all(int fd, char buf[], size_t size);
 
@@ -0,0 +1,348 @@
+/* sessionbench.c
+ * In-process session benchmark. Runs handle_client() on one end of a
+ * socketpair() while a scripted client pumps recorded client input
+ * through the other end as fast as the server consumes it. With no
+ * TCP stack and no process boundary in the way, the numbers reflect
+ * the cost of parsing, state handling and storage alone, and the
+ * whole run is a single process that is easy to profile with perf.
+ *
+ * A session script is the raw byte stream sent by a client (e.g., the
+ * in.s.* inputs used by test.sh) or a session capture recorded with
+ * "mysmtpd -C dir". Without a script, a built-in session delivering a
+ * few messages to user "bench" is used.
+ *
+ * Usage: sessionbench [-n sessions] [-u users-file] [-k] [-t options] [script...]
+ *
+ *   -n sessions  number of sessions to run (default 1000); scripts are
+ *                used round-robin
+ *   -u file      users file to install in the scratch directory
+ *                (default: a file containing only "bench")
+ *   -k           keep delivered mail between sessions, so mailboxes
+ *                grow during the run (by default they are emptied
+ *                after every session, outside the timed region)
+ *   -t options   run the sessions over TCP on the loopback interface
+ *                instead, through a listener with the given socket
+ *                options, as in the listen setting ("nodelay,rcvbuf=64k",
+ *                or "-" for none). This shows the cost of the TCP path
+ *                and the effect of the options, e.g. of Nagle's
+ *                algorithm on the replies to pipelined commands.
+ */
+
+#define _XOPEN_SOURCE 700
+#include "mysmtpd.h"
+#include "capture.h"
+#include "server.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_MESSAGES 4
+
+static int tcp_listener = -1;
+
+struct script {
+    char  *data;
+    size_t len;
+    int    messages;
+};
+
+static unsigned long long now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *server_thread(void *arg) {
+    int fd = *(int *) arg;
+    static const Listen_options opts;
+
+    handle_client(fd, Listen_smtp, &opts);
+    close(fd);
+    return NULL;
+}
+
+/** Counts the messages in a script, i.e., the end-of-data lines.
+ */
+static int count_messages(const char *data, size_t len) {
+    int n = 0;
+    for (size_t i = 0; i + 2 < len; i++)
+        if (data[i] == '\n' && data[i + 1] == '.' && (data[i + 2] == '\r' || data[i + 2] == '\n'))
+            n++;
+    return n;
+}
+
+static int load_script(struct script *s, const char *file) {
+    FILE *f = fopen(file, "r");
+    if (!f)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    s->len = ftell(f);
+    rewind(f);
+    s->data = malloc(s->len + 1);
+    if (fread(s->data, 1, s->len, f) != s->len) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    // For a capture, keep only the received data, in order
+    if (s->len >= 16 && !memcmp(s->data, CAPTURE_MAGIC, 8)) {
+        size_t in = 16, out = 0;
+        uint32_t len;
+        while (in + 12 <= s->len) {
+            memcpy(&len, s->data + in + 8, 4);
+            in += 12;
+            if (in + len > s->len)
+                break;
+            memmove(s->data + out, s->data + in, len);
+            in += len;
+            out += len;
+        }
+        s->len = out;
+    }
+    s->messages = count_messages(s->data, s->len);
+    return 0;
+}
+
+static void default_script(struct script *s) {
+    size_t cap = 8192;
+    s->data = malloc(cap);
+    s->len = sprintf(s->data, "EHLO sessionbench\r\n");
+    for (int i = 0; i < DEFAULT_MESSAGES; i++)
+        s->len += sprintf(s->data + s->len,
+                          "MAIL FROM:<bench@localhost>\r\n"
+                          "RCPT TO:<bench>\r\n"
+                          "DATA\r\n"
+                          "From: <bench@localhost>\r\n"
+                          "Subject: sessionbench %d\r\n"
+                          "\r\n"
+                          "The quick brown fox jumps over the lazy dog.\r\n"
+                          "..leading dot\r\n"
+                          ".\r\n", i);
+    s->len += sprintf(s->data + s->len, "QUIT\r\n");
+    s->messages = DEFAULT_MESSAGES;
+}
+
+/** Opens the loopback listener for -t, with socket options given as
+ *  in a listen setting. Returns 0 on success, -1 on failure.
+ */
+static int open_tcp_listener(const char *options) {
+    struct sockaddr_in sin = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    char spec[256];
+    Listen_options opts;
+
+    snprintf(spec, sizeof(spec), "0%s%s", strcmp(options, "-") ? "," : "",
+             strcmp(options, "-") ? options : "");
+    if (config_parse_listen(spec, NULL, NULL, &opts) < 0) {
+        fprintf(stderr, "sessionbench: invalid socket options \"%s\"\n", options);
+        return -1;
+    }
+    if ((tcp_listener = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        server_socket_options(tcp_listener, &opts) < 0 ||
+        bind(tcp_listener, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        listen(tcp_listener, 16) < 0) {
+        perror("sessionbench: listener");
+        return -1;
+    }
+    return 0;
+}
+
+/** Connects a client socket to a server socket: a socketpair, or a
+ *  loopback TCP connection with -t.
+ */
+static int connect_pair(int sv[2]) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int yes = 1;
+
+    if (tcp_listener < 0)
+        return socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    if (getsockname(tcp_listener, (struct sockaddr *) &sin, &len) < 0 ||
+        (sv[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    // The client sends as soon as it can, like smtpbench
+    setsockopt(sv[0], IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    if (connect(sv[0], (struct sockaddr *) &sin, len) < 0 ||
+        (sv[1] = accept(tcp_listener, NULL, NULL)) < 0) {
+        close(sv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+/** Runs one session: writes the whole script to the server while
+ *  draining its replies, then reads until the server closes the
+ *  connection. Returns the number of reply bytes, or -1 on error.
+ */
+static long run_session(const struct script *s) {
+    int sv[2];
+    pthread_t thread;
+    size_t sent = 0;
+    long received = 0;
+    char buf[65536];
+
+    if (connect_pair(sv) < 0)
+        return -1;
+    if (pthread_create(&thread, NULL, server_thread, &sv[1]) != 0)
+        return -1;
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+    for (;;) {
+        struct pollfd pfd = { sv[0], POLLIN | (sent < s->len ? POLLOUT : 0), 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+        if (pfd.revents & POLLOUT) {
+            ssize_t rv = send(sv[0], s->data + sent, s->len - sent, MSG_NOSIGNAL);
+            if (rv > 0)
+                sent += rv;
+            else if (rv < 0 && errno != EAGAIN)
+                sent = s->len;  // server went away; just collect replies
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t rv = recv(sv[0], buf, sizeof(buf), 0);
+            if (rv == 0 || (rv < 0 && errno != EAGAIN))
+                break;
+            if (rv > 0)
+                received += rv;
+        }
+    }
+    close(sv[0]);
+    pthread_join(thread, NULL);
+    return received;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+static int copy_file(const char *from, const char *to) {
+    char buf[8192];
+    size_t n;
+    FILE *in = fopen(from, "r"), *out;
+    if (!in)
+        return -1;
+    out = fopen(to, "w");
+    if (!out) {
+        fclose(in);
+        return -1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, n, out);
+    fclose(in);
+    return fclose(out);
+}
+
+static int cmp_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    char dir[] = "/tmp/sessionbenchXXXXXX";
+    const char *users = NULL;
+    struct script *scripts;
+    int nscripts, nsessions = 1000, keep = 0, opt, i;
+    unsigned long long *lat, wall = 0, cpu = 0;
+    unsigned long messages = 0, bytes_in = 0, bytes_out = 0;
+
+    while ((opt = getopt(argc, argv, "n:u:kt:")) != -1) {
+        switch (opt) {
+        case 'n': nsessions = atoi(optarg); break;
+        case 'u': users = optarg; break;
+        case 'k': keep = 1; break;
+        case 't':
+            if (open_tcp_listener(optarg) < 0)
+                return 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n sessions] [-u users-file] [-k] [-t options] [script...]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (nsessions < 1)
+        nsessions = 1;
+
+    nscripts = argc > optind ? argc - optind : 1;
+    scripts = calloc(nscripts, sizeof(struct script));
+    if (argc > optind) {
+        for (i = 0; i < nscripts; i++)
+            if (load_script(&scripts[i], argv[optind + i]) < 0) {
+                perror(argv[optind + i]);
+                return 1;
+            }
+    } else {
+        default_script(&scripts[0]);
+    }
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    if (users) {
+        char path[sizeof(dir) + 16];
+        snprintf(path, sizeof(path), "%s/users.txt", dir);
+        if (copy_file(users, path) < 0) {
+            perror(users);
+            return 1;
+        }
+    }
+    if (chdir(dir) < 0) {
+        perror(dir);
+        return 1;
+    }
+    if (!users) {
+        FILE *f = fopen("users.txt", "w");
+        fprintf(f, "bench bench\n");
+        fclose(f);
+    }
+
+    be_verbose = 0;
+    lat = malloc(nsessions * sizeof(*lat));
+    for (i = 0; i < nsessions; i++) {
+        const struct script *s = &scripts[i % nscripts];
+        unsigned long long c = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+        unsigned long long t = now_ns(CLOCK_MONOTONIC);
+        long rv = run_session(s);
+        lat[i] = now_ns(CLOCK_MONOTONIC) - t;
+        cpu += now_ns(CLOCK_PROCESS_CPUTIME_ID) - c;
+        wall += lat[i];
+        if (rv < 0) {
+            fprintf(stderr, "sessionbench: session %d failed\n", i);
+            return 1;
+        }
+        messages += s->messages;
+        bytes_in += s->len;
+        bytes_out += rv;
+        if (!keep)
+            nftw("mail.store", remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    qsort(lat, nsessions, sizeof(*lat), cmp_ull);
+    printf("sessions=%d messages=%lu bytes_in=%lu bytes_out=%lu\n",
+           nsessions, messages, bytes_in, bytes_out);
+    printf("wall/session=%.0fns wall/msg=%.0fns cpu/msg=%.0fns sessions/s=%.0f msgs/s=%.0f\n",
+           (double) wall / nsessions, messages ? (double) wall / messages : 0,
+           messages ? (double) cpu / messages : 0,
+           nsessions * 1e9 / wall, messages * 1e9 / wall);
+    printf("session p50=%lluns p99=%lluns max=%lluns\n",
+           lat[nsessions / 2], lat[(nsessions - 1) * 99 / 100], lat[nsessions - 1]);
+
+    chdir("/");
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
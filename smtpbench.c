@@ -0,0 +1,481 @@
+/* smtpbench.c
+ * SMTP load generator. Opens a number of concurrent connections to a
+ * server and runs a number of mail transactions on each one, then
+ * reports throughput and latency percentiles for every protocol phase.
+ *
+ * Usage: smtpbench [options] host port
+ *
+ *   -c conns     number of concurrent connections (default 1)
+ *   -n txns      transactions per connection (default 10)
+ *   -r rcpts     recipients per message (default 1)
+ *   -u users     comma-separated recipient names, used round-robin
+ *                (default "user")
+ *   -f sender    reverse-path used in MAIL FROM (default bench@localhost)
+ *   -s dist      message size distribution: fixed:N, uniform:MIN-MAX
+ *                or exp:MEAN (default fixed:1024)
+ *   -P           pipeline MAIL, RCPT and DATA/BDAT in a single write
+ *   -B           send the body with BDAT ... LAST instead of DATA
+ *   -R rate      open-loop mode: start transactions at a constant total
+ *                rate (messages per second) instead of back to back.
+ *                Transaction latency is then measured from the
+ *                scheduled start time, so queueing delay is included.
+ *   -S seed      random seed for the size distribution
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <math.h>
+
+#define MAX_REPLY 4096
+
+typedef enum phase {
+    Connect,
+    Greeting,
+    Helo,
+    Mail,
+    Rcpt,
+    Data,
+    Body,
+    Quit,
+    Transaction,
+    NumPhases
+} Phase;
+
+static const char *phase_names[NumPhases] = {
+    "connect", "greeting", "helo", "mail", "rcpt", "data", "body", "quit", "txn"
+};
+
+typedef enum size_kind { SizeFixed, SizeUniform, SizeExp } SizeKind;
+
+struct latencies {
+    unsigned long *us;
+    size_t n, cap;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    int fd;
+    unsigned int seed;
+    char reply[MAX_REPLY];
+    size_t reply_len;
+    char *cmd;          // command group of a transaction, cmd_size bytes
+    struct latencies lat[NumPhases];
+    unsigned long msgs;
+    unsigned long bytes;
+    unsigned long errors;
+};
+
+static const char *host, *port;
+static int nconns = 1, ntxns = 10, nrcpts = 1;
+static int pipelining = 0, use_bdat = 0;
+static double rate = 0;
+static const char *sender = "bench@localhost";
+static char **users;
+static int nusers;
+static size_t cmd_size;
+static SizeKind size_kind = SizeFixed;
+static long size_a = 1024, size_b = 1024;
+static struct timespec start_time;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record(struct worker *w, Phase p, double start) {
+    struct latencies *l = &w->lat[p];
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 256;
+        l->us = realloc(l->us, l->cap * sizeof(*l->us));
+    }
+    l->us[l->n++] = (unsigned long) ((now_sec() - start) * 1e6);
+}
+
+static int send_all(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t rv = send(fd, buf, size, MSG_NOSIGNAL);
+        if (rv <= 0)
+            return -1;
+        buf += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+/** Reads one complete (possibly multi-line) reply from the server and
+ *  returns its three-digit code, or -1 on error or disconnect.
+ */
+static int read_reply(struct worker *w) {
+    for (;;) {
+        char *line = w->reply, *eol;
+        // Look for the final line of the reply ("NNN " rather than "NNN-")
+        while ((eol = memchr(line, '\n', w->reply + w->reply_len - line)) != NULL) {
+            if (eol - line >= 3 && (eol - line == 3 || line[3] != '-')) {
+                int code = atoi(line);
+                size_t used = eol + 1 - w->reply;
+                memmove(w->reply, eol + 1, w->reply_len - used);
+                w->reply_len -= used;
+                return code;
+            }
+            line = eol + 1;
+        }
+        if (w->reply_len == sizeof(w->reply))
+            return -1;
+        ssize_t rv = recv(w->fd, w->reply + w->reply_len, sizeof(w->reply) - w->reply_len, 0);
+        if (rv <= 0)
+            return -1;
+        w->reply_len += rv;
+    }
+}
+
+static int expect(struct worker *w, int code) {
+    int rv = read_reply(w);
+    if (rv != code) {
+        w->errors++;
+        return -1;
+    }
+    return 0;
+}
+
+static long pick_size(struct worker *w) {
+    double u = rand_r(&w->seed) / ((double) RAND_MAX + 1);
+    switch (size_kind) {
+    case SizeUniform:
+        return size_a + (long) (u * (size_b - size_a + 1));
+    case SizeExp:
+        return (long) (-log(1 - u) * size_a) + 1;
+    default:
+        return size_a;
+    }
+}
+
+/** Builds a message body of roughly the requested size, with short
+ *  header block and 76-character lines. No line starts with '.', so
+ *  no dot-stuffing is needed. The end-of-data marker is appended
+ *  after the returned length, so DATA can send both in one write.
+ */
+static size_t build_body(char **buf, size_t *cap, long size, int worker, int txn) {
+    size_t len = 0, need = (size > 0 ? size : 0) + strlen(sender) + 64;
+    if (*cap < need) {
+        *cap = need;
+        *buf = realloc(*buf, *cap);
+    }
+    len += snprintf(*buf, *cap, "From: <%s>\r\nSubject: smtpbench %d/%d\r\n\r\n", sender, worker, txn);
+    while (len + 78 <= (size_t) size) {
+        memset(*buf + len, 'x', 76);
+        len += 76;
+        (*buf)[len++] = '\r';
+        (*buf)[len++] = '\n';
+    }
+    memcpy(*buf + len, ".\r\n", 3);
+    return len;
+}
+
+static int do_connect(struct worker *w) {
+    struct addrinfo hints, *res, *p;
+    double t = now_sec();
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    w->fd = -1;
+    for (p = res; p; p = p->ai_next) {
+        w->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (w->fd < 0)
+            continue;
+        if (connect(w->fd, p->ai_addr, p->ai_addrlen) == 0) {
+            // Every write below is a complete request, so Nagle would
+            // only add client-side delay to the measurements.
+            int yes = 1;
+            setsockopt(w->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            break;
+        }
+        close(w->fd);
+        w->fd = -1;
+    }
+    freeaddrinfo(res);
+    if (w->fd < 0)
+        return -1;
+    record(w, Connect, t);
+    w->reply_len = 0;
+
+    t = now_sec();
+    if (expect(w, 220) < 0)
+        return -1;
+    record(w, Greeting, t);
+
+    t = now_sec();
+    if (send_all(w->fd, "EHLO smtpbench\r\n", 16) < 0 || expect(w, 250) < 0)
+        return -1;
+    record(w, Helo, t);
+    return 0;
+}
+
+static int do_transaction(struct worker *w, int txn, char **body, size_t *cap) {
+    char *cmd = w->cmd;
+    size_t len, cmdlen, blen;
+    double t, ttxn = now_sec();
+    int i;
+
+    blen = build_body(body, cap, pick_size(w), w->id, txn);
+
+    // cmd_size has room for the longest command group
+    len = snprintf(cmd, cmd_size, "MAIL FROM:<%s>\r\n", sender);
+    for (i = 0; i < nrcpts; i++)
+        len += snprintf(cmd + len, cmd_size - len, "RCPT TO:<%s>\r\n",
+                        users[(txn * nrcpts + i) % nusers]);
+    if (use_bdat)
+        len += snprintf(cmd + len, cmd_size - len, "BDAT %zu LAST\r\n", blen);
+    else
+        len += snprintf(cmd + len, cmd_size - len, "DATA\r\n");
+
+    if (pipelining) {
+        // Send the whole command group at once, then collect the
+        // replies in order. With BDAT the body goes in the same burst.
+        t = now_sec();
+        if (send_all(w->fd, cmd, len) < 0)
+            return -1;
+        if (use_bdat && send_all(w->fd, *body, blen) < 0)
+            return -1;
+        if (expect(w, 250) < 0)
+            return -1;
+        record(w, Mail, t);
+        for (i = 0; i < nrcpts; i++) {
+            if (expect(w, 250) < 0)
+                return -1;
+            record(w, Rcpt, t);
+        }
+        if (use_bdat) {
+            if (expect(w, 250) < 0)
+                return -1;
+            record(w, Body, t);
+        }
+    } else {
+        char *c = cmd, *eol;
+        Phase p = Mail;
+        while ((eol = strstr(c, "\r\n")) != NULL) {
+            cmdlen = eol + 2 - c;
+            t = now_sec();
+            if (send_all(w->fd, c, cmdlen) < 0)
+                return -1;
+            if (!strncmp(c, "BDAT", 4)) {
+                if (send_all(w->fd, *body, blen) < 0 || expect(w, 250) < 0)
+                    return -1;
+                record(w, Body, t);
+            } else if (!strncmp(c, "DATA", 4)) {
+                break;
+            } else {
+                if (expect(w, 250) < 0)
+                    return -1;
+                record(w, p, t);
+                p = Rcpt;
+            }
+            c = eol + 2;
+        }
+    }
+
+    if (!use_bdat) {
+        t = now_sec();
+        if (expect(w, 354) < 0)
+            return -1;
+        record(w, Data, t);
+        t = now_sec();
+        if (send_all(w->fd, *body, blen + 3) < 0)
+            return -1;
+        if (expect(w, 250) < 0)
+            return -1;
+        record(w, Body, t);
+    }
+
+    record(w, Transaction, ttxn);
+    w->msgs++;
+    w->bytes += blen;
+    return 0;
+}
+
+static void sleep_until(double when) {
+    struct timespec ts;
+    double delay = when - now_sec();
+    if (delay <= 0)
+        return;
+    ts.tv_sec = (time_t) delay;
+    ts.tv_nsec = (long) ((delay - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    char *body = NULL;
+    size_t cap = 0;
+    double interval = rate > 0 ? nconns / rate : 0;
+    double first = start_time.tv_sec + start_time.tv_nsec / 1e9 + w->id * interval / nconns;
+    int txn;
+
+    if (do_connect(w) < 0) {
+        w->errors++;
+        return NULL;
+    }
+    w->cmd = malloc(cmd_size);
+
+    for (txn = 0; txn < ntxns; txn++) {
+        if (interval > 0) {
+            double when = first + txn * interval;
+            sleep_until(when);
+            // In open-loop mode the transaction is timed from its
+            // scheduled start, not from when it could actually start.
+            double t = when;
+            if (do_transaction(w, txn, &body, &cap) < 0)
+                break;
+            w->lat[Transaction].us[w->lat[Transaction].n - 1] =
+                (unsigned long) ((now_sec() - t) * 1e6);
+        } else if (do_transaction(w, txn, &body, &cap) < 0) {
+            break;
+        }
+    }
+
+    double t = now_sec();
+    if (send_all(w->fd, "QUIT\r\n", 6) == 0 && expect(w, 221) == 0)
+        record(w, Quit, t);
+    close(w->fd);
+    free(body);
+    free(w->cmd);
+    return NULL;
+}
+
+static int cmp_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long percentile(struct latencies *l, double p) {
+    size_t i = (size_t) (p * (l->n - 1) + 0.5);
+    return l->us[i];
+}
+
+static int parse_sizes(const char *s) {
+    if (!strncmp(s, "fixed:", 6)) {
+        size_kind = SizeFixed;
+        size_a = size_b = atol(s + 6);
+    } else if (!strncmp(s, "uniform:", 8)) {
+        size_kind = SizeUniform;
+        if (sscanf(s + 8, "%ld-%ld", &size_a, &size_b) != 2 || size_b < size_a)
+            return -1;
+    } else if (!strncmp(s, "exp:", 4)) {
+        size_kind = SizeExp;
+        size_a = size_b = atol(s + 4);
+    } else {
+        return -1;
+    }
+    return size_a > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c conns] [-n txns] [-r rcpts] [-u user,...] [-f sender]\n"
+            "       [-s fixed:N|uniform:MIN-MAX|exp:MEAN] [-P] [-B] [-R rate] [-S seed] host port\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct worker *workers;
+    struct latencies all[NumPhases];
+    unsigned long msgs = 0, bytes = 0, errors = 0;
+    char *userlist = "user";
+    unsigned int seed = 1;
+    double elapsed;
+    int opt, i, p;
+
+    while ((opt = getopt(argc, argv, "c:n:r:u:f:s:PBR:S:")) != -1) {
+        switch (opt) {
+        case 'c': nconns = atoi(optarg); break;
+        case 'n': ntxns = atoi(optarg); break;
+        case 'r': nrcpts = atoi(optarg); break;
+        case 'u': userlist = optarg; break;
+        case 'f': sender = optarg; break;
+        case 's': if (parse_sizes(optarg) < 0) usage(argv[0]); break;
+        case 'P': pipelining = 1; break;
+        case 'B': use_bdat = 1; break;
+        case 'R': rate = atof(optarg); break;
+        case 'S': seed = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || nconns < 1 || ntxns < 0 || nrcpts < 1)
+        usage(argv[0]);
+    host = argv[optind];
+    port = argv[optind + 1];
+
+    userlist = strdup(userlist);
+    users = malloc((strlen(userlist) / 2 + 1) * sizeof(char *));
+    for (char *u = strtok(userlist, ","); u; u = strtok(NULL, ","))
+        users[nusers++] = u;
+    if (!nusers)
+        usage(argv[0]);
+
+    // MAIL, RCPT per recipient, DATA or BDAT (with a 20-digit length)
+    size_t longest = 0;
+    for (i = 0; i < nusers; i++)
+        if (strlen(users[i]) > longest)
+            longest = strlen(users[i]);
+    cmd_size = strlen(sender) + 16 + nrcpts * (longest + 14) + 40;
+
+    workers = calloc(nconns, sizeof(struct worker));
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (i = 0; i < nconns; i++) {
+        workers[i].id = i;
+        workers[i].seed = seed + i;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    memset(all, 0, sizeof(all));
+    for (i = 0; i < nconns; i++) {
+        struct worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        msgs += w->msgs;
+        bytes += w->bytes;
+        errors += w->errors;
+        for (p = 0; p < NumPhases; p++) {
+            struct latencies *l = &all[p];
+            l->us = realloc(l->us, (l->n + w->lat[p].n + 1) * sizeof(*l->us));
+            memcpy(l->us + l->n, w->lat[p].us, w->lat[p].n * sizeof(*l->us));
+            l->n += w->lat[p].n;
+            free(w->lat[p].us);
+        }
+    }
+    elapsed = now_sec() - (start_time.tv_sec + start_time.tv_nsec / 1e9);
+
+    printf("connections=%d transactions=%d recipients=%d pipelining=%d bdat=%d rate=%.1f\n",
+           nconns, ntxns, nrcpts, pipelining, use_bdat, rate);
+    printf("elapsed=%.3fs msgs=%lu errors=%lu msgs/s=%.1f bytes/s=%.0f\n",
+           elapsed, msgs, errors, msgs / elapsed, bytes / elapsed);
+    printf("%-10s %8s %10s %10s %10s %10s %10s (us)\n",
+           "phase", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (p = 0; p < NumPhases; p++) {
+        struct latencies *l = &all[p];
+        if (!l->n)
+            continue;
+        qsort(l->us, l->n, sizeof(*l->us), cmp_ulong);
+        printf("%-10s %8zu %10lu %10lu %10lu %10lu %10lu\n", phase_names[p], l->n,
+               percentile(l, 0.50), percentile(l, 0.90), percentile(l, 0.99),
+               percentile(l, 0.999), l->us[l->n - 1]);
+    }
+    return errors ? 2 : 0;
+}
@@ -0,0 +1,287 @@
+/* smtpreplay.c
+ * Replays sessions recorded with "mysmtpd -C dir" against a server.
+ * Sessions are either replayed with their original pacing (both the
+ * spacing between sessions and the timing of data within a session)
+ * or as fast as possible, spread over N parallel connections.
+ *
+ * Usage: smtpreplay [-j parallel] [-F] [-x speed] [-l loops] host port capture...
+ *
+ *   -j parallel  number of sessions replayed concurrently (default 1)
+ *   -F           fast mode: ignore timestamps and send as fast as
+ *                the server accepts the data
+ *   -x speed     pacing speed-up factor, e.g. 2 replays twice as fast
+ *                as recorded (default 1)
+ *   -l loops     replay the whole set of captures this many times
+ */
+
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#define DRAIN_TIMEOUT_MS 5000
+
+struct record {
+    uint64_t offset_ns;
+    uint32_t len;
+    char    *data;
+};
+
+struct session {
+    const char    *file;
+    uint64_t       start_ns;
+    struct record *recs;
+    size_t         nrecs;
+    char          *raw;
+};
+
+static const char *host, *port;
+static struct session *sessions;
+static size_t nsessions, next_session;
+static int loops = 1, fast = 0;
+static double speed = 1;
+static uint64_t first_start_ns, replay_start_ns;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long total_sessions, total_errors;
+static unsigned long long total_sent, total_received, total_lag_ns, max_lag_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int load_capture(struct session *s, const char *file) {
+    FILE *f = fopen(file, "r");
+    long size;
+    size_t off, cap = 16;
+
+    if (!f)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    s->raw = malloc(size);
+    if (size < 16 || fread(s->raw, 1, size, f) != (size_t) size ||
+        memcmp(s->raw, CAPTURE_MAGIC, 8)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    s->file = file;
+    memcpy(&s->start_ns, s->raw + 8, 8);
+    s->recs = malloc(cap * sizeof(struct record));
+    s->nrecs = 0;
+    for (off = 16; off + 12 <= (size_t) size; ) {
+        struct record *r;
+        if (s->nrecs == cap)
+            s->recs = realloc(s->recs, (cap *= 2) * sizeof(struct record));
+        r = &s->recs[s->nrecs];
+        memcpy(&r->offset_ns, s->raw + off, 8);
+        memcpy(&r->len, s->raw + off + 8, 4);
+        off += 12;
+        if (off + r->len > (size_t) size)
+            break;  // truncated capture; replay what is complete
+        r->data = s->raw + off;
+        off += r->len;
+        s->nrecs++;
+    }
+    return 0;
+}
+
+static int cmp_session(const void *a, const void *b) {
+    const struct session *x = a, *y = b;
+    return x->start_ns < y->start_ns ? -1 : x->start_ns > y->start_ns;
+}
+
+static int connect_server(void) {
+    struct addrinfo hints, *res, *p;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    for (p = res; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/** Reads and discards server replies until the deadline (an absolute
+ *  CLOCK_MONOTONIC time, 0 meaning "whatever is available now").
+ *  Returns -1 once the server has closed the connection.
+ */
+static int drain_until(int fd, uint64_t deadline, unsigned long long *received) {
+    char buf[16384];
+    for (;;) {
+        uint64_t now = now_ns();
+        int timeout = deadline > now ? (int) ((deadline - now + 999999) / 1000000) : 0;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int rv = poll(&pfd, 1, timeout);
+        if (rv < 0 && errno != EINTR)
+            return -1;
+        if (rv <= 0) {
+            if (now_ns() >= deadline)
+                return 0;
+            continue;
+        }
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            return -1;
+        if (n > 0)
+            *received += n;
+    }
+}
+
+static int send_record(int fd, const struct record *r, unsigned long long *sent,
+                       unsigned long long *received) {
+    size_t off = 0;
+    while (off < r->len) {
+        ssize_t n = send(fd, r->data + off, r->len - off, MSG_NOSIGNAL);
+        if (n > 0) {
+            off += n;
+            *sent += n;
+        } else if (n < 0 && errno == EAGAIN) {
+            // Server is not keeping up; read its replies while waiting
+            if (drain_until(fd, now_ns() + 1000000, received) < 0)
+                return -1;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void replay(const struct session *s, uint64_t scheduled) {
+    unsigned long long sent = 0, received = 0;
+    uint64_t start = now_ns(), lag = start > scheduled ? start - scheduled : 0;
+    int fd = connect_server(), error = fd < 0;
+
+    for (size_t i = 0; !error && i < s->nrecs; i++) {
+        const struct record *r = &s->recs[i];
+        uint64_t when = fast ? 0 : start + (uint64_t) (r->offset_ns / speed);
+        if (drain_until(fd, when, &received) < 0) {
+            error = 1;
+            break;
+        }
+        error = send_record(fd, r, &sent, &received) < 0;
+    }
+    // Wait for the server to finish the session (normally after QUIT)
+    if (!error)
+        drain_until(fd, now_ns() + DRAIN_TIMEOUT_MS * 1000000ull, &received);
+    if (fd >= 0)
+        close(fd);
+
+    pthread_mutex_lock(&lock);
+    total_sessions++;
+    total_errors += error;
+    total_sent += sent;
+    total_received += received;
+    total_lag_ns += lag;
+    if (lag > max_lag_ns)
+        max_lag_ns = lag;
+    pthread_mutex_unlock(&lock);
+}
+
+static void *worker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        size_t n = next_session++;
+        pthread_mutex_unlock(&lock);
+        if (n >= nsessions * loops)
+            return NULL;
+
+        const struct session *s = &sessions[n % nsessions];
+        uint64_t scheduled = 0;
+        if (!fast) {
+            // Each loop starts where the previous one ended
+            uint64_t span = sessions[nsessions - 1].start_ns - first_start_ns;
+            uint64_t offset = (n / nsessions) * span + s->start_ns - first_start_ns;
+            scheduled = replay_start_ns + (uint64_t) (offset / speed);
+            uint64_t now = now_ns();
+            if (scheduled > now) {
+                struct timespec ts = { (scheduled - now) / 1000000000ull,
+                                       (scheduled - now) % 1000000000ull };
+                while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+                    ;
+            }
+        }
+        replay(s, scheduled ? scheduled : now_ns());
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int parallel = 1, opt, i;
+    pthread_t *threads;
+    double elapsed;
+
+    while ((opt = getopt(argc, argv, "j:Fx:l:")) != -1) {
+        switch (opt) {
+        case 'j': parallel = atoi(optarg); break;
+        case 'F': fast = 1; break;
+        case 'x': speed = atof(optarg); break;
+        case 'l': loops = atoi(optarg); break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind < 3 || parallel < 1 || speed <= 0 || loops < 1)
+        goto usage;
+    host = argv[optind];
+    port = argv[optind + 1];
+
+    nsessions = argc - optind - 2;
+    sessions = calloc(nsessions, sizeof(struct session));
+    for (i = 0; i < (int) nsessions; i++)
+        if (load_capture(&sessions[i], argv[optind + 2 + i]) < 0) {
+            fprintf(stderr, "smtpreplay: %s: not a capture file\n", argv[optind + 2 + i]);
+            return 1;
+        }
+    qsort(sessions, nsessions, sizeof(struct session), cmp_session);
+    first_start_ns = sessions[0].start_ns;
+
+    threads = calloc(parallel, sizeof(pthread_t));
+    replay_start_ns = now_ns();
+    for (i = 0; i < parallel; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+    for (i = 0; i < parallel; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = (now_ns() - replay_start_ns) / 1e9;
+
+    printf("sessions=%lu errors=%lu elapsed=%.3fs sessions/s=%.1f\n",
+           total_sessions, total_errors, elapsed, total_sessions / elapsed);
+    printf("sent=%llu received=%llu bytes/s=%.0f\n",
+           total_sent, total_received, total_sent / elapsed);
+    if (!fast)
+        printf("start lag avg=%.3fms max=%.3fms\n",
+               total_sessions ? total_lag_ns / 1e6 / total_sessions : 0, max_lag_ns / 1e6);
+    return total_errors ? 2 : 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-j parallel] [-F] [-x speed] [-l loops] host port capture...\n",
+            argv[0]);
+    return 1;
+}
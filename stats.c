@@ -0,0 +1,248 @@
+/* stats.c
+ * Per-session resource accounting. The session currently being
+ * handled by a thread is tracked through a thread-local pointer, so
+ * that the network layer (netbuffer.c, server.c) can charge recv and
+ * send calls to it without having the session passed around.
+ *
+ * Totals are aggregated per client address in a small in-process
+ * table. When the server forks a process per client (DOFORK), each
+ * child only sees its own session. Server-wide totals, for the admin
+ * dump, are kept in shared memory (stats_init) so that they cover all
+ * the processes of the server.
+ */
+
+#include "stats.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#define PEER_BUCKETS   1024
+#define MAX_PEERS      65536
+#define OTHER_PEERS    "(other)"
+
+struct peer_totals {
+    char     peer[INET6_ADDRSTRLEN];
+    uint64_t sessions;
+    uint64_t messages;
+    uint64_t cpu_ns;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t recv_calls;
+    uint64_t send_calls;
+    struct peer_totals *next;
+};
+
+struct server_totals {
+    pid_t    pid;
+    time_t   started;
+    uint64_t sessions;
+    uint64_t active;
+    uint64_t disconnects;   // sessions the client ended without QUIT
+    uint64_t messages;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t cpu_ns;
+};
+
+static __thread session_stats *current = NULL;
+static struct server_totals local_totals, *totals = &local_totals;
+static struct peer_totals *peer_table[PEER_BUCKETS];
+static int npeers = 0;
+
+static uint64_t timespec_ns(const struct timespec *ts) {
+    return (uint64_t) ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static unsigned hash_peer(const char *peer) {
+    unsigned h = 2166136261u;
+    while (*peer)
+        h = (h ^ (unsigned char) *peer++) * 16777619u;
+    return h % PEER_BUCKETS;
+}
+
+/** Returns the totals entry for a peer address, creating it if
+ *  needed. Once MAX_PEERS distinct addresses have been seen, any new
+ *  address is accounted under a single shared "(other)" entry.
+ */
+static struct peer_totals *peer_lookup(const char *peer) {
+    unsigned h = hash_peer(peer);
+    struct peer_totals *p;
+
+    for (p = peer_table[h]; p; p = p->next)
+        if (!strcmp(p->peer, peer))
+            return p;
+
+    if (npeers >= MAX_PEERS && strcmp(peer, OTHER_PEERS))
+        return peer_lookup(OTHER_PEERS);
+
+    p = calloc(1, sizeof(struct peer_totals));
+    if (!p)
+        return NULL;
+    snprintf(p->peer, sizeof(p->peer), "%s", peer);
+    p->next = peer_table[h];
+    peer_table[h] = p;
+    npeers++;
+    return p;
+}
+
+/** Formats the address of the peer of a socket: a numeric address,
+ *  "local" for a unix socket, or "unknown".
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              buf: Buffer of at least INET6_ADDRSTRLEN bytes.
+ */
+void stats_peer_address(int fd, char *buf) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    strcpy(buf, "unknown");
+    if (getpeername(fd, (struct sockaddr *) &addr, &len) == 0) {
+        if (addr.ss_family == AF_INET)
+            inet_ntop(AF_INET, &((struct sockaddr_in *) &addr)->sin_addr,
+                      buf, INET6_ADDRSTRLEN);
+        else if (addr.ss_family == AF_INET6)
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &addr)->sin6_addr,
+                      buf, INET6_ADDRSTRLEN);
+        else if (addr.ss_family == AF_UNIX)
+            strcpy(buf, "local");
+    }
+}
+
+/** Keeps the server-wide totals in memory shared with the processes
+ *  forked from now on. Called once, at startup.
+ */
+void stats_init(void) {
+    struct server_totals *shared = mmap(NULL, sizeof(struct server_totals), PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared != MAP_FAILED)
+        totals = shared;
+    totals->pid = getpid();
+    totals->started = time(NULL);
+}
+
+/** Formats the server-wide totals, one "name value" line each.
+ *
+ *  Returns: the length of the text, as snprintf().
+ */
+int stats_dump(char *buf, size_t size) {
+    return snprintf(buf, size,
+                    "pid %d\nuptime %ld\nsessions %lu\nactive %lu\ndisconnects %lu\nmessages %lu\n"
+                    "bytes_in %lu\nbytes_out %lu\ncpu_us %lu\n",
+                    (int) totals->pid, (long) (time(NULL) - totals->started),
+                    (unsigned long) __atomic_load_n(&totals->sessions, __ATOMIC_RELAXED),
+                    (unsigned long) __atomic_load_n(&totals->active, __ATOMIC_RELAXED),
+                    (unsigned long) __atomic_load_n(&totals->disconnects, __ATOMIC_RELAXED),
+                    (unsigned long) __atomic_load_n(&totals->messages, __ATOMIC_RELAXED),
+                    (unsigned long) __atomic_load_n(&totals->bytes_in, __ATOMIC_RELAXED),
+                    (unsigned long) __atomic_load_n(&totals->bytes_out, __ATOMIC_RELAXED),
+                    (unsigned long) (__atomic_load_n(&totals->cpu_ns, __ATOMIC_RELAXED) / 1000));
+}
+
+/** Starts accounting for a new client session on the calling
+ *  thread. The peer address is taken from the socket itself.
+ *
+ *  Parameters: st: Statistics object for the session.
+ *              fd: Socket file descriptor of the client.
+ */
+void stats_session_begin(session_stats *st, int fd) {
+    memset(st, 0, sizeof(*st));
+    stats_peer_address(fd, st->peer);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &st->cpu_start);
+    current = st;
+    __atomic_add_fetch(&totals->sessions, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->active, 1, __ATOMIC_RELAXED);
+}
+
+/** Stops accounting for a session, logs its resource usage and adds
+ *  it to the totals for its peer address.
+ *
+ *  Parameters: st: Statistics object for the session.
+ */
+void stats_session_end(session_stats *st) {
+    struct timespec now;
+    struct peer_totals *p;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    st->cpu_ns += timespec_ns(&now) - timespec_ns(&st->cpu_start);
+    if (current == st)
+        current = NULL;
+    __atomic_sub_fetch(&totals->active, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->disconnects, st->disconnected, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->messages, st->messages, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->bytes_in, st->bytes_in, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->bytes_out, st->bytes_out, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->cpu_ns, st->cpu_ns, __ATOMIC_RELAXED);
+
+    dlog("stats: session %s cpu=%luus in=%lu out=%lu recv=%lu send=%lu mem_hwm=%zu msgs=%u%s\n",
+         st->peer, (unsigned long) (st->cpu_ns / 1000),
+         (unsigned long) st->bytes_in, (unsigned long) st->bytes_out,
+         (unsigned long) st->recv_calls, (unsigned long) st->send_calls,
+         st->mem_high_water, st->messages, st->disconnected ? " disconnected" : "");
+
+    p = peer_lookup(st->peer);
+    if (!p)
+        return;
+    p->sessions++;
+    p->messages   += st->messages;
+    p->cpu_ns     += st->cpu_ns;
+    p->bytes_in   += st->bytes_in;
+    p->bytes_out  += st->bytes_out;
+    p->recv_calls += st->recv_calls;
+    p->send_calls += st->send_calls;
+
+    dlog("stats: peer %s sessions=%lu msgs=%lu cpu=%luus in=%lu out=%lu cpu/msg=%luus\n",
+         p->peer, (unsigned long) p->sessions, (unsigned long) p->messages,
+         (unsigned long) (p->cpu_ns / 1000),
+         (unsigned long) p->bytes_in, (unsigned long) p->bytes_out,
+         (unsigned long) (p->cpu_ns / 1000 / (p->messages ? p->messages : 1)));
+}
+
+/** Charges one recv call to the current session. Errors and
+ *  end-of-file count as calls but add no bytes.
+ */
+void stats_note_recv(long bytes) {
+    if (!current)
+        return;
+    current->recv_calls++;
+    if (bytes > 0)
+        current->bytes_in += bytes;
+}
+
+/** Charges one send call to the current session.
+ */
+void stats_note_send(long bytes) {
+    if (!current)
+        return;
+    current->send_calls++;
+    if (bytes > 0)
+        current->bytes_out += bytes;
+}
+
+/** Records the amount of memory currently held by the session, keeping
+ *  track of the largest value seen.
+ */
+void stats_note_memory(size_t bytes) {
+    if (current && bytes > current->mem_high_water)
+        current->mem_high_water = bytes;
+}
+
+/** Counts one message accepted in the current session.
+ */
+void stats_note_message(void) {
+    if (current)
+        current->messages++;
+}
+
+/** Records that the client of the session hung up or reset the
+ *  connection without ending the session with QUIT.
+ */
+void stats_note_disconnect(void) {
+    if (current)
+        current->disconnected = 1;
+}
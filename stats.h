@@ -0,0 +1,41 @@
+/* stats.h
+ * Per-session resource accounting: CPU time, bytes transferred,
+ * recv/send calls and memory high-water mark for each client
+ * connection, aggregated per client address.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef struct session_stats {
+    char            peer[INET6_ADDRSTRLEN];
+    struct timespec cpu_start;
+    uint64_t        cpu_ns;
+    uint64_t        bytes_in;
+    uint64_t        bytes_out;
+    uint64_t        recv_calls;
+    uint64_t        send_calls;
+    size_t          mem_high_water;
+    unsigned        messages;
+    int             disconnected;   // the client went away without QUIT
+} session_stats;
+
+void stats_init(void);
+int  stats_dump(char *buf, size_t size);
+void stats_peer_address(int fd, char *buf);
+void stats_session_begin(session_stats *st, int fd);
+void stats_session_end(session_stats *st);
+
+void stats_note_recv(long bytes);
+void stats_note_send(long bytes);
+void stats_note_memory(size_t bytes);
+void stats_note_message(void);
+void stats_note_disconnect(void);
+
+#endif
@@ -6,6 +6,10 @@ reset()
 }
 
 logfile=log.$$.txt
+# The server writes a line to its ready fd once it accepts clients
+readyfifo=ready.$$.fifo
+mkfifo $readyfifo
+trap 'rm -f $readyfifo' EXIT
 if [ "$1" != "" ] ; then
     pattern=in.s.$1
 else
@@ -18,11 +22,13 @@ for i in $pattern ; do
     expmailstore=$expfile.mail.store
     reset
     pkill mysmtpd
-    ./mysmtpd 5005 >& $logfile &
-    sleep 1
+    ./mysmtpd -o ready_fd=3 5005 3> $readyfifo >& $logfile &
+    pid=$!
+    read -r ready < $readyfifo
     nc localhost 5005 < $i | tr -d '\015' > $outfile
-    sleep 1
-    pkill mysmtpd
+    # SIGTERM lets the session finish storing its mail
+    kill $pid
+    wait $pid
     if diff -c $expfile $outfile ; then
 	rm -f $outfile
     fi
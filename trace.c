@@ -0,0 +1,68 @@
+/* trace.c
+ * Builds the Received: header added to each accepted message
+ * (RFC 5321, section 4.4). The header goes into a small buffer of its
+ * own, so that it can be written in front of the message with writev()
+ * instead of copying the message body behind it.
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/** Returns the current time as an RFC 5322 date, e.g.
+ *  "Sat, 17 Oct 2026 12:00:00 +0000". The formatted string is cached,
+ *  and only rebuilt when the second changes. The result is per thread
+ *  and stays valid until the next call from the same thread.
+ */
+const char *trace_date(void) {
+    static __thread time_t cached_time = -1;
+    static __thread char cached_date[64];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (now != cached_time) {
+        localtime_r(&now, &tm);
+        strftime(cached_date, sizeof(cached_date), "%a, %d %b %Y %H:%M:%S %z", &tm);
+        cached_time = now;
+    }
+    return cached_date;
+}
+
+/** Formats a Received: header, terminated by CRLF.
+ *
+ *  Parameters: buf, size: buffer receiving the header. A header that
+ *                      does not fit is truncated.
+ *              helo:   name the client gave in HELO/EHLO/LHLO.
+ *              rdns:   confirmed name of the client, or NULL.
+ *              peer:   client address.
+ *              by:     name of this host.
+ *              proto:  "SMTP" or "LMTP".
+ *              id:     queue id of the message.
+ *              rcpt:   the recipient, if there is only one; else NULL.
+ *
+ *  Returns: the length of the header in buf.
+ */
+size_t trace_received(char *buf, size_t size, const char *helo, const char *rdns,
+                      const char *peer, const char *by, const char *proto,
+                      const char *id, const char *rcpt) {
+    int n = snprintf(buf, size,
+                     "Received: from %s (%s [%s])\r\n"
+                     "\tby %s with %s id %s%s%s%s;\r\n"
+                     "\t%s\r\n",
+                     helo, rdns ? rdns : "unknown", peer, by, proto, id,
+                     rcpt ? "\r\n\tfor <" : "", rcpt ? rcpt : "", rcpt ? ">" : "",
+                     trace_date());
+
+    if (n < 0)
+        return 0;
+    if ((size_t) n >= size) {
+        // Keep the header well-formed even when truncated
+        n = size - 1;
+        if (n >= 2) {
+            buf[n - 2] = '\r';
+            buf[n - 1] = '\n';
+        }
+    }
+    return n;
+}
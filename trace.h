@@ -0,0 +1,17 @@
+/* trace.h
+ * Trace (Received:) header generation for accepted messages.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+
+#define TRACE_MAX_HEADER 4096
+
+const char *trace_date(void);
+size_t      trace_received(char *buf, size_t size, const char *helo, const char *rdns,
+                           const char *peer, const char *by, const char *proto,
+                           const char *id, const char *rcpt);
+
+#endif